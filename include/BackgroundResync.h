@@ -0,0 +1,82 @@
+/**
+ * LMNC Organ Brain - Background Resync
+ *
+ * A lost Note Off leaves a pipe stuck on, and a lost Note On leaves one silent, until panic()
+ * silences everything. The background resync clears them without a panic: while the output is
+ * idle it slowly re-sends the committed state of every pipe, a window of RESYNC_WINDOW_PIPES pipes
+ * every RESYNC_INTERVAL_MS, sliding through every rank's compass and round again. No desync can
+ * outlast one sweep.
+ *
+ * Pipes believed off get a Note Off. Pipes believed on are skipped, unless RESYNC_REASSERT_ON is
+ * defined to send them a Note On again. With pipe frames (see PipeFrames.h) the window is a whole
+ * rank, sent as a bitmap frame.
+ *
+ * At the defaults it's 120 bytes a second of MIDI, under 4% of a port, and a sweep of every pipe
+ * takes under 10 seconds.
+ */
+#ifndef BACKGROUND_RESYNC_H
+#define BACKGROUND_RESYNC_H
+
+#include "OrganConfig.h"
+
+#ifndef RESYNC_INTERVAL_MS
+#define RESYNC_INTERVAL_MS 100
+#endif
+#ifndef RESYNC_WINDOW_PIPES
+#define RESYNC_WINDOW_PIPES 4
+#endif
+
+struct ResyncCursor
+{
+  byte rank;
+  byte pitch;
+  unsigned long lastWindow; // millis() when the last window went out
+  uint32_t pipes;           // Pipes refreshed
+  uint32_t bytes;           // Bytes the refreshes took on the output ports
+  uint16_t sweeps;          // Times round every rank, saturates
+};
+
+inline void resetResyncCursor(ResyncCursor &cursor)
+{
+  cursor.rank = 0;
+  cursor.pitch = RANK_RANGES[0].lowest;
+  cursor.lastWindow = 0;
+  cursor.pipes = 0;
+  cursor.bytes = 0;
+  cursor.sweeps = 0;
+}
+
+inline boolean resyncWindowDue(const ResyncCursor &cursor, unsigned long nowMillis)
+{
+  return nowMillis - cursor.lastWindow >= RESYNC_INTERVAL_MS;
+}
+
+/**
+ * Moves the cursor to the bottom of the next rank
+ */
+inline void advanceResyncRank(ResyncCursor &cursor)
+{
+  cursor.rank = cursor.rank + 1 < RANK_COUNT ? cursor.rank + 1 : 0;
+  cursor.pitch = RANK_RANGES[cursor.rank].lowest;
+  if (cursor.rank == 0 && cursor.sweeps != 0xFFFF)
+  {
+    cursor.sweeps++;
+  }
+}
+
+/**
+ * Moves the cursor to the next pipe, on to the next rank at the top of the compass
+ */
+inline void advanceResyncPipe(ResyncCursor &cursor)
+{
+  if (cursor.pitch < RANK_RANGES[cursor.rank].highest)
+  {
+    cursor.pitch++;
+  }
+  else
+  {
+    advanceResyncRank(cursor);
+  }
+}
+
+#endif // BACKGROUND_RESYNC_H
@@ -0,0 +1,315 @@
+/**
+ * LMNC Organ Brain - Bitmap128
+ *
+ * A 128 bit note bitmap, one bit per MIDI pitch. It's a plain value type (no constructors, so
+ * `Bitmap128 state = {};` is all zeros) that replaces the bare byte[16] arrays.
+ *
+ * The word width depends on the target: 8 bit words on AVR, where the CPU only has 8 bit registers
+ * anyway, and 64 bit words everywhere else. Pitch n is always bit n % WORD_BITS of word
+ * n / WORD_BITS, so on a little-endian CPU the memory layout is the same as the old byte[16]
+ * bitmaps no matter the word width.
+ *
+ * Shifting moves every note up or down by some number of semitones. Notes that land outside of
+ * 0-127 are dropped.
+ *
+ * Iterate over the notes that are on with:
+ *   for (byte pitch : bitmap.setBits()) { ... }
+ *
+ * Must stay valid C++11, the AVR toolchain doesn't go any further.
+ */
+#ifndef BITMAP128_H
+#define BITMAP128_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdint.h>
+typedef uint8_t byte;
+#endif
+
+#ifdef __AVR__
+typedef uint8_t BitmapWord;
+#define BITMAP_POPCOUNT(word) __builtin_popcount(word)
+#define BITMAP_CTZ(word) __builtin_ctz(word)
+#else
+typedef uint64_t BitmapWord;
+#define BITMAP_POPCOUNT(word) __builtin_popcountll(word)
+#define BITMAP_CTZ(word) __builtin_ctzll(word)
+#endif
+
+#define BITMAP_BITS 128
+#define BITMAP_WORD_BITS ((byte)(sizeof(BitmapWord) * 8))
+#define BITMAP_WORD_COUNT ((byte)(BITMAP_BITS / BITMAP_WORD_BITS))
+#define BITMAP_BYTES (BITMAP_BITS / 8)
+
+struct Bitmap128
+{
+  BitmapWord words[BITMAP_WORD_COUNT];
+
+  ////////////////////////////////////////
+  // Single bits
+
+  bool get(byte index) const
+  {
+    return (words[index / BITMAP_WORD_BITS] >> (index % BITMAP_WORD_BITS)) & 1;
+  }
+
+  void set(byte index, bool val)
+  {
+    BitmapWord mask = (BitmapWord)1 << (index % BITMAP_WORD_BITS);
+    if (val)
+    {
+      words[index / BITMAP_WORD_BITS] |= mask;
+    }
+    else
+    {
+      words[index / BITMAP_WORD_BITS] &= ~mask;
+    }
+  }
+
+  ////////////////////////////////////////
+  // Bytes
+
+  /**
+   * Pitches 8 * index up to 8 * index + 7, the lowest in bit 0, whatever the word width
+   */
+  byte getByte(byte index) const
+  {
+    return (byte)(words[index * 8 / BITMAP_WORD_BITS] >> (index * 8 % BITMAP_WORD_BITS));
+  }
+
+  void setByte(byte index, byte value)
+  {
+    byte shift = index * 8 % BITMAP_WORD_BITS;
+    BitmapWord &word = words[index * 8 / BITMAP_WORD_BITS];
+    word = (word & ~((BitmapWord)0xFF << shift)) | ((BitmapWord)value << shift);
+  }
+
+  ////////////////////////////////////////
+  // Whole bitmap
+
+  void clear()
+  {
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      words[i] = 0;
+    }
+  }
+
+  bool any() const
+  {
+    BitmapWord combined = 0;
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      combined |= words[i];
+    }
+    return combined != 0;
+  }
+
+  /**
+   * Number of notes that are on
+   */
+  byte count() const
+  {
+    byte total = 0;
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      total += BITMAP_POPCOUNT(words[i]);
+    }
+    return total;
+  }
+
+  /**
+   * The lowest note that's on. Only call it if any() is true.
+   */
+  byte lowest() const
+  {
+    byte i = 0;
+    while (words[i] == 0)
+    {
+      i++;
+    }
+    return i * BITMAP_WORD_BITS + BITMAP_CTZ(words[i]);
+  }
+
+  Bitmap128 &operator|=(const Bitmap128 &other)
+  {
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      words[i] |= other.words[i];
+    }
+    return *this;
+  }
+
+  Bitmap128 &operator&=(const Bitmap128 &other)
+  {
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      words[i] &= other.words[i];
+    }
+    return *this;
+  }
+
+  Bitmap128 &operator^=(const Bitmap128 &other)
+  {
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      words[i] ^= other.words[i];
+    }
+    return *this;
+  }
+
+  /**
+   * Turn off every note that's on in other
+   */
+  Bitmap128 &andNot(const Bitmap128 &other)
+  {
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      words[i] &= ~other.words[i];
+    }
+    return *this;
+  }
+
+  /**
+   * Move every note up by `semitones`. Notes above 127 are dropped.
+   */
+  Bitmap128 &operator<<=(byte semitones)
+  {
+    byte wordShift = semitones / BITMAP_WORD_BITS;
+    byte bitShift = semitones % BITMAP_WORD_BITS;
+    for (int8_t i = BITMAP_WORD_COUNT - 1; i >= 0; i--)
+    {
+      int8_t from = i - wordShift;
+      BitmapWord word = 0;
+      if (from >= 0)
+      {
+        word = words[from] << bitShift;
+        if (bitShift != 0 && from > 0)
+        {
+          word |= words[from - 1] >> (BITMAP_WORD_BITS - bitShift);
+        }
+      }
+      words[i] = word;
+    }
+    return *this;
+  }
+
+  /**
+   * Move every note down by `semitones`. Notes below 0 are dropped.
+   */
+  Bitmap128 &operator>>=(byte semitones)
+  {
+    byte wordShift = semitones / BITMAP_WORD_BITS;
+    byte bitShift = semitones % BITMAP_WORD_BITS;
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      byte from = i + wordShift;
+      BitmapWord word = 0;
+      if (from < BITMAP_WORD_COUNT)
+      {
+        word = words[from] >> bitShift;
+        if (bitShift != 0 && from + 1 < BITMAP_WORD_COUNT)
+        {
+          word |= words[from + 1] << (BITMAP_WORD_BITS - bitShift);
+        }
+      }
+      words[i] = word;
+    }
+    return *this;
+  }
+
+  /**
+   * Turn off every note outside of from-to, with three shifts rather than a loop over the notes
+   */
+  Bitmap128 &clip(byte from, byte to)
+  {
+    *this <<= BITMAP_BITS - 1 - to;
+    *this >>= BITMAP_BITS - 1 - to + from;
+    *this <<= from;
+    return *this;
+  }
+
+  Bitmap128 operator|(const Bitmap128 &other) const { return Bitmap128(*this) |= other; }
+  Bitmap128 operator&(const Bitmap128 &other) const { return Bitmap128(*this) &= other; }
+  Bitmap128 operator^(const Bitmap128 &other) const { return Bitmap128(*this) ^= other; }
+  Bitmap128 operator<<(byte semitones) const { return Bitmap128(*this) <<= semitones; }
+  Bitmap128 operator>>(byte semitones) const { return Bitmap128(*this) >>= semitones; }
+
+  bool operator==(const Bitmap128 &other) const
+  {
+    BitmapWord difference = 0;
+    for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
+    {
+      difference |= words[i] ^ other.words[i];
+    }
+    return difference == 0;
+  }
+
+  bool operator!=(const Bitmap128 &other) const { return !(*this == other); }
+
+  ////////////////////////////////////////
+  // Set bit iteration
+
+  /**
+   * Walks the notes that are on from lowest to highest. Whole empty words are skipped, so a
+   * sparse bitmap costs about one step per word plus one per note.
+   */
+  class SetBitIterator
+  {
+  public:
+    SetBitIterator(const Bitmap128 *bitmap, byte wordIndex) : bitmap(bitmap), wordIndex(wordIndex), remaining(0)
+    {
+      if (wordIndex < BITMAP_WORD_COUNT)
+      {
+        remaining = bitmap->words[wordIndex];
+        skipEmptyWords();
+      }
+    }
+
+    byte operator*() const
+    {
+      return wordIndex * BITMAP_WORD_BITS + BITMAP_CTZ(remaining);
+    }
+
+    SetBitIterator &operator++()
+    {
+      remaining &= remaining - 1; // Clear the lowest bit
+      skipEmptyWords();
+      return *this;
+    }
+
+    bool operator!=(const SetBitIterator &other) const
+    {
+      return wordIndex != other.wordIndex || remaining != other.remaining;
+    }
+
+  private:
+    void skipEmptyWords()
+    {
+      while (remaining == 0 && ++wordIndex < BITMAP_WORD_COUNT)
+      {
+        remaining = bitmap->words[wordIndex];
+      }
+    }
+
+    const Bitmap128 *bitmap;
+    byte wordIndex;
+    BitmapWord remaining;
+  };
+
+  struct SetBits
+  {
+    const Bitmap128 *bitmap;
+    SetBitIterator begin() const { return SetBitIterator(bitmap, 0); }
+    SetBitIterator end() const { return SetBitIterator(bitmap, BITMAP_WORD_COUNT); }
+  };
+
+  SetBits setBits() const
+  {
+    SetBits bits = {this};
+    return bits;
+  }
+};
+
+#endif // BITMAP128_H
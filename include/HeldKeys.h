@@ -0,0 +1,95 @@
+/**
+ * LMNC Organ Brain - Held Keys
+ *
+ * A short list of the keys currently held on a keyboard, kept next to the keyboard's note bitmap so
+ * routing only has to look at the keys that are down instead of all 128 pitches.
+ *
+ * The list is unordered (removing a key moves the last one into its place). If more than
+ * MAX_HELD_KEYS keys are held at once the list is marked as overflowed and routing falls back to
+ * the bitmap, until enough keys are let go that it fits again.
+ *
+ * Always change a keyboard with setHeldKey() so the bitmap and the list agree.
+ *
+ * Code that walks the list and lets keys change part way through should walk it from the end and
+ * check the index against count each step: a release only moves a key from further along the list,
+ * so going backwards nothing that was held the whole time gets skipped.
+ */
+#ifndef HELD_KEYS_H
+#define HELD_KEYS_H
+
+#include "OrganConfig.h"
+#include "Bitmap128.h"
+
+struct HeldKeyList
+{
+  byte keys[MAX_HELD_KEYS];
+  byte count;
+  boolean overflowed;
+};
+
+/**
+ * Rebuilds the list from the keyboard bitmap, if it fits
+ */
+inline void rebuildHeldKeys(const Bitmap128 &keyboard, HeldKeyList &held)
+{
+  held.count = 0;
+  held.overflowed = keyboard.count() > MAX_HELD_KEYS;
+  if (held.overflowed)
+  {
+    return;
+  }
+  for (byte pitch : keyboard.setBits())
+  {
+    held.keys[held.count++] = pitch;
+  }
+}
+
+/**
+ * Press or release a key on a keyboard, keeping the bitmap and the held key list in step.
+ *
+ * @param keyboard The keyboard's note bitmap
+ * @param held The keyboard's held key list
+ * @param pitch The key
+ * @param val true for pressed, false for released
+ */
+inline void setHeldKey(Bitmap128 &keyboard, HeldKeyList &held, byte pitch, boolean val)
+{
+  if (pitch >= NOTES_SIZE || keyboard.get(pitch) == val)
+  {
+    // Repeated Note On/Off, the list already has it right
+    return;
+  }
+  keyboard.set(pitch, val);
+
+  if (held.overflowed)
+  {
+    if (!val)
+    {
+      rebuildHeldKeys(keyboard, held);
+    }
+  }
+  else if (val)
+  {
+    if (held.count < MAX_HELD_KEYS)
+    {
+      held.keys[held.count++] = pitch;
+    }
+    else
+    {
+      held.overflowed = true;
+    }
+  }
+  else
+  {
+    for (byte i = 0; i < held.count; i++)
+    {
+      if (held.keys[i] == pitch)
+      {
+        held.keys[i] = held.keys[--held.count];
+        break;
+      }
+    }
+  }
+}
+
+#endif // HELD_KEYS_H
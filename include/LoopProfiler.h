@@ -0,0 +1,164 @@
+/**
+ * Loop Profiler
+ *
+ * Scoped timing probes for the stages of loop() and the phases of calculateOutputNotes(). A probe
+ * measures how long its scope took and adds the result to a fixed-size histogram for its stage.
+ *
+ * Everything here compiles away unless ORGAN_PROFILING is defined. The production image
+ * (env:nanoatmega328) has no probes, no histograms and no timer setup. The profiling image
+ * (env:nanoatmega328_profile) gets the full per-stage distributions.
+ *
+ * Timing source:
+ *  - AVR: Timer1 running free with a /64 prescaler, so 1 tick = 4us at 16MHz. The counter is 16
+ *    bits and wraps after ~262ms, which is far longer than any stage outside of a panic.
+ *  - Host: std::chrono::steady_clock, 1 tick = 1us.
+ *
+ * Histogram buckets are powers of two: bucket 0 counts 0 tick samples, bucket n counts samples of
+ * [2^(n-1), 2^n) ticks and the last bucket counts everything bigger. Counts saturate instead of
+ * wrapping so a long profiling session never turns a hot bucket into a cold one.
+ */
+#ifndef LOOP_PROFILER_H
+#define LOOP_PROFILER_H
+
+#ifdef ORGAN_PROFILING
+
+#ifdef __AVR__
+#include <Arduino.h>
+#else
+#include <stdint.h>
+#include <chrono>
+#endif
+
+#define PROFILE_BUCKET_COUNT 16
+
+/**
+ * Every stage that can be profiled. Inner phases of calculateOutputNotes() are nested inside
+ * STAGE_CALCULATE, so their times are also part of it. The compute task runs a slice at a time,
+ * so these are per slice, and a slice that starts building is counted as building.
+ */
+enum ProfileStage
+{
+  STAGE_LOOP,
+  STAGE_CHECK_PANIC,
+  STAGE_READ_MIDI,
+  STAGE_READ_STOPS,
+  STAGE_CALCULATE,
+  STAGE_CALC_BUILD, // calculateOutputNotes(): building the new rank states
+  STAGE_CALC_DIFF,  // calculateOutputNotes(): diffing and queueing MIDI On/Off
+  STAGE_SEND_MIDI,
+  PROFILE_STAGE_COUNT
+};
+
+typedef uint16_t ProfileTicks;
+
+struct ProfileHistogram
+{
+  uint16_t buckets[PROFILE_BUCKET_COUNT];
+  ProfileTicks maxTicks;
+};
+
+// Defined once by the program using the profiler (src/main.cpp for the firmware)
+extern ProfileHistogram profileHistograms[PROFILE_STAGE_COUNT];
+
+#ifdef __AVR__
+
+/**
+ * Put Timer1 into normal mode with a /64 prescaler. The Arduino core sets it up for 8-bit phase
+ * correct PWM, which would make it count up and back down again.
+ */
+inline void profilerBegin()
+{
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11) | _BV(CS10);
+  TCNT1 = 0;
+}
+
+inline ProfileTicks profilerNow()
+{
+  return TCNT1;
+}
+
+#else
+
+inline void profilerBegin()
+{
+}
+
+inline ProfileTicks profilerNow()
+{
+  using namespace std::chrono;
+  return (ProfileTicks)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
+
+/**
+ * Adds a single sample to a stage histogram
+ */
+inline void profilerRecord(uint8_t stage, ProfileTicks ticks)
+{
+  uint8_t bucket = 0;
+  for (ProfileTicks t = ticks; t != 0 && bucket < PROFILE_BUCKET_COUNT - 1; t >>= 1)
+  {
+    bucket++;
+  }
+
+  ProfileHistogram &histogram = profileHistograms[stage];
+  if (histogram.buckets[bucket] != 0xFFFF)
+  {
+    histogram.buckets[bucket]++;
+  }
+  if (ticks > histogram.maxTicks)
+  {
+    histogram.maxTicks = ticks;
+  }
+}
+
+inline void profilerReset()
+{
+  for (uint8_t stage = 0; stage < PROFILE_STAGE_COUNT; stage++)
+  {
+    for (uint8_t bucket = 0; bucket < PROFILE_BUCKET_COUNT; bucket++)
+    {
+      profileHistograms[stage].buckets[bucket] = 0;
+    }
+    profileHistograms[stage].maxTicks = 0;
+  }
+}
+
+/**
+ * Records the time between construction and destruction against a stage. Unsigned subtraction
+ * takes care of the counter wrapping once.
+ */
+class ProfileScope
+{
+public:
+  explicit ProfileScope(uint8_t stage) : stage(stage), start(profilerNow()) {}
+  ~ProfileScope() { profilerRecord(stage, (ProfileTicks)(profilerNow() - start)); }
+
+private:
+  uint8_t stage;
+  ProfileTicks start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+#define PROFILE_BEGIN() profilerBegin()
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(stage)
+#define PROFILE_STAGE(stage, statement) \
+  do                                    \
+  {                                     \
+    PROFILE_SCOPE(stage);               \
+    statement;                          \
+  } while (0)
+
+#else // ORGAN_PROFILING
+
+#define PROFILE_BEGIN()
+#define PROFILE_SCOPE(stage)
+#define PROFILE_STAGE(stage, statement) statement
+
+#endif // ORGAN_PROFILING
+
+#endif // LOOP_PROFILER_H
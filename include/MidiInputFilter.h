@@ -0,0 +1,246 @@
+/**
+ * LMNC Organ Brain - MIDI Input Filter
+ *
+ * Digital keyboards fill the input with traffic the organ has no use for: Active Sensing every
+ * 300ms, Timing Clock 24 times a beat, aftertouch while a key is held and controller sweeps. Every
+ * byte of it used to go through a full MIDI.read() of the MIDI Library, and kept readMidi() going
+ * round for messages that were thrown away at the end.
+ *
+ * The filter sits between the serial input and the MIDI Library's parser, as the library's
+ * transport (FilteredSerialMIDI below). It looks at each byte once, and only lets through Note On
+ * and Note Off on the keyboard channels and our own SysEx. Everything else is dropped right there
+ * and counted by class, so the SysEx filter report shows how much noise the controllers send.
+ *
+ * The filter keeps track of running status the same way the parser does. A dropped status byte
+ * takes the data bytes after it down with it, so the parser never sees a data byte without the
+ * status it belongs to. Realtime bytes can turn up anywhere, even in the middle of a message, and
+ * are dropped without touching the running status.
+ */
+#ifndef MIDI_INPUT_FILTER_H
+#define MIDI_INPUT_FILTER_H
+
+#include "OrganConfig.h"
+
+#define MIDI_BAUD_RATE 31250
+#define MIDI_FILTER_NO_SYSEX 0x80 // Not a manufacturer ID, so no SysEx gets through
+
+/**
+ * What dropped messages are counted as
+ */
+enum MidiDropClass
+{
+  DROP_REALTIME,       // Timing Clock, Active Sensing, Start/Stop and the rest of 0xF8 to 0xFF
+  DROP_CONTROL_CHANGE,
+  DROP_AFTERTOUCH,     // Polyphonic and channel pressure
+  DROP_SYSEX,          // Anyone else's SysEx
+  DROP_OTHER,          // Notes on other channels, program changes, pitch bend and system common
+  MIDI_DROP_CLASS_COUNT
+};
+
+struct MidiInputFilter
+{
+  uint16_t noteChannels; // Bit per channel (bit 0 = channel 1) whose Note On/Off get through
+  byte sysExId;          // Manufacturer ID of the SysEx that gets through, or MIDI_FILTER_NO_SYSEX
+  byte status;           // Status of the message being read, 0 when there's no running status
+  byte dataLength;       // Data bytes in each message with that status
+  byte dataCount;        // Data bytes of the current message read so far
+  boolean admitting;     // The current message goes through to the parser
+  byte admitted[2];      // Bytes let through that the parser hasn't read yet
+  byte admittedHead;
+  byte admittedCount;
+  uint32_t dropped[MIDI_DROP_CLASS_COUNT]; // Messages dropped, by MidiDropClass
+};
+
+/**
+ * The keyboard channels as a channel mask for MidiInputFilter::noteChannels
+ */
+inline uint16_t keyboardChannelMask()
+{
+  uint16_t mask = 0;
+  for (byte keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    mask |= 1 << (KEYBOARD_CHANNELS[keyboard] - 1);
+  }
+  return mask;
+}
+
+inline void resetMidiInputFilter(MidiInputFilter &filter, uint16_t noteChannels, byte sysExId)
+{
+  filter.noteChannels = noteChannels;
+  filter.sysExId = sysExId;
+  filter.status = 0;
+  filter.dataLength = 0;
+  filter.dataCount = 0;
+  filter.admitting = false;
+  filter.admittedHead = 0;
+  filter.admittedCount = 0;
+  for (byte i = 0; i < MIDI_DROP_CLASS_COUNT; i++)
+  {
+    filter.dropped[i] = 0;
+  }
+}
+
+inline void admitMidiByte(MidiInputFilter &filter, byte value)
+{
+  filter.admitted[filter.admittedHead + filter.admittedCount++] = value;
+}
+
+inline MidiDropClass channelDropClass(byte status)
+{
+  switch (status & 0xF0)
+  {
+  case 0xB0:
+    return DROP_CONTROL_CHANGE;
+  case 0xA0:
+  case 0xD0:
+    return DROP_AFTERTOUCH;
+  default:
+    return DROP_OTHER;
+  }
+}
+
+/**
+ * Feed one byte from the serial input through the filter. Whatever gets through is added to
+ * filter.admitted for the parser. Only call it once the parser has read everything admitted before.
+ */
+inline void filterMidiByte(MidiInputFilter &filter, byte value)
+{
+  filter.admittedHead = 0;
+  if (value >= 0xF8)
+  {
+    // Realtime, which never changes the running status
+    filter.dropped[DROP_REALTIME]++;
+  }
+  else if (value == 0xF7)
+  {
+    // End of SysEx, which only means something after a SysEx that got through
+    if (filter.status == 0xF0 && filter.admitting)
+    {
+      admitMidiByte(filter, value);
+    }
+    filter.status = 0;
+    filter.admitting = false;
+  }
+  else if (value == 0xF0)
+  {
+    // Held back until the manufacturer ID says whose it is
+    filter.status = value;
+    filter.dataCount = 0;
+    filter.admitting = false;
+  }
+  else if (value > 0xF0)
+  {
+    // System common, which cancels the running status. Its data bytes are dropped along with any
+    // other data bytes until the next status.
+    filter.dropped[DROP_OTHER]++;
+    filter.status = value;
+    filter.admitting = false;
+  }
+  else if (value >= 0x80)
+  {
+    byte type = value & 0xF0;
+    filter.status = value;
+    filter.dataLength = type == 0xC0 || type == 0xD0 ? 1 : 2;
+    filter.dataCount = 0;
+    filter.admitting = (type == 0x80 || type == 0x90) && ((filter.noteChannels >> (value & 0x0F)) & 1);
+    if (filter.admitting)
+    {
+      admitMidiByte(filter, value);
+    }
+    else
+    {
+      filter.dropped[channelDropClass(value)]++;
+    }
+  }
+  else if (filter.status == 0xF0)
+  {
+    if (filter.dataCount == 0)
+    {
+      filter.dataCount = 1;
+      filter.admitting = value == filter.sysExId;
+      if (filter.admitting)
+      {
+        admitMidiByte(filter, 0xF0);
+      }
+      else
+      {
+        filter.dropped[DROP_SYSEX]++;
+      }
+    }
+    if (filter.admitting)
+    {
+      admitMidiByte(filter, value);
+    }
+  }
+  else if (filter.status >= 0x80 && filter.status < 0xF0)
+  {
+    if (filter.dataCount == filter.dataLength)
+    {
+      // Running status, so this starts another message with the same status
+      filter.dataCount = 0;
+      if (!filter.admitting)
+      {
+        filter.dropped[channelDropClass(filter.status)]++;
+      }
+    }
+    filter.dataCount++;
+    if (filter.admitting)
+    {
+      admitMidiByte(filter, value);
+    }
+  }
+  // Otherwise it's a data byte without a status, which the parser would ignore anyway
+}
+
+/**
+ * Take the next admitted byte. Only call it when filter.admittedCount isn't 0.
+ */
+inline byte takeAdmittedMidiByte(MidiInputFilter &filter)
+{
+  filter.admittedCount--;
+  return filter.admitted[filter.admittedHead++];
+}
+
+/**
+ * A transport for the MIDI Library (in place of its SerialMIDI) that runs the input through a
+ * MidiInputFilter. Sending goes straight to the serial port.
+ */
+template <class SerialPort>
+struct FilteredSerialMIDI
+{
+  static const bool thruActivated = false; // Thru is always off, the pipes aren't on our input
+
+  SerialPort &serial;
+  MidiInputFilter filter;
+
+  FilteredSerialMIDI(SerialPort &serial) : serial(serial)
+  {
+    resetMidiInputFilter(filter, 0, MIDI_FILTER_NO_SYSEX);
+  }
+
+  void begin() { serial.begin(MIDI_BAUD_RATE); }
+
+  template <typename MidiType>
+  bool beginTransmission(MidiType) { return true; }
+
+  void write(byte value) { serial.write(value); }
+
+  void endTransmission() {}
+
+  /**
+   * Drops everything in the serial input buffer up to the next byte that gets through, so the
+   * parser is only ever called for bytes it has to see
+   */
+  unsigned available()
+  {
+    while (filter.admittedCount == 0 && serial.available() > 0)
+    {
+      filterMidiByte(filter, serial.read());
+    }
+    return filter.admittedCount;
+  }
+
+  byte read() { return takeAdmittedMidiByte(filter); }
+};
+
+#endif // MIDI_INPUT_FILTER_H
@@ -0,0 +1,181 @@
+/**
+ * LMNC Organ Brain - Onset Scheduler
+ *
+ * A big chord on a full registration starts hundreds of pipes within a few milliseconds, which
+ * starves the wind chest and makes the pipes speak unevenly. With ONSET_SCHEDULING defined, a pipe
+ * that has to turn on doesn't go straight to the output queue. It's marked pending, and the output
+ * task releases at most ONSET_CAP_PER_SLICE pending pipes per rank every ONSET_SLICE_MS, so a big
+ * chord is staggered over a few slices instead of hitting the wind all at once. Each rank releases
+ * round robin from a pitch cursor, going up from the last pipe it released and wrapping round at
+ * the top, so new low pipes can't keep a high one waiting. Note Offs are never held back. A Note Off for a pipe that's still pending just cancels it,
+ * so the pipe never speaks at all.
+ *
+ * Pending pipes are a bitmap per rank, so they take no room in the output queue. There's no room for
+ * a timestamp per pipe, so the delays are an upper bound: a pipe released now was scheduled after
+ * the cursor last went past it, which was no earlier than the start of the previous sweep round the
+ * rank. The delay is measured from there, so it stays within two sweeps of the real one however
+ * long the rank is kept busy. A rank starts over from the time of its first pipe once it empties.
+ *
+ * The release runs off millis() slices in the output task rather than a hardware timer interrupt,
+ * so it never races the output queue.
+ */
+#ifndef ONSET_SCHEDULER_H
+#define ONSET_SCHEDULER_H
+
+#include "OrganConfig.h"
+#include "Bitmap128.h"
+
+#ifndef ONSET_SLICE_MS
+#define ONSET_SLICE_MS 10
+#endif
+#ifndef ONSET_CAP_PER_SLICE
+#define ONSET_CAP_PER_SLICE 4 // Per rank, so a 20 pipe chord on one rank speaks over 50ms
+#endif
+
+struct OnsetScheduler
+{
+  Bitmap128 pending[RANK_COUNT];
+  byte cursor[RANK_COUNT];                      // Lowest pitch the next release looks from
+  unsigned long sweepStart[RANK_COUNT];         // When the cursor last wrapped round
+  unsigned long previousSweepStart[RANK_COUNT]; // When it wrapped round the time before
+  byte released[RANK_COUNT];                    // Pipes released in the current slice
+  unsigned long sliceStart;
+  uint32_t onsets;        // Pipes released
+  uint32_t delayedOnsets; // Pipes held back for a slice or more
+  uint32_t totalDelayMs;  // Added up over every released pipe, for the average
+  uint16_t worstDelayMs;  // Saturates
+};
+
+inline void clearPendingOnsets(OnsetScheduler &scheduler)
+{
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    scheduler.pending[rank].clear();
+  }
+}
+
+inline void resetOnsetScheduler(OnsetScheduler &scheduler)
+{
+  clearPendingOnsets(scheduler);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    scheduler.cursor[rank] = 0;
+    scheduler.sweepStart[rank] = 0;
+    scheduler.previousSweepStart[rank] = 0;
+    scheduler.released[rank] = 0;
+  }
+  scheduler.sliceStart = 0;
+  scheduler.onsets = 0;
+  scheduler.delayedOnsets = 0;
+  scheduler.totalDelayMs = 0;
+  scheduler.worstDelayMs = 0;
+}
+
+inline boolean onsetsPending(const OnsetScheduler &scheduler)
+{
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    if (scheduler.pending[rank].any())
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Hold a pipe back until releaseOnsets() has room for it
+ */
+inline void scheduleOnset(OnsetScheduler &scheduler, byte rank, byte pitch, unsigned long nowMillis)
+{
+  if (!scheduler.pending[rank].any())
+  {
+    scheduler.sweepStart[rank] = nowMillis;
+    scheduler.previousSweepStart[rank] = nowMillis;
+  }
+  scheduler.pending[rank].set(pitch, true);
+}
+
+/**
+ * A pipe has to turn off. If it was still waiting to start, it's just taken off the pending list.
+ *
+ * @returns true if the pipe was pending, so there's no Note Off to send
+ */
+inline boolean cancelOnset(OnsetScheduler &scheduler, byte rank, byte pitch)
+{
+  if (!scheduler.pending[rank].get(pitch))
+  {
+    return false;
+  }
+  scheduler.pending[rank].set(pitch, false);
+  return true;
+}
+
+/**
+ * The next pending pipe from the cursor up, wrapping round to the lowest one. Only call it if the
+ * rank has a pending pipe.
+ */
+inline byte nextPendingOnset(const Bitmap128 &pending, byte cursor)
+{
+  if (cursor < BITMAP_BITS)
+  {
+    Bitmap128 above = pending;
+    if (above.clip(cursor, BITMAP_BITS - 1).any())
+    {
+      return above.lowest();
+    }
+  }
+  return pending.lowest();
+}
+
+/**
+ * Release as many pending pipes as each rank's cap allows in the current slice. release(rank, pitch)
+ * sends the Note On, and returns false if there's no room for it yet.
+ */
+template <typename Release>
+inline void releaseOnsets(OnsetScheduler &scheduler, unsigned long nowMillis, Release release)
+{
+  boolean newSlice = nowMillis - scheduler.sliceStart >= ONSET_SLICE_MS;
+  if (newSlice)
+  {
+    scheduler.sliceStart = nowMillis;
+  }
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    if (newSlice)
+    {
+      scheduler.released[rank] = 0;
+    }
+    Bitmap128 &pending = scheduler.pending[rank];
+    while (pending.any() && scheduler.released[rank] < ONSET_CAP_PER_SLICE)
+    {
+      byte pitch = nextPendingOnset(pending, scheduler.cursor[rank]);
+      if (!release(rank, pitch))
+      {
+        return; // The output is full, carry on next time
+      }
+      if (pitch < scheduler.cursor[rank])
+      {
+        scheduler.previousSweepStart[rank] = scheduler.sweepStart[rank];
+        scheduler.sweepStart[rank] = nowMillis;
+      }
+      pending.set(pitch, false);
+      scheduler.cursor[rank] = pitch + 1;
+      scheduler.released[rank]++;
+
+      unsigned long delay = nowMillis - scheduler.previousSweepStart[rank];
+      scheduler.onsets++;
+      scheduler.totalDelayMs += delay;
+      if (delay >= ONSET_SLICE_MS)
+      {
+        scheduler.delayedOnsets++;
+      }
+      if (delay > scheduler.worstDelayMs)
+      {
+        scheduler.worstDelayMs = delay > 0xFFFF ? 0xFFFF : delay;
+      }
+    }
+  }
+}
+
+#endif // ONSET_SCHEDULER_H
@@ -0,0 +1,425 @@
+/**
+ * LMNC Organ Brain - Console Configuration
+ *
+ * Everything that describes the console: the MIDI channels of the keyboards and pipe ranks, the
+ * stop switch pins and how every stop and coupler routes keys to pipes.
+ *
+ * This is shared by the firmware and the host tools in tools/, so the tools always analyze the
+ * routing that's actually running in the organ. It must stay plain C++ with no Arduino
+ * dependencies beyond the types below.
+ */
+#ifndef ORGAN_CONFIG_H
+#define ORGAN_CONFIG_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <stdint.h>
+#include <string.h>
+typedef uint8_t byte;
+typedef bool boolean;
+#define PROGMEM
+#define memcpy_P memcpy
+#endif
+
+/**
+ * MIDI ON and MIDI OFF messages are up to 3 bytes each. Our Tx buffer is 64 bytes, so the output
+ * task only sends while there's room for a whole message and the rest wait in the ring buffer.
+ *
+ * The Nano has one UART, so every rank goes out through it. The Mega has four, so each rank gets a
+ * UART (and a transmit interrupt) of its own: Serial, Serial1, Serial2 and Serial3, in the order of
+ * RANK_OUTPUT_PORTS below. Each port has its own output queue, splitting RING_BUFFER_MAX_SIZE.
+ */
+#define MIDI_MESSAGE_MAX_BYTES 3
+#ifdef __AVR_ATmega2560__
+#define OUTPUT_PORT_COUNT 4
+#else
+#define OUTPUT_PORT_COUNT 1
+#endif
+#if defined(COMPACT_STATE)
+#define RING_BUFFER_MAX_SIZE (64 * OUTPUT_PORT_COUNT)
+#elif defined(__AVR_ATmega2560__)
+#define RING_BUFFER_MAX_SIZE 1024
+#else
+#define RING_BUFFER_MAX_SIZE 512
+#endif
+#define OUTPUT_QUEUE_SIZE (RING_BUFFER_MAX_SIZE / OUTPUT_PORT_COUNT)
+
+/**
+ * Define COMPACT_STATE to leave the Nano's 2 KB of SRAM to the serial buffers instead of the
+ * state: the stops are packed into bits (StopBits in OrganEngine.h) and the output queues shrink
+ * to 64 notes a port. The compute task waits for room in a queue before diffing each
+ * bitmap word, so a short queue only holds a big registration change back, it never overflows.
+ * env:nanoatmega328_compact spends the SRAM on bigger serial buffers, see platformio.ini.
+ */
+
+/**
+ * Normally all three keyboards come in merged on one MIDI input, told apart by channel. Define
+ * SEPARATE_MANUAL_INPUTS on the Mega to also take each keyboard on its own input, the receive side
+ * of Serial1 (Swell), Serial2 (Great) and Serial3 (Pedal), so no merger has to squeeze them through
+ * one 31250 baud link. Notes on a keyboard's own input play that keyboard whatever their channel.
+ */
+#ifdef SEPARATE_MANUAL_INPUTS
+#ifndef __AVR_ATmega2560__
+#error "SEPARATE_MANUAL_INPUTS needs the Mega's extra UARTs"
+#endif
+#define INPUT_PORT_COUNT 4
+#else
+#define INPUT_PORT_COUNT 1
+#endif
+
+/**
+ * Define SHIFT_REGISTER_OUTPUT on the Mega to drive the pipes from a chain of 74HC595 shift
+ * registers on the SPI bus (D51 data, D52 clock, latch below) instead of sending MIDI, see
+ * ShiftRegisterOutput.h. Every pin on the Nano is taken by a stop, so there's no room for SPI.
+ */
+#ifdef SHIFT_REGISTER_OUTPUT
+#ifndef __AVR_ATmega2560__
+#error "SHIFT_REGISTER_OUTPUT needs the Mega's free SPI pins"
+#endif
+#define SHIFT_REGISTER_LATCH_PIN 53
+#define SHIFT_REGISTER_SPI_HZ 8000000
+#endif
+
+/**
+ * Define PIPE_FRAME_OUTPUT to send each rank's changes to its output port as binary frames for
+ * pipe driver boards of our own, instead of MIDI notes, see PipeFrames.h.
+ */
+#if defined(PIPE_FRAME_OUTPUT) && defined(SHIFT_REGISTER_OUTPUT)
+#error "Pick one of PIPE_FRAME_OUTPUT and SHIFT_REGISTER_OUTPUT"
+#endif
+
+/**
+ * Define ONSET_SCHEDULING to stagger pipe starts so big chords don't starve the wind, see
+ * OnsetScheduler.h. It staggers MIDI Note Ons, so it doesn't work with the other output modes.
+ */
+#if defined(ONSET_SCHEDULING) && (defined(PIPE_FRAME_OUTPUT) || defined(SHIFT_REGISTER_OUTPUT))
+#error "ONSET_SCHEDULING only works with MIDI output"
+#endif
+
+/**
+ * Time budget for one slice of each task, see Scheduler.h. At 31250 baud the 64 byte serial input
+ * buffer takes ~20ms to fill up, and the input task runs between every other slice, so these keep
+ * it well inside that even with a few overruns.
+ */
+#define INPUT_TASK_BUDGET_MICROS 300
+#define COMPUTE_TASK_BUDGET_MICROS 1000
+#define OUTPUT_TASK_BUDGET_MICROS 300
+
+/**
+ * The compute task also yields after diffing this many bytes of the rank banks, however much of its
+ * budget is left. Every byte can queue up to 8 pipe changes, so this bounds a diff slice by work
+ * as well as by the clock, and a big registration change is spread evenly over the loop passes.
+ */
+#define DIFF_BYTES_PER_SLICE 8
+
+/**
+ * Note Constants
+ */
+#define OCTAVE 12
+#define TWO_OCTAVE 24
+#define TWELFTH 31 // 2 Octaves + 7
+
+// Coupler pitches, as the transposition of the coupled keys
+#define COUPLER_16_FOOT (-OCTAVE) // Sub octave
+#define COUPLER_8_FOOT 0          // Unison
+#define COUPLER_4_FOOT OCTAVE     // Super octave
+#define DEFAULT_OUTPUT_VELOCITY 100
+
+#define NOTES_SIZE 128
+#define NOTES_BITMAP_ARRAY_SIZE 16 // NOTES_SIZE / 8
+#define MAX_HELD_KEYS 24           // Per keyboard, see HeldKeys.h
+
+/**
+ * MIDI Channels
+ */
+#define SwellChannel 3 // swell keyboard midi input
+#define GreatChannel 2 // Great keyboard midi input
+#define PedalChannel 1 // Pedal keyboard midi input
+
+/**
+ * Output Channels
+ */
+#define PrincipalPipesChannel 13
+#define StringPipesChannel 14
+#define FlutePipesChannel 15
+#define ReedPipesChannel 16
+
+// Organ Stop Switch Pins
+
+/**
+ * Swell Stop Switches
+ */
+#define SwellOpenDiapason8_PIN_7 7    // Swell Stop Open Diapason 8
+#define SwellStoppedDiapason8_PIN_6 6 // Swell Stop Stopped Diapason 8
+#define SwellPrincipal4_PIN_5 5       // Swell Stop Principal 4
+#define SwellFlute4_PIN_4 4           // Swell Stop Principal 4
+#define SwellFifteenth2_PIN_3 3       // Swell Stop Fifteenth 2
+#define SwellTwelfth22thirds_PIN_2 2  // Swell Stop twelfth 2 2/3
+
+/**
+ * Great Stop Switches
+ */
+#define GreatOpenDiapason8_PIN_15 15  // Great Stop Open Diapason 8
+#define GreatLieblich8_PIN_14 14      // Great Stop Lieblich 8
+#define GreatSalicional8_PIN_13 13    // Great Stop Salicional 8 NEED TO REMOVE ARDUINO LED TO MAKE THIS WORK
+#define GreatGemsHorn4_PIN_12 12      // Great Stop GemsHorn 4 dont know yet
+#define GreatSalicet4_PIN_11 11       // Great Stop Salicet 4
+#define GreatNazard22thirds_PIN_10 10 // Great Stop Nazard 2 2/3
+#define GreatHorn8_PIN_9 9            // Great Stop Horn 8
+#define GreatClarion4_PIN_8 8         // Great Stop Clarion 4
+
+/**
+ * Pedal Stop Switches
+ */
+#define PedalBassFlute8_PIN_20 20 // Pedal BassFlute 8. Need to analogRead this pin
+#define PedalBourdon16_PIN_19 19  // Pedal Bourdon 16
+
+/**
+ *
+ * Coupler Stops
+ *
+ * From: https://www.ibiblio.org/pipeorgan/Pages/Console.html
+ *
+ * "For example, the Great to Pedal coupler means that stops that stops in the Great division will now
+ * be controlled by the pedal board. This is especially useful on organs that only have 16' and 8'
+ * pedal stops. However, the stops on the Great will still sound if keys on the Great manual are played."
+ *
+ * Couplers can also connect manuals at a specific range. For example, a Swell to Great 4' means that all the
+ * stops currently playing in the Swell will be copied to the Great manual an octave higher than their regular
+ * pitch on the Swell. So, an 8' flute in the Swell will sound at 8' pitch on the swell but at 4' pitch on the
+ * great. Common ranges of these types of couplers are 16', and 4'. While this type of coupler is helpful, it
+ * is not a necessary part of the organ so you may find organs which do not have them.
+ *
+ */
+#define SwellToGreat_PIN_18 18 // Send the Swell Stops to the Great Keyboard (Great Plays Swell and Great Stops)
+#define SwellToPedal_PIN_17 17 // Send the Swell Stops to the Pedal Keyboard (Pedal Plays Swell and Pedal Stops)
+#define GreatToPedal_PIN_16 16 // Send the Great Stops to the Pedal Keyboard (Pedal Plays Great and Pedal Stops)
+                               // Note: If Both the SwellToPedal and GreatToPedal are enabled, The pedals play All Stops
+
+#define PanicButton_PIN_21 21 // Pin D21/A7 is analog input only
+
+// StopSwitchStates is indexed by pin number
+#define STOP_STATES_SIZE 21
+
+/**
+ * The pin numbers above are the Nano's. The Mega uses D14, D16 and D18 to send MIDI out on Serial3,
+ * Serial2 and Serial1, and has no analog input on D20 or D21, so those stops (and the panic button)
+ * are wired to other pins. They keep their Nano pin numbers everywhere else.
+ */
+inline byte stopInputPin(byte stopPin)
+{
+#ifdef __AVR_ATmega2560__
+  switch (stopPin)
+  {
+  case GreatLieblich8_PIN_14:
+    return 22;
+  case GreatToPedal_PIN_16:
+    return 23;
+  case SwellToGreat_PIN_18:
+    return 24;
+  case PedalBassFlute8_PIN_20:
+    return A6;
+  case PanicButton_PIN_21:
+    return A7;
+#ifdef SEPARATE_MANUAL_INPUTS
+  // D15, D17 and D19 are receiving the keyboards
+  case GreatOpenDiapason8_PIN_15:
+    return 25;
+  case SwellToPedal_PIN_17:
+    return 26;
+  case PedalBourdon16_PIN_19:
+    return 27;
+#endif
+  }
+#endif
+  return stopPin;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Routing
+//
+
+/**
+ * Each keyboard has a division of stops with the same name. Keyboards and divisions share the
+ * same index.
+ *
+ * To add a keyboard or a rank, add it to the enum below and give it a channel and a compass in the
+ * tables that follow. Everything else is sized from DIVISION_COUNT, RANK_COUNT and STOP_STATES_SIZE.
+ */
+enum Division
+{
+  SWELL,
+  GREAT,
+  PEDAL,
+  DIVISION_COUNT
+};
+
+/**
+ * Pipe ranks, each with its own output channel
+ */
+enum Rank
+{
+  PRINCIPAL_RANK,
+  STRING_RANK,
+  FLUTE_RANK,
+  REED_RANK,
+  RANK_COUNT
+};
+
+const byte KEYBOARD_CHANNELS[DIVISION_COUNT] = {
+    SwellChannel,
+    GreatChannel,
+    PedalChannel,
+};
+
+const byte RANK_CHANNELS[RANK_COUNT] = {
+    PrincipalPipesChannel,
+    StringPipesChannel,
+    FlutePipesChannel,
+    ReedPipesChannel,
+};
+
+// Which MIDI output port each rank is sent on. Ranks can share a port.
+#ifdef __AVR_ATmega2560__
+const byte RANK_OUTPUT_PORTS[RANK_COUNT] = {0, 1, 2, 3};
+#else
+const byte RANK_OUTPUT_PORTS[RANK_COUNT] = {0, 0, 0, 0};
+#endif
+
+/**
+ * Compass of each keyboard and each rank, as MIDI pitches (both ends included). Keys outside a
+ * keyboard's compass are dropped as they come in, and pipes outside a rank's compass are never
+ * sent, so nothing has to scan past them.
+ *
+ * A rank's compass must cover every pipe its stops can reach from the keyboards, or the top of the
+ * higher-pitched stops goes missing. tools/fanout.cpp warns if they don't.
+ */
+#define SWELL_LOWEST_KEY 36  // C2, 61 note manual
+#define SWELL_HIGHEST_KEY 96 // C7
+#define GREAT_LOWEST_KEY 36  // C2, 61 note manual
+#define GREAT_HIGHEST_KEY 96 // C7
+#define PEDAL_LOWEST_KEY 36  // C2, 32 note pedalboard
+#define PEDAL_HIGHEST_KEY 67 // G4
+
+#define PRINCIPAL_LOWEST_PIPE 36
+#define PRINCIPAL_HIGHEST_PIPE 127 // Top key of the Swell Twelfth 2 2/3
+#define STRING_LOWEST_PIPE 36
+#define STRING_HIGHEST_PIPE 108 // Top key of the Great Salicet 4
+#define FLUTE_LOWEST_PIPE 36
+#define FLUTE_HIGHEST_PIPE 127 // Top key of the Great Nazard 2 2/3
+#define REED_LOWEST_PIPE 36
+#define REED_HIGHEST_PIPE 108 // Top key of the Great Clarion 4
+
+// Every pipe on every rank is between these
+#define PIPES_LOWEST_PITCH 36
+#define PIPES_HIGHEST_PITCH 127
+
+struct PitchRange
+{
+  byte lowest;
+  byte highest;
+};
+
+constexpr PitchRange KEYBOARD_RANGES[DIVISION_COUNT] = {
+    {SWELL_LOWEST_KEY, SWELL_HIGHEST_KEY},
+    {GREAT_LOWEST_KEY, GREAT_HIGHEST_KEY},
+    {PEDAL_LOWEST_KEY, PEDAL_HIGHEST_KEY},
+};
+
+constexpr PitchRange RANK_RANGES[RANK_COUNT] = {
+    {PRINCIPAL_LOWEST_PIPE, PRINCIPAL_HIGHEST_PIPE},
+    {STRING_LOWEST_PIPE, STRING_HIGHEST_PIPE},
+    {FLUTE_LOWEST_PIPE, FLUTE_HIGHEST_PIPE},
+    {REED_LOWEST_PIPE, REED_HIGHEST_PIPE},
+};
+
+static_assert(PRINCIPAL_LOWEST_PIPE >= PIPES_LOWEST_PITCH && PRINCIPAL_HIGHEST_PIPE <= PIPES_HIGHEST_PITCH &&
+                  STRING_LOWEST_PIPE >= PIPES_LOWEST_PITCH && STRING_HIGHEST_PIPE <= PIPES_HIGHEST_PITCH &&
+                  FLUTE_LOWEST_PIPE >= PIPES_LOWEST_PITCH && FLUTE_HIGHEST_PIPE <= PIPES_HIGHEST_PITCH &&
+                  REED_LOWEST_PIPE >= PIPES_LOWEST_PITCH && REED_HIGHEST_PIPE <= PIPES_HIGHEST_PITCH,
+              "PIPES_LOWEST_PITCH and PIPES_HIGHEST_PITCH must cover every rank");
+
+inline boolean inRange(const PitchRange &range, byte pitch)
+{
+  return pitch >= range.lowest && pitch <= range.highest;
+}
+
+/**
+ * When the stop on stopPin is pulled, every key pressed for the division plays the pipe
+ * `transpose` semitones higher on the rank. Notes transposed above the top of the MIDI range are
+ * dropped.
+ */
+struct StopRoute
+{
+  byte stopPin;
+  byte division;
+  byte rank;
+  byte transpose;
+};
+
+const StopRoute STOP_ROUTES[] PROGMEM = {
+    {SwellOpenDiapason8_PIN_7, SWELL, PRINCIPAL_RANK, 0},         // Swell Stop To Principal Pipes
+    {SwellStoppedDiapason8_PIN_6, SWELL, FLUTE_RANK, 0},          // Swell Stop To Flute Pipes
+    {SwellPrincipal4_PIN_5, SWELL, PRINCIPAL_RANK, OCTAVE},       // Swell Stop To Principal Pipes + 1 Octave
+    {SwellFlute4_PIN_4, SWELL, FLUTE_RANK, OCTAVE},               // Swell Stop To Flute Pipes + 1 Octave
+    {SwellFlute4_PIN_4, SWELL, FLUTE_RANK, TWO_OCTAVE},           // ... and + 2 Octave
+    {SwellFifteenth2_PIN_3, SWELL, PRINCIPAL_RANK, TWO_OCTAVE},   // Swell Stop To Principal Pipes + 2 Octave
+    {SwellTwelfth22thirds_PIN_2, SWELL, PRINCIPAL_RANK, TWELFTH}, // Swell Stop To Principal Pipes + 2 Octave + 5th
+    {GreatOpenDiapason8_PIN_15, GREAT, PRINCIPAL_RANK, 0},        // Great Stop To Principal Pipes
+    {GreatLieblich8_PIN_14, GREAT, FLUTE_RANK, 0},                // Great Stop To Flute Pipes
+    {GreatSalicional8_PIN_13, GREAT, STRING_RANK, 0},             // Great Stop To String Pipes
+    {GreatGemsHorn4_PIN_12, GREAT, PRINCIPAL_RANK, OCTAVE},       // TODO 05: Great Stop To DONT KNOW YET
+    {GreatSalicet4_PIN_11, GREAT, STRING_RANK, OCTAVE},           // TODO 06: Great Stop To DONT KNOW YET
+    {GreatNazard22thirds_PIN_10, GREAT, FLUTE_RANK, TWELFTH},     // Great Stop To Flute Rank Plus a third
+    {GreatHorn8_PIN_9, GREAT, REED_RANK, 0},                      // Great Stop To Reeds
+    {GreatClarion4_PIN_8, GREAT, REED_RANK, OCTAVE},              // Great Stop To Reeds + Octave
+    {PedalBassFlute8_PIN_20, PEDAL, PRINCIPAL_RANK, 0},           // Pedal Stop to Principal and String
+    {PedalBassFlute8_PIN_20, PEDAL, STRING_RANK, 0},              // ...
+    {PedalBourdon16_PIN_19, PEDAL, FLUTE_RANK, 0},                // Pedal Stop To Bourdon Pipes (Flute)
+};
+#define STOP_ROUTE_COUNT (sizeof(STOP_ROUTES) / sizeof(STOP_ROUTES[0]))
+
+/**
+ * When the coupler on stopPin is pulled, every key pressed on `keyboard` also plays the stops of
+ * `division`, as if the key `transpose` semitones away was pressed on that division's own keyboard.
+ * Keys that land outside of the division's keyboard compass are dropped. Couplers don't chain: the
+ * Pedal only gets the Swell through SwellToPedal, never through GreatToPedal + SwellToGreat.
+ *
+ * A coupler can couple a keyboard to its own division too, e.g. a Swell super octave would be
+ * {pin, SWELL, SWELL, COUPLER_4_FOOT}.
+ */
+struct CouplerRoute
+{
+  byte stopPin;
+  byte keyboard;
+  byte division;
+  int8_t transpose;
+};
+
+const CouplerRoute COUPLER_ROUTES[] PROGMEM = {
+    {SwellToGreat_PIN_18, GREAT, SWELL, COUPLER_8_FOOT}, // TODO 02: Unison until we know if it transposes
+    {SwellToPedal_PIN_17, PEDAL, SWELL, COUPLER_8_FOOT}, // TODO 03: Unison until we know if it transposes
+    {GreatToPedal_PIN_16, PEDAL, GREAT, COUPLER_8_FOOT}, // TODO 04: Unison until we know if it transposes
+};
+#define COUPLER_ROUTE_COUNT (sizeof(COUPLER_ROUTES) / sizeof(COUPLER_ROUTES[0]))
+
+/**
+ * The routing tables live in flash on AVR, so they need to be copied out before use
+ */
+inline StopRoute readStopRoute(byte index)
+{
+  StopRoute route;
+  memcpy_P(&route, &STOP_ROUTES[index], sizeof(StopRoute));
+  return route;
+}
+
+inline CouplerRoute readCouplerRoute(byte index, const CouplerRoute *couplers = COUPLER_ROUTES)
+{
+  CouplerRoute route;
+  memcpy_P(&route, &couplers[index], sizeof(CouplerRoute));
+  return route;
+}
+
+#endif // ORGAN_CONFIG_H
@@ -0,0 +1,367 @@
+/**
+ * LMNC Organ Brain - Routing Engine
+ *
+ * Works out which pipes should be on for every rank, from the keys held on each keyboard and the
+ * stop switch states. This is the code that runs in the firmware, pulled out of src/main.cpp so the
+ * host tools in tools/ can run exactly the same routing.
+ *
+ * Nothing in here touches globals or hardware. All state is passed in, so it can run on many host
+ * threads at once.
+ *
+ * State is passed as fixed-size arrays indexed by Division and Rank, and the functions take the
+ * number of keyboards and ranks from the array sizes as template parameters. Stop states are
+ * anything indexed by pin: a boolean[STOP_STATES_SIZE], or StopBits in COMPACT_STATE builds. Every loop is
+ * bounded at compile time by the counts in OrganConfig.h, so a bigger console only changes the
+ * config, and the Nano build still gets the smallest loops.
+ *
+ * The firmware doesn't call the build functions, its compute task walks the held keys itself so it
+ * can yield between them (see calculateOutputNotes() in src/main.cpp). They're kept here as the
+ * reference the host tools check it against. It does call applyStopChange(), for a pass where only
+ * one stop moved.
+ */
+#ifndef ORGAN_ENGINE_H
+#define ORGAN_ENGINE_H
+
+#include "OrganConfig.h"
+#include "Bitmap128.h"
+#include "HeldKeys.h"
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Note State
+//
+
+/**
+ * Sets the note state to the specified value. 0 for off, 1 for on.
+ * @param noteBitmap The note bitmap to change
+ * @param pitch The note index/pitch to change in the mask
+ * @param val false for off, true for on
+ *
+ * @return true if it changed, false if it did not change
+ */
+inline boolean setNoteState(Bitmap128 &noteBitmap, byte pitch, boolean val)
+{
+  if (pitch < NOTES_SIZE)
+  {
+    boolean current = noteBitmap.get(pitch);
+    noteBitmap.set(pitch, val);
+    return current != val;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Stop State
+//
+
+/**
+ * Stop switch states packed one bit per pin (bit n = pin n), instead of a boolean per pin. Reads
+ * like the boolean arrays, so the routing takes either.
+ */
+struct StopBits
+{
+  uint32_t word;
+
+  boolean operator[](byte pin) const { return (word >> pin) & 1; }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Routing
+//
+
+/**
+ * Resets the state bitmaps for all new states. Ready for calculating
+ */
+template <byte Ranks>
+inline void resetNewState(Bitmap128 (&newRankStates)[Ranks])
+{
+  for (byte rank = 0; rank < Ranks; rank++)
+  {
+    newRankStates[rank].clear();
+  }
+}
+
+/**
+ * Updates output notes based on the state of a division's stop switches for the given pitch
+ * being on. See STOP_ROUTES in OrganConfig.h for what every stop plays.
+ *
+ * @param division The division whose stops should play the pitch
+ * @param pitch The pitch to enable notes for based on stop switch state for the division
+ */
+template <typename Stops, byte Ranks>
+inline void enableNoteForDivisionSwitches(const Stops &stopSwitchStates, Bitmap128 (&newRankStates)[Ranks],
+                                          byte division, byte pitch)
+{
+  static_assert(Ranks == RANK_COUNT, "Routes index ranks by Rank");
+  for (byte i = 0; i < STOP_ROUTE_COUNT; i++)
+  {
+    StopRoute route = readStopRoute(i);
+    int pipe = pitch + route.transpose;
+    if (route.division == division && stopSwitchStates[route.stopPin] && pipe < NOTES_SIZE)
+    {
+      newRankStates[route.rank].set(pipe, true);
+    }
+  }
+}
+
+/**
+ * true if a pulled coupler plays the division from any keyboard
+ */
+template <typename Stops>
+inline boolean divisionIsCoupled(const Stops &stopSwitchStates, byte division)
+{
+  for (byte i = 0; i < COUPLER_ROUTE_COUNT; i++)
+  {
+    CouplerRoute coupler = readCouplerRoute(i);
+    if (coupler.division == division && stopSwitchStates[coupler.stopPin])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The keys that play a division's stops: its own keyboard's, plus those of every keyboard coupled
+ * to it by a pulled coupler. A coupled keyboard costs one shifted OR of its whole bitmap, clipped to
+ * the division's compass, rather than routing each of its keys again.
+ *
+ * The couplers are COUPLER_ROUTES unless another table is passed in, which has to be in flash
+ * (PROGMEM) as well. The tests use that to try transposing couplers.
+ */
+template <typename Stops, byte Manuals>
+inline Bitmap128 keysPlayingDivision(const Stops &stopSwitchStates, const Bitmap128 (&keyboardStates)[Manuals],
+                                     byte division, const CouplerRoute *couplers = COUPLER_ROUTES,
+                                     byte couplerCount = COUPLER_ROUTE_COUNT)
+{
+  Bitmap128 keys = keyboardStates[division];
+  for (byte i = 0; i < couplerCount; i++)
+  {
+    CouplerRoute coupler = readCouplerRoute(i, couplers);
+    if (coupler.division == division && stopSwitchStates[coupler.stopPin])
+    {
+      Bitmap128 coupled = keyboardStates[coupler.keyboard];
+      if (coupler.transpose >= 0)
+      {
+        coupled <<= coupler.transpose;
+      }
+      else
+      {
+        coupled >>= -coupler.transpose;
+      }
+      keys |= coupled.clip(KEYBOARD_RANGES[division].lowest, KEYBOARD_RANGES[division].highest);
+    }
+  }
+  return keys;
+}
+
+/**
+ * Builds the new state of every rank from scratch, for each note/division/stop switch combination
+ *
+ * @param stopSwitchStates Stop switch states, indexed by pin
+ * @param keyboardStates Note bitmap of the keys held on each keyboard, indexed by Division
+ * @param newRankStates Note bitmap for each Rank to build into
+ * @param couplers Coupler table in flash, see keysPlayingDivision()
+ */
+template <typename Stops, byte Manuals, byte Ranks>
+inline void buildNewRankStates(const Stops &stopSwitchStates, const Bitmap128 (&keyboardStates)[Manuals],
+                               Bitmap128 (&newRankStates)[Ranks], const CouplerRoute *couplers = COUPLER_ROUTES,
+                               byte couplerCount = COUPLER_ROUTE_COUNT)
+{
+  static_assert(Manuals == DIVISION_COUNT, "Keyboards are indexed by Division");
+
+  // Clear out the new state, so it can be constructed by combining the keyboard states and the active stop switches
+  resetNewState(newRankStates);
+
+  for (byte division = 0; division < Manuals; division++)
+  {
+    Bitmap128 keys = keysPlayingDivision(stopSwitchStates, keyboardStates, division, couplers, couplerCount);
+    // Only the keys the keyboard actually has, see KEYBOARD_RANGES
+    for (int pitch = KEYBOARD_RANGES[division].lowest; pitch <= KEYBOARD_RANGES[division].highest; pitch++)
+    {
+      if (keys.get(pitch))
+      { // This note is played on this division
+        enableNoteForDivisionSwitches(stopSwitchStates, newRankStates, division, pitch);
+      }
+    }
+  }
+}
+
+/**
+ * Same result as buildNewRankStates(), but only visits the keys that are held, so the cost goes with
+ * how many keys are down rather than the size of the keyboard. A division that's coupled, or whose
+ * held key list has overflowed, is walked through the set bits of keysPlayingDivision() instead.
+ *
+ * @param stopSwitchStates Stop switch states, indexed by pin
+ * @param keyboardStates Note bitmap of the keys held on each keyboard, indexed by Division
+ * @param heldKeys Held key list for each keyboard, indexed by Division
+ * @param newRankStates Note bitmap for each Rank to build into
+ */
+template <typename Stops, byte Manuals, byte Ranks>
+inline void buildNewRankStatesFromHeldKeys(const Stops &stopSwitchStates,
+                                           const Bitmap128 (&keyboardStates)[Manuals],
+                                           const HeldKeyList (&heldKeys)[Manuals], Bitmap128 (&newRankStates)[Ranks])
+{
+  static_assert(Manuals == DIVISION_COUNT, "Keyboards are indexed by Division");
+
+  resetNewState(newRankStates);
+
+  for (byte division = 0; division < Manuals; division++)
+  {
+    const HeldKeyList &held = heldKeys[division];
+    if (held.overflowed || divisionIsCoupled(stopSwitchStates, division))
+    {
+      Bitmap128 keys = keysPlayingDivision(stopSwitchStates, keyboardStates, division);
+      for (byte pitch : keys.setBits())
+      {
+        enableNoteForDivisionSwitches(stopSwitchStates, newRankStates, division, pitch);
+      }
+    }
+    else
+    {
+      for (byte i = 0; i < held.count; i++)
+      {
+        enableNoteForDivisionSwitches(stopSwitchStates, newRankStates, division, held.keys[i]);
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Stop Changes
+//
+// Drawing or pushing in one stop with no keys moving only changes the pipes of that stop's ranks,
+// so instead of a full build the committed state is patched with whole bitmaps: the keys that play
+// the stop's division, shifted by its transpose, are the pipes it plays.
+//
+
+#define NO_SINGLE_STOP_CHANGE 0xFF
+
+/**
+ * The pipes one stop route plays for the keys held now. Pipes shifted past the top of the bitmap
+ * drop off, like the pipe < NOTES_SIZE check in enableNoteForDivisionSwitches().
+ */
+template <typename Stops, byte Manuals>
+inline Bitmap128 stopRoutePipes(const Stops &stopSwitchStates, const Bitmap128 (&keyboardStates)[Manuals],
+                                const StopRoute &route)
+{
+  Bitmap128 pipes = keysPlayingDivision(stopSwitchStates, keyboardStates, route.division);
+  pipes <<= route.transpose;
+  return pipes;
+}
+
+/**
+ * Which stop changed between two packed stop words (bit n = pin n), if it's exactly one and it can
+ * be patched in with applyStopChange(). A coupler changes which keyboards play a whole division, so
+ * that needs a full build.
+ *
+ * @return The stop's pin, or NO_SINGLE_STOP_CHANGE
+ */
+inline byte singleStopChange(uint32_t before, uint32_t after)
+{
+  uint32_t changed = before ^ after;
+  if (changed == 0 || (changed & (changed - 1)) != 0)
+  {
+    return NO_SINGLE_STOP_CHANGE;
+  }
+  byte pin = 0;
+  while (!(changed & 1))
+  {
+    changed >>= 1;
+    pin++;
+  }
+  for (byte i = 0; i < COUPLER_ROUTE_COUNT; i++)
+  {
+    if (readCouplerRoute(i).stopPin == pin)
+    {
+      return NO_SINGLE_STOP_CHANGE;
+    }
+  }
+  return pin;
+}
+
+/**
+ * Patches rank states built for the same keys with the stop on stopPin the other way, so they come
+ * out the same as buildNewRankStates() with the stop's new state.
+ *
+ * A pulled stop just ORs its pipes in. A pushed in stop can share pipes with other stops on the
+ * same rank, which have to stay on, so the pipes still played by the rank's other pulled stops are
+ * worked out (again one shifted bitmap per route) and only the rest are taken out.
+ *
+ * @param stopSwitchStates Stop switch states, with stopPin already changed
+ * @param keyboardStates Note bitmap of the keys held on each keyboard, indexed by Division
+ * @param rankStates The rank states built with the old stop state, patched in place
+ * @param stopPin The stop that changed, not a coupler (see singleStopChange())
+ */
+template <typename Stops, byte Manuals, byte Ranks>
+inline void applyStopChange(const Stops &stopSwitchStates, const Bitmap128 (&keyboardStates)[Manuals],
+                            Bitmap128 (&rankStates)[Ranks], byte stopPin)
+{
+  static_assert(Ranks == RANK_COUNT, "Routes index ranks by Rank");
+  for (byte i = 0; i < STOP_ROUTE_COUNT; i++)
+  {
+    StopRoute route = readStopRoute(i);
+    if (route.stopPin != stopPin)
+    {
+      continue;
+    }
+    Bitmap128 pipes = stopRoutePipes(stopSwitchStates, keyboardStates, route);
+    if (stopSwitchStates[stopPin])
+    {
+      rankStates[route.rank] |= pipes;
+      continue;
+    }
+    Bitmap128 stillPlayed = {};
+    for (byte j = 0; j < STOP_ROUTE_COUNT; j++)
+    {
+      StopRoute other = readStopRoute(j);
+      if (other.rank == route.rank && stopSwitchStates[other.stopPin])
+      {
+        stillPlayed |= stopRoutePipes(stopSwitchStates, keyboardStates, other);
+      }
+    }
+    rankStates[route.rank].andNot(pipes.andNot(stillPlayed));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Diffing
+//
+
+/**
+ * Finds the pipes of a rank that are different in the next state than in the committed one, for one
+ * word of the bitmaps. The firmware keeps the rank states in two banks, builds the next state in one
+ * while the pipes play the other, and swaps them after the diff, so nothing is copied back.
+ *
+ * The words are compared with one XOR, so the cost goes with how many pipes changed rather than how
+ * many pipes the rank has. Pitches outside the rank's compass have no pipe, so they're skipped.
+ *
+ * @param committed What the pipes are playing
+ * @param next The rank state just built
+ * @param rank The rank both states are for
+ * @param word Which word of the bitmaps to compare
+ * @param changed Called as changed(rank, pitch, on) for every pipe that changed
+ */
+template <typename Changed>
+inline void diffRankWord(const Bitmap128 &committed, const Bitmap128 &next, byte rank, byte word, Changed changed)
+{
+  BitmapWord diff = committed.words[word] ^ next.words[word];
+  while (diff)
+  {
+    byte pitch = word * BITMAP_WORD_BITS + BITMAP_CTZ(diff);
+    diff &= diff - 1; // Clear the lowest bit
+    if (inRange(RANK_RANGES[rank], pitch))
+    {
+      changed(rank, pitch, next.get(pitch));
+    }
+  }
+}
+
+#endif // ORGAN_ENGINE_H
@@ -0,0 +1,77 @@
+/**
+ * LMNC Organ Brain - Output Queue
+ *
+ * A ring buffer of MIDI Note On/Off messages waiting for room in a serial output buffer. Each MIDI
+ * output port has its own queue: the Nano has one, the Mega has one per UART (see
+ * OUTPUT_PORT_COUNT in OrganConfig.h).
+ *
+ * Notes are packed into a 16 bit word: the pitch in the low byte, the channel in the next 7 bits
+ * and on/off in the top bit.
+ */
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include "OrganConfig.h"
+
+struct OutputQueue
+{
+  uint16_t notes[OUTPUT_QUEUE_SIZE];
+  int head; // Start of buffer (where to read from)
+  int tail; // End of buffer (where to write to)
+  int size; // Number of pending notes. If this ever gets bigger than the max size, panic!
+};
+
+/**
+ * Clear the queue by resetting the head, tail, and size. No need to write over existing data in
+ * the buffer array.
+ */
+inline void resetOutputQueue(OutputQueue &queue)
+{
+  queue.head = 0;
+  queue.tail = 0;
+  queue.size = 0;
+}
+
+/**
+ * How many more notes fit in the queue
+ */
+inline int outputQueueRoom(const OutputQueue &queue)
+{
+  return OUTPUT_QUEUE_SIZE - queue.size;
+}
+
+/**
+ * @returns false if the queue is full, true if the note was added to the queue
+ */
+inline boolean pushOutputQueue(OutputQueue &queue, byte channel, byte pitch, boolean val)
+{
+  if (queue.size >= OUTPUT_QUEUE_SIZE)
+  {
+    return false; // The queue is full, cannot add or we will overflow
+  }
+  queue.notes[queue.tail] = pitch | (channel << 8) | ((val ? 1 : 0) << 15);
+  queue.tail = queue.tail + 1 >= OUTPUT_QUEUE_SIZE ? 0 : queue.tail + 1;
+  queue.size++;
+  return true;
+}
+
+/**
+ * @returns false if the queue is empty, true if a note was taken off the queue
+ */
+inline boolean popOutputQueue(OutputQueue &queue, byte &channel, byte &pitch, boolean &val)
+{
+  if (queue.size <= 0)
+  {
+    return false;
+  }
+  uint16_t encodedNote = queue.notes[queue.head];
+  queue.head = queue.head + 1 >= OUTPUT_QUEUE_SIZE ? 0 : queue.head + 1;
+  queue.size--;
+
+  pitch = encodedNote & 0x00FF;
+  channel = (encodedNote >> 8) & 0b01111111;
+  val = (encodedNote >> 15) == 1;
+  return true;
+}
+
+#endif // OUTPUT_QUEUE_H
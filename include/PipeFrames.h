@@ -0,0 +1,288 @@
+/**
+ * LMNC Organ Brain - Pipe Frames
+ *
+ * A compact binary protocol for pipe driver boards of our own, used instead of MIDI on the output
+ * ports when PIPE_FRAME_OUTPUT is defined. Each frame carries the changes to one rank since the
+ * last frame for it, in whichever of three encodings is shortest:
+ *
+ *   PIPE_FRAME_BITMAP  the whole rank, 16 bytes, pitch 0 in bit 0 of the first byte
+ *   PIPE_FRAME_RUNS    ranges of changed bitmap bytes: (first byte << 4 | length - 1), then the new
+ *                      bytes, for each range
+ *   PIPE_FRAME_NOTES   one byte per changed pipe: the pitch, with the top bit set for on
+ *
+ * A registration change on a full chord is one 21 byte frame per rank, where MIDI would need three
+ * bytes for every pipe that changed.
+ *
+ * Frame layout:
+ *
+ *   PIPE_FRAME_SYNC, sequence, kind << 4 | rank, payload length, payload..., CRC-8
+ *
+ * The sequence counts up by one for every frame on a port, so the receiver can tell when it has
+ * missed one. The CRC-8 (polynomial 0x07) covers everything between the sync byte and itself. A
+ * receiver that misses a frame or gets a bad one can no longer trust the deltas, and asks for a
+ * bitmap frame of every rank with the SysEx resync request (see SYSEX_PIPE_RESYNC in main.cpp).
+ * PipeFrameDecoder is the reference receiver.
+ *
+ * The replies to SysEx requests still go out on port 0, in between whole frames, as the console
+ * doesn't have a port of its own on the Nano. A SysEx message never has a 0xF5 in it (its data
+ * bytes are below 0x80), so a receiver that is hunting for the sync byte skips over it.
+ *
+ * Must stay valid C++11, the AVR toolchain doesn't go any further.
+ */
+#ifndef PIPE_FRAMES_H
+#define PIPE_FRAMES_H
+
+#include "OrganConfig.h"
+#include "Bitmap128.h"
+
+#define PIPE_FRAME_SYNC 0xF5 // Undefined in MIDI, so it can't start a message on a shared port
+#define PIPE_FRAME_BITMAP 0
+#define PIPE_FRAME_RUNS 1
+#define PIPE_FRAME_NOTES 2
+
+#define PIPE_FRAME_HEADER_BYTES 4
+#define PIPE_FRAME_OVERHEAD_BYTES (PIPE_FRAME_HEADER_BYTES + 1)
+#define PIPE_FRAME_MAX_PAYLOAD BITMAP_BYTES // The encoder never picks anything longer than a bitmap
+#define PIPE_FRAME_MAX_BYTES (PIPE_FRAME_OVERHEAD_BYTES + PIPE_FRAME_MAX_PAYLOAD)
+
+static_assert(RANK_COUNT <= 16, "The rank has to fit in the low nibble of the kind byte");
+
+inline byte pipeFrameCrc(byte crc, byte value)
+{
+  crc ^= value;
+  for (byte bit = 0; bit < 8; bit++)
+  {
+    crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+/**
+ * Payload bytes needed to send the changed ranges of bitmap bytes
+ */
+inline byte pipeFrameRunsLength(const Bitmap128 &sent, const Bitmap128 &next)
+{
+  byte length = 0;
+  boolean inRun = false;
+  for (byte i = 0; i < BITMAP_BYTES; i++)
+  {
+    boolean changed = sent.getByte(i) != next.getByte(i);
+    if (changed)
+    {
+      length += inRun ? 1 : 2;
+    }
+    inRun = changed;
+  }
+  return length;
+}
+
+/**
+ * Encodes the change from what the receiver has (sent) to the rank's new pipes (next) as the
+ * shortest frame. Nothing has to have changed: full forces a bitmap frame, for a resync.
+ *
+ * @return Length of the frame
+ */
+inline byte encodePipeFrame(byte sequence, byte rank, const Bitmap128 &sent, const Bitmap128 &next, boolean full,
+                            byte frame[PIPE_FRAME_MAX_BYTES])
+{
+  Bitmap128 changed = sent ^ next;
+  byte notes = changed.count();
+  byte runs = pipeFrameRunsLength(sent, next);
+  byte kind = PIPE_FRAME_BITMAP;
+  byte length = BITMAP_BYTES;
+  if (!full && notes < length && notes <= runs)
+  {
+    kind = PIPE_FRAME_NOTES;
+    length = notes;
+  }
+  else if (!full && runs < length)
+  {
+    kind = PIPE_FRAME_RUNS;
+    length = runs;
+  }
+
+  frame[0] = PIPE_FRAME_SYNC;
+  frame[1] = sequence;
+  frame[2] = kind << 4 | rank;
+  frame[3] = length;
+  byte *payload = frame + PIPE_FRAME_HEADER_BYTES;
+  if (kind == PIPE_FRAME_BITMAP)
+  {
+    for (byte i = 0; i < BITMAP_BYTES; i++)
+    {
+      payload[i] = next.getByte(i);
+    }
+  }
+  else if (kind == PIPE_FRAME_NOTES)
+  {
+    byte *note = payload;
+    for (byte pitch : changed.setBits())
+    {
+      *note++ = pitch | (next.get(pitch) ? 0x80 : 0);
+    }
+  }
+  else
+  {
+    byte *run = payload;
+    byte *runStart = nullptr;
+    for (byte i = 0; i < BITMAP_BYTES; i++)
+    {
+      if (sent.getByte(i) == next.getByte(i))
+      {
+        runStart = nullptr;
+        continue;
+      }
+      if (runStart)
+      {
+        (*runStart)++;
+      }
+      else
+      {
+        runStart = run++;
+        *runStart = i << 4;
+      }
+      *run++ = next.getByte(i);
+    }
+  }
+
+  byte crc = 0;
+  for (byte i = 1; i < PIPE_FRAME_HEADER_BYTES + length; i++)
+  {
+    crc = pipeFrameCrc(crc, frame[i]);
+  }
+  frame[PIPE_FRAME_HEADER_BYTES + length] = crc;
+  return PIPE_FRAME_OVERHEAD_BYTES + length;
+}
+
+/**
+ * Reference receiver for one output port. Feed it the port's bytes one at a time.
+ */
+struct PipeFrameDecoder
+{
+  Bitmap128 ranks[RANK_COUNT];
+  uint16_t stale;       // Bit per rank that can't take deltas until its next bitmap frame
+  byte expectedSequence;
+  boolean started;      // A good frame has come in, so expectedSequence means something
+  byte frame[PIPE_FRAME_MAX_BYTES];
+  byte length;          // Bytes of the current frame so far, 0 while looking for a sync byte
+  uint32_t goodFrames;
+  uint32_t badFrames;   // Bad CRC, length or rank
+  uint32_t lostFrames;  // Gaps in the sequence
+};
+
+inline void resetPipeFrameDecoder(PipeFrameDecoder &decoder)
+{
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    decoder.ranks[rank].clear();
+  }
+  decoder.stale = (1 << RANK_COUNT) - 1; // Nothing has been received yet
+  decoder.expectedSequence = 0;
+  decoder.started = false;
+  decoder.length = 0;
+  decoder.goodFrames = 0;
+  decoder.badFrames = 0;
+  decoder.lostFrames = 0;
+}
+
+/**
+ * true while the decoder is waiting for bitmap frames, and the sender should be asked for a resync
+ */
+inline boolean pipeFramesNeedResync(const PipeFrameDecoder &decoder)
+{
+  return decoder.stale != 0;
+}
+
+inline void applyPipeFrame(PipeFrameDecoder &decoder, byte kind, byte rank, const byte payload[], byte length)
+{
+  Bitmap128 &pipes = decoder.ranks[rank];
+  if (kind == PIPE_FRAME_BITMAP)
+  {
+    for (byte i = 0; i < BITMAP_BYTES; i++)
+    {
+      pipes.setByte(i, payload[i]);
+    }
+    decoder.stale &= ~(1 << rank);
+    return;
+  }
+  if (decoder.stale & (1 << rank))
+  {
+    return; // A delta on top of a state we don't have
+  }
+  if (kind == PIPE_FRAME_NOTES)
+  {
+    for (byte i = 0; i < length; i++)
+    {
+      pipes.set(payload[i] & 0x7F, payload[i] & 0x80);
+    }
+    return;
+  }
+  for (byte i = 0; i < length;)
+  {
+    byte first = payload[i] >> 4;
+    byte count = (payload[i] & 0x0F) + 1;
+    i++;
+    for (byte j = 0; j < count && i < length; j++, i++)
+    {
+      pipes.setByte(first + j, payload[i]);
+    }
+  }
+}
+
+/**
+ * @return true if the byte finished a good frame
+ */
+inline boolean decodePipeFrameByte(PipeFrameDecoder &decoder, byte value)
+{
+  if (decoder.length == 0 && value != PIPE_FRAME_SYNC)
+  {
+    return false; // Hunting for the start of a frame
+  }
+  decoder.frame[decoder.length++] = value;
+  if (decoder.length < PIPE_FRAME_HEADER_BYTES)
+  {
+    return false;
+  }
+  byte payloadLength = decoder.frame[3];
+  byte kind = decoder.frame[2] >> 4;
+  byte rank = decoder.frame[2] & 0x0F;
+  if (payloadLength > PIPE_FRAME_MAX_PAYLOAD || rank >= RANK_COUNT || kind > PIPE_FRAME_NOTES ||
+      (kind == PIPE_FRAME_BITMAP && payloadLength != BITMAP_BYTES))
+  {
+    decoder.badFrames++;
+    decoder.stale = (1 << RANK_COUNT) - 1;
+    decoder.length = 0;
+    return false;
+  }
+  if (decoder.length < PIPE_FRAME_OVERHEAD_BYTES + payloadLength)
+  {
+    return false;
+  }
+  decoder.length = 0;
+
+  byte crc = 0;
+  for (byte i = 1; i < PIPE_FRAME_HEADER_BYTES + payloadLength; i++)
+  {
+    crc = pipeFrameCrc(crc, decoder.frame[i]);
+  }
+  if (crc != decoder.frame[PIPE_FRAME_HEADER_BYTES + payloadLength])
+  {
+    decoder.badFrames++;
+    decoder.stale = (1 << RANK_COUNT) - 1;
+    return false;
+  }
+
+  byte sequence = decoder.frame[1];
+  if (decoder.started && sequence != decoder.expectedSequence)
+  {
+    decoder.lostFrames += (byte)(sequence - decoder.expectedSequence);
+    decoder.stale = (1 << RANK_COUNT) - 1;
+  }
+  decoder.started = true;
+  decoder.expectedSequence = sequence + 1;
+  decoder.goodFrames++;
+  applyPipeFrame(decoder, kind, rank, decoder.frame + PIPE_FRAME_HEADER_BYTES, payloadLength);
+  return true;
+}
+
+#endif // PIPE_FRAMES_H
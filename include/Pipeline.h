@@ -0,0 +1,142 @@
+/**
+ * LMNC Organ Brain - Dual Core Pipeline
+ *
+ * On the AVR one core has to take turns reading MIDI, routing and sending (see Scheduler.h). With
+ * two cores (the RP2040, see src/rp2040.cpp) the work is split in two:
+ *
+ *   core 0  reads the MIDI input and the stop switches, and pushes key events and debounced stop
+ *           words into the pipeline's queues
+ *   core 1  takes them off the queues, keeps the keyboard and stop state, routes it with the same
+ *           engine as the AVR firmware (OrganEngine.h) and sends the pipe changes
+ *
+ * The queues are lock-free SPSC queues (SpscQueue.h), so neither core ever waits for the other. If
+ * the key queue is full, core 0 leaves the rest of the input in the UART's buffer until there's
+ * room, so nothing is dropped. A stop word is the whole stop state, so core 0 only ever needs to
+ * push the latest one.
+ *
+ * tools/pipeline.cpp runs the same pipeline on two std::threads to stress test it on the host.
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "OrganConfig.h"
+#include "OrganEngine.h"
+#include "SpscQueue.h"
+
+#define PIPELINE_KEY_QUEUE_SIZE 256
+#define PIPELINE_STOP_QUEUE_SIZE 8
+
+struct KeyEvent
+{
+  byte keyboard;
+  byte pitch;
+  boolean on;
+};
+
+/**
+ * Everything that crosses from core 0 to core 1
+ */
+struct Pipeline
+{
+  SpscQueue<KeyEvent, PIPELINE_KEY_QUEUE_SIZE> keys;
+  SpscQueue<uint32_t, PIPELINE_STOP_QUEUE_SIZE> stops;
+};
+
+/**
+ * Core 1's state. Core 0 never touches it.
+ */
+struct RoutingCore
+{
+  Bitmap128 keyboardStates[DIVISION_COUNT];
+  HeldKeyList heldKeys[DIVISION_COUNT];
+  boolean stopSwitchStates[STOP_STATES_SIZE];
+  Bitmap128 rankBanks[2][RANK_COUNT]; // Committed and next, like RankBanks in main.cpp
+  byte committedBank;
+};
+
+inline void resetPipeline(Pipeline &pipeline)
+{
+  resetSpscQueue(pipeline.keys);
+  resetSpscQueue(pipeline.stops);
+}
+
+inline void resetRoutingCore(RoutingCore &core)
+{
+  for (byte keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    core.keyboardStates[keyboard].clear();
+    rebuildHeldKeys(core.keyboardStates[keyboard], core.heldKeys[keyboard]);
+  }
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    core.stopSwitchStates[pin] = false;
+  }
+  resetNewState(core.rankBanks[0]);
+  resetNewState(core.rankBanks[1]);
+  core.committedBank = 0;
+}
+
+/**
+ * Core 0: queue a key, unless it isn't on the keyboard
+ *
+ * @returns false if the queue is full, try again later
+ */
+inline boolean pushKeyEvent(Pipeline &pipeline, byte keyboard, byte pitch, boolean on)
+{
+  if (!inRange(KEYBOARD_RANGES[keyboard], pitch))
+  {
+    return true; // There's no such key, so don't let it cost anything further down
+  }
+  KeyEvent event = {keyboard, pitch, on};
+  return pushSpscQueue(pipeline.keys, event);
+}
+
+/**
+ * Core 1: apply everything waiting in the queues, and if anything changed, route it and call
+ * changed(rank, pitch, on) for every pipe that has to turn on or off
+ *
+ * @returns true if a routing pass ran
+ */
+template <typename Changed>
+inline boolean runRoutingPass(Pipeline &pipeline, RoutingCore &core, Changed changed)
+{
+  boolean dirty = false;
+  KeyEvent event;
+  while (popSpscQueue(pipeline.keys, event))
+  {
+    setHeldKey(core.keyboardStates[event.keyboard], core.heldKeys[event.keyboard], event.pitch, event.on);
+    dirty = true;
+  }
+  uint32_t stopWord;
+  boolean stopsChanged = false;
+  while (popSpscQueue(pipeline.stops, stopWord))
+  {
+    stopsChanged = true; // Only the latest one matters
+  }
+  if (stopsChanged)
+  {
+    for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+    {
+      core.stopSwitchStates[pin] = (stopWord >> pin) & 1;
+    }
+    dirty = true;
+  }
+  if (!dirty)
+  {
+    return false;
+  }
+
+  Bitmap128(&next)[RANK_COUNT] = core.rankBanks[core.committedBank ^ 1];
+  buildNewRankStatesFromHeldKeys(core.stopSwitchStates, core.keyboardStates, core.heldKeys, next);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    for (byte word = 0; word < BITMAP_WORD_COUNT; word++)
+    {
+      diffRankWord(core.rankBanks[core.committedBank][rank], next[rank], rank, word, changed);
+    }
+  }
+  core.committedBank ^= 1;
+  return true;
+}
+
+#endif // PIPELINE_H
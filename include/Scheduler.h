@@ -0,0 +1,105 @@
+/**
+ * LMNC Organ Brain - Cooperative Scheduler
+ *
+ * Tiny protothread-style tasks. A task is a function that takes its Task and can stop part way
+ * through with TASK_YIELD(), then carry on from the same spot the next time it's run. The loop runs
+ * every task in turn, so a long task (routing) gives the short, urgent ones (reading MIDI input) a
+ * turn between its slices instead of needing readMidi() calls sprinkled through it.
+ *
+ * Each task has a time budget for one slice. TASK_YIELD_IF_OVER_BUDGET() yields once the slice has
+ * used it up. A slice that runs past its budget (one step of work took longer than what was left)
+ * is counted as an overrun, and the longest slice is kept, so the budgets can be tuned.
+ *
+ *   void countTask(Task &task)
+ *   {
+ *     TASK_BEGIN(task);
+ *     for (counter = 0; counter < 1000; counter++)
+ *     {
+ *       doSomething(counter);
+ *       TASK_YIELD_IF_OVER_BUDGET(task);
+ *     }
+ *     TASK_END(task);
+ *   }
+ *
+ * Like all protothreads, local variables don't survive a yield, so loop counters have to live
+ * outside the task function. TASK_YIELD() can't be used inside a switch statement in the task, or
+ * while an object with a destructor (like PROFILE_SCOPE) is in scope.
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "OrganConfig.h"
+
+#ifndef TASK_MICROS
+#ifdef ARDUINO
+#define TASK_MICROS() micros()
+#else
+#include <chrono>
+inline unsigned long taskMicros()
+{
+  using namespace std::chrono;
+  return (unsigned long)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+#define TASK_MICROS() taskMicros()
+#endif
+#endif
+
+struct Task
+{
+  uint16_t resume;       // Line to carry on from, 0 to start from the top
+  uint16_t budgetMicros; // How long one slice should take
+  unsigned long sliceStart;
+  uint16_t overruns;         // Slices that took longer than budgetMicros, saturates
+  uint16_t worstSliceMicros; // Saturates
+};
+
+#define TASK_BEGIN(task)  \
+  switch ((task).resume) \
+  {                      \
+  case 0:
+
+#define TASK_YIELD(task)        \
+  do                            \
+  {                             \
+    (task).resume = __LINE__;   \
+    return;                     \
+  case __LINE__:;               \
+  } while (0)
+
+#define TASK_YIELD_IF_OVER_BUDGET(task) \
+  do                                    \
+  {                                     \
+    if (taskOverBudget(task))           \
+    {                                   \
+      TASK_YIELD(task);                 \
+    }                                   \
+  } while (0)
+
+#define TASK_END(task) \
+  }                    \
+  (task).resume = 0
+
+inline boolean taskOverBudget(const Task &task)
+{
+  return TASK_MICROS() - task.sliceStart >= task.budgetMicros;
+}
+
+/**
+ * Run one slice of a task, and keep track of how long it took
+ */
+inline void runTask(Task &task, void (*body)(Task &))
+{
+  task.sliceStart = TASK_MICROS();
+  body(task);
+  unsigned long elapsed = TASK_MICROS() - task.sliceStart;
+  if (elapsed > task.budgetMicros && task.overruns != 0xFFFF)
+  {
+    task.overruns++;
+  }
+  if (elapsed > task.worstSliceMicros)
+  {
+    task.worstSliceMicros = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+  }
+}
+
+#endif // SCHEDULER_H
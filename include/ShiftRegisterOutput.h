@@ -0,0 +1,72 @@
+/**
+ * LMNC Organ Brain - Shift Register Output
+ *
+ * Drives the pipe solenoids straight from the committed rank bitmaps, through a chain of 74HC595
+ * shift registers on the SPI bus, instead of sending a MIDI message per pipe. The whole chain is
+ * one frame: 44 bytes for the current ranks, which takes well under 100us at 8MHz, where a big
+ * registration change as MIDI would take hundreds of milliseconds at 31250 baud.
+ *
+ * Every rank starts on a register of its own, one bit per pipe of its compass (see RANK_RANGES),
+ * lowest pipe on Q0 of the rank's first register. Register 0 is the one next to the board, so the
+ * frame is shifted out from the far end of the chain first.
+ *
+ * The bus is anything with transfer(byte) and latch(), so the host tests can record the frames.
+ */
+#ifndef SHIFT_REGISTER_OUTPUT_H
+#define SHIFT_REGISTER_OUTPUT_H
+
+#include "OrganConfig.h"
+#include "Bitmap128.h"
+
+constexpr byte shiftRegistersForRank(byte rank)
+{
+  return (RANK_RANGES[rank].highest - RANK_RANGES[rank].lowest + 8) / 8;
+}
+
+/**
+ * Index of the rank's first register in the chain. shiftRegisterOffset(RANK_COUNT) is the length
+ * of the chain.
+ */
+constexpr byte shiftRegisterOffset(byte rank)
+{
+  return rank == 0 ? 0 : shiftRegisterOffset(rank - 1) + shiftRegistersForRank(rank - 1);
+}
+
+#define SHIFT_REGISTER_FRAME_BYTES shiftRegisterOffset(RANK_COUNT)
+
+/**
+ * Packs the pipes of every rank into a frame for the register chain
+ */
+template <byte Ranks>
+inline void buildShiftRegisterFrame(const Bitmap128 (&rankStates)[Ranks], byte frame[SHIFT_REGISTER_FRAME_BYTES])
+{
+  static_assert(Ranks == RANK_COUNT, "Ranks are indexed by Rank");
+  for (byte rank = 0; rank < Ranks; rank++)
+  {
+    Bitmap128 pipes = rankStates[rank] >> RANK_RANGES[rank].lowest;
+    byte offset = shiftRegisterOffset(rank);
+    byte count = shiftRegistersForRank(rank);
+    for (byte i = 0; i < count; i++)
+    {
+      frame[offset + i] = pipes.getByte(i);
+    }
+    // The outputs past the top of the compass have no pipe
+    byte spare = count * 8 - (RANK_RANGES[rank].highest - RANK_RANGES[rank].lowest + 1);
+    frame[offset + count - 1] &= 0xFF >> spare;
+  }
+}
+
+/**
+ * Shifts a frame out to the register chain and latches it onto the outputs
+ */
+template <typename Bus>
+inline void sendShiftRegisterFrame(Bus &bus, const byte frame[SHIFT_REGISTER_FRAME_BYTES])
+{
+  for (int i = SHIFT_REGISTER_FRAME_BYTES - 1; i >= 0; i--)
+  {
+    bus.transfer(frame[i]);
+  }
+  bus.latch();
+}
+
+#endif // SHIFT_REGISTER_OUTPUT_H
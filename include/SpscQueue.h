@@ -0,0 +1,86 @@
+/**
+ * LMNC Organ Brain - SPSC Queue
+ *
+ * A lock-free single producer, single consumer ring buffer for handing events from one core to the
+ * other (see Pipeline.h). One side only ever pushes and the other only ever pops, so head and tail
+ * each have a single writer and nothing needs a lock: the producer fills a slot and then publishes
+ * it with a release store of the tail, and the consumer's acquire load of the tail sees the slot
+ * filled in. The same goes the other way for the head, so a slot isn't reused until it's been read.
+ *
+ * Size must be a power of two. Head and tail count up forever and are masked on use, so all Size
+ * slots can be used and full is just tail - head == Size.
+ *
+ * Needs <atomic>, so it's for the RP2040 and the host, not the AVR builds.
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, uint16_t Size>
+struct SpscQueue
+{
+  static_assert(Size != 0 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+
+  T items[Size];
+  alignas(64) std::atomic<uint32_t> head; // Next slot to pop, only written by the consumer
+  alignas(64) std::atomic<uint32_t> tail; // Next slot to push, only written by the producer
+};
+
+/**
+ * Only call this before both cores are running
+ */
+template <typename T, uint16_t Size>
+inline void resetSpscQueue(SpscQueue<T, Size> &queue)
+{
+  queue.head.store(0, std::memory_order_relaxed);
+  queue.tail.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Producer side only
+ *
+ * @returns false if the queue is full
+ */
+template <typename T, uint16_t Size>
+inline bool pushSpscQueue(SpscQueue<T, Size> &queue, const T &item)
+{
+  uint32_t tail = queue.tail.load(std::memory_order_relaxed);
+  if (tail - queue.head.load(std::memory_order_acquire) >= Size)
+  {
+    return false;
+  }
+  queue.items[tail & (Size - 1)] = item;
+  queue.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+/**
+ * Producer side only. true if there's room for at least count more items.
+ */
+template <typename T, uint16_t Size>
+inline bool spscQueueHasRoom(const SpscQueue<T, Size> &queue, uint16_t count)
+{
+  return queue.tail.load(std::memory_order_relaxed) - queue.head.load(std::memory_order_acquire) + count <= Size;
+}
+
+/**
+ * Consumer side only
+ *
+ * @returns false if the queue is empty
+ */
+template <typename T, uint16_t Size>
+inline bool popSpscQueue(SpscQueue<T, Size> &queue, T &item)
+{
+  uint32_t head = queue.head.load(std::memory_order_relaxed);
+  if (head == queue.tail.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  item = queue.items[head & (Size - 1)];
+  queue.head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+#endif // SPSC_QUEUE_H
@@ -0,0 +1,113 @@
+/**
+ * LMNC Organ Brain - Stop Debouncer
+ *
+ * Drawstop contacts bounce for a few milliseconds when a stop is pulled or pushed in. Without a
+ * filter every bounce flips the stop state, and every flip sends a wave of Note On/Off messages for
+ * every held key on the stop's rank, which can fill the output ring buffer and panic.
+ *
+ * The stops are read into a packed word (bit n = pin n) and fed through a counter integrator: the
+ * word is sampled every STOP_SETTLE_MS / STOP_DEBOUNCE_SAMPLES milliseconds, and a stop only changes
+ * once it has read the new way for STOP_DEBOUNCE_SAMPLES samples in a row. It's a two bit vertical
+ * counter per stop, so every stop is filtered at once with a handful of 32 bit operations.
+ *
+ * Every change of the raw word is a recompute the firmware would have done without the filter, and
+ * every change of the debounced word is one it still does. The difference is how many bounce
+ * induced recomputes were prevented.
+ */
+#ifndef STOP_DEBOUNCER_H
+#define STOP_DEBOUNCER_H
+
+#include "OrganConfig.h"
+
+#ifndef STOP_SETTLE_MS
+#define STOP_SETTLE_MS 20 // How long a stop has to read the same before it counts
+#endif
+#define STOP_DEBOUNCE_SAMPLES 4 // Fixed by the two bit counters
+#define STOP_SAMPLE_INTERVAL_MS (STOP_SETTLE_MS / STOP_DEBOUNCE_SAMPLES)
+
+static_assert(STOP_STATES_SIZE <= 32, "Every stop needs a bit in the 32 bit stop word");
+
+struct StopDebouncer
+{
+  uint32_t stable; // Debounced stop word
+  uint32_t raw;    // Last raw stop word
+  uint32_t count0; // Low bits of each stop's counter
+  uint32_t count1; // High bits of each stop's counter
+  uint32_t lastSample;
+  uint32_t rawChanges;
+  uint32_t stableChanges;
+};
+
+inline void setStopBit(uint32_t &stopWord, byte pin, boolean val)
+{
+  if (val)
+  {
+    stopWord |= (uint32_t)1 << pin;
+  }
+  else
+  {
+    stopWord &= ~((uint32_t)1 << pin);
+  }
+}
+
+/**
+ * Start with the stops as they are now, so there's no settle time at power on
+ */
+inline void resetStopDebouncer(StopDebouncer &debouncer, uint32_t raw, uint32_t nowMillis)
+{
+  debouncer.stable = raw;
+  debouncer.raw = raw;
+  debouncer.count0 = 0;
+  debouncer.count1 = 0;
+  debouncer.lastSample = nowMillis;
+  debouncer.rawChanges = 0;
+  debouncer.stableChanges = 0;
+}
+
+/**
+ * Feed the latest raw stop word through the filter. Call it every loop.
+ *
+ * @return true if the debounced stop word changed
+ */
+inline boolean debounceStops(StopDebouncer &debouncer, uint32_t raw, uint32_t nowMillis)
+{
+  if (raw != debouncer.raw)
+  {
+    debouncer.raw = raw;
+    debouncer.rawChanges++;
+  }
+  if (nowMillis - debouncer.lastSample < STOP_SAMPLE_INTERVAL_MS)
+  {
+    return false;
+  }
+  debouncer.lastSample = nowMillis;
+
+  // Count up every stop that reads differently to its debounced state, and reset the rest
+  uint32_t differs = debouncer.stable ^ raw;
+  uint32_t settled = differs & debouncer.count1 & debouncer.count0; // Was about to count past 3
+  debouncer.count1 = (debouncer.count1 ^ debouncer.count0) & differs;
+  debouncer.count0 = ~debouncer.count0 & differs;
+  if (!settled)
+  {
+    return false;
+  }
+  debouncer.stable ^= settled;
+  debouncer.stableChanges++;
+  return true;
+}
+
+/**
+ * true if debounceStops() still has work to do with this raw word: it's different to the last one,
+ * or some stop is part way through settling. If not, calling it can't change anything.
+ */
+inline boolean stopsSettling(const StopDebouncer &debouncer, uint32_t raw)
+{
+  return raw != debouncer.raw || raw != debouncer.stable || (debouncer.count0 | debouncer.count1) != 0;
+}
+
+inline uint32_t bounceRecomputesPrevented(const StopDebouncer &debouncer)
+{
+  return debouncer.rawChanges - debouncer.stableChanges;
+}
+
+#endif // STOP_DEBOUNCER_H
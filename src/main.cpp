@@ -13,13 +13,13 @@
  *
  * [ ] TODO 00: Make sure the analog pins have pulldown resistors (not a code TODO)
  * [ ] TODO 01: Enable panic button after double checking pulldown resistor
- * [ ] TODO 02: Do we need to transpose SwellToGreat Notes
- * [ ] TODO 03: Do we need to transpose SwellToPedal Notes
- * [ ] TODO 04: Do we need to transpose GreatToPedal Notes
+ * [ ] TODO 02: Do we need to transpose SwellToGreat Notes (set its transposition in COUPLER_ROUTES)
+ * [ ] TODO 03: Do we need to transpose SwellToPedal Notes (set its transposition in COUPLER_ROUTES)
+ * [ ] TODO 04: Do we need to transpose GreatToPedal Notes (set its transposition in COUPLER_ROUTES)
  * [ ] TODO 05: Great Stop To DONT KNOW YET (GreatGemsHorn4_PIN_12)
  * [ ] TODO 06: Great Stop To DONT KNOW YET (GreatSalicet4_PIN_11)
  *
- * Note: Search the code below for TODO XX to find the remaining TODO
+ * Note: Search the code below (and include/OrganConfig.h) for TODO XX to find the remaining TODO
  *
  * =================================================================================================
  * Approach tl;dr
@@ -35,8 +35,10 @@
  *
  * Because of the limited serial buffer on the Arduino Nano (64 bytes or 32 MIDI note messages),
  * we must read and clear the input buffer as much as possible to not miss any messages, which would
- * result in stuck notes. An output ring buffer is used to send the output notes in batches to
- * prevent overwhelming the serial output and dropping MIDI note messages.
+ * result in stuck notes. The work is split into three cooperative tasks (input, compute, output,
+ * see include/Scheduler.h), each run for a short time budget, and the input task gets a turn
+ * between the others. An output ring buffer holds the output notes until the serial output has
+ * room for them, to prevent overwhelming the serial output and dropping MIDI note messages.
  *
  * =================================================================================================
  * Longer Description of approach
@@ -61,7 +63,8 @@
  * Now that we know what notes are supposed to be on for each of the 4 ranks (ouput notes), we can
  * compare it with the previous state was. If the previous state is the same as the new state, we
  * don't need to send a new MIDI message for this note. If the note is now On, we can sent a MIDI On
- * and if the note is now off we can send a MIDI Off.
+ * and if the note is now off we can send a MIDI Off. The previous and new states are two banks of
+ * bitmaps that swap roles after every comparison, so the new state never has to be copied over.
  *
  * This will allow for the same notes to be pressed and released from multiple keyboards without
  * prematurely stopping a note. It will also allow for the rank ouput notes to respond correctly to
@@ -82,17 +85,86 @@
  * a ring buffer which can queue up notes in memory before we send batches of them to the serial
  * buffer. This lets us limit the output so it doesn't overwhelm the serial buffer and we don't drop
  * any notes. I also added a check so if the ring buffer ever gets full and we try to write to it,
- * instead of overwriting another note it will cause an automatic panic.
+ * instead of overwriting another note it will cause an automatic panic. The compute task waits for
+ * room in the ring buffer before diffing each part of the banks, so that's only a last resort.
  *
  */
 
 #include <MIDI.h>
+#include <EEPROM.h>
+#include "OrganConfig.h"
+#include "LoopProfiler.h"
+#include "StopDebouncer.h"
+#include "Scheduler.h"
+#include "OrganEngine.h"
+#include "OutputQueue.h"
+#include "MidiInputFilter.h"
+#ifndef SHIFT_REGISTER_OUTPUT
+#include "BackgroundResync.h"
+#endif
+#ifdef SHIFT_REGISTER_OUTPUT
+#include <SPI.h>
+#include "ShiftRegisterOutput.h"
+#endif
+#ifdef PIPE_FRAME_OUTPUT
+#include "PipeFrames.h"
+#endif
+#ifdef ONSET_SCHEDULING
+#include "OnsetScheduler.h"
+#endif
+
+/**
+ * The library's defaults, except for the SysEx receive buffer. Only the requests in handleSysEx()
+ * ever come in, and they're a few bytes long, so the default 128 bytes per instance would be
+ * wasted SRAM.
+ */
+struct OrganMidiSettings : public midi::DefaultSettings
+{
+  static const unsigned SysExMaxSize = 16;
+};
+
+/**
+ * Like the library's MIDI_CREATE_CUSTOM_INSTANCE, but the input goes through a MidiInputFilter
+ * before the parser sees it, see MidiInputFilter.h. The transport is serial<Name>.
+ */
+#define MIDI_CREATE_FILTERED_INSTANCE(SerialPort, Name)                \
+  FilteredSerialMIDI<HardwareSerial> serial##Name(SerialPort);         \
+  midi::MidiInterface<FilteredSerialMIDI<HardwareSerial>, OrganMidiSettings> Name(serial##Name);
 
 /**
  * This will use a baud rate of 31250 for the Serial out by default
  * which is standard for Arduino
  */
-MIDI_CREATE_DEFAULT_INSTANCE();
+MIDI_CREATE_FILTERED_INSTANCE(Serial, MIDI);
+
+/**
+ * The MIDI output ports, see OUTPUT_PORT_COUNT, and input ports, see INPUT_PORT_COUNT. The merged
+ * keyboard input always comes in on MIDI (Serial), and SysEx replies go out on it. On the Mega the
+ * other UARTs only send, unless SEPARATE_MANUAL_INPUTS gives each of them a keyboard to receive.
+ */
+#ifdef __AVR_ATmega2560__
+MIDI_CREATE_FILTERED_INSTANCE(Serial1, MIDI1);
+MIDI_CREATE_FILTERED_INSTANCE(Serial2, MIDI2);
+MIDI_CREATE_FILTERED_INSTANCE(Serial3, MIDI3);
+decltype(MIDI) *const OUTPUT_MIDI[OUTPUT_PORT_COUNT] = {&MIDI, &MIDI1, &MIDI2, &MIDI3};
+HardwareSerial *const OUTPUT_SERIALS[OUTPUT_PORT_COUNT] = {&Serial, &Serial1, &Serial2, &Serial3};
+#else
+decltype(MIDI) *const OUTPUT_MIDI[OUTPUT_PORT_COUNT] = {&MIDI};
+HardwareSerial *const OUTPUT_SERIALS[OUTPUT_PORT_COUNT] = {&Serial};
+#endif
+
+#ifdef SEPARATE_MANUAL_INPUTS
+// Input port 1 + keyboard is the keyboard's own input
+decltype(MIDI) *const INPUT_MIDI[INPUT_PORT_COUNT] = {&MIDI, &MIDI1, &MIDI2, &MIDI3};
+HardwareSerial *const INPUT_SERIALS[INPUT_PORT_COUNT] = {&Serial, &Serial1, &Serial2, &Serial3};
+FilteredSerialMIDI<HardwareSerial> *const INPUT_TRANSPORTS[INPUT_PORT_COUNT] = {&serialMIDI, &serialMIDI1, &serialMIDI2,
+                                                                                &serialMIDI3};
+static_assert(INPUT_PORT_COUNT == 1 + DIVISION_COUNT, "Every keyboard needs an input port");
+#else
+decltype(MIDI) *const INPUT_MIDI[INPUT_PORT_COUNT] = {&MIDI};
+HardwareSerial *const INPUT_SERIALS[INPUT_PORT_COUNT] = {&Serial};
+FilteredSerialMIDI<HardwareSerial> *const INPUT_TRANSPORTS[INPUT_PORT_COUNT] = {&serialMIDI};
+#endif
 
 // Uncomment this line to force all settings for local testing,
 // such as 115200 serial baud rate and force-enabling all stop switches
@@ -107,128 +179,176 @@ MIDI_CREATE_DEFAULT_INSTANCE();
 #define PANIC_WAIT_TIME_SECONDS 5
 
 /**
- * MIDI ON and MIDI OFF messages are 2 bytes each.  Our Tx buffer is 64 bytes, so it can hold
- * a maximum of 32 ON/OFF messages before it starts overwriting itself. Limit to a lower
- * capacity to ensure we don't overload the Serial output buffer. We can probably tweak this
- * up or down based on performance
+ * SysEx messages we send and understand use the non-commercial manufacturer ID, followed by a
+ * message type byte
  */
-#define MAX_MIDI_SENDS_PER_CALL 24
-#define RING_BUFFER_MAX_SIZE 512
+#define SYSEX_MANUFACTURER_ID 0x7D
+#define SYSEX_PROFILE_REPORT 0x01
+#define SYSEX_STATS_REPORT 0x02 // Empty body requests a report, we reply with the stats
+#define SYSEX_STATS_RESET 0x03
+#define SYSEX_DEBOUNCE_REPORT 0x04 // Empty body requests a report, we reply with the stop debounce counters
+#define SYSEX_SCHEDULER_REPORT 0x05 // Empty body requests a report, we reply with the task budget overruns
+#define SYSEX_PIPE_RESYNC 0x06      // A pipe board lost a frame, send a bitmap frame of every rank
+#define SYSEX_RESYNC_REPORT 0x07    // Empty body requests a report, we reply with the background resync counters
+#define SYSEX_ONSET_REPORT 0x08     // Empty body requests a report, we reply with the onset stagger delays
+#define SYSEX_FILTER_REPORT 0x09    // Empty body requests a report, we reply with the input filter's drop counters
 
 /**
- * Note Constants
+ * Persistent stats are saved to a ring of EEPROM slots, at most once per STATS_SAVE_INTERVAL_MS and
+ * only if something changed. Each save goes to the next slot, so every cell sees 1/STATS_SLOT_COUNT
+ * of the writes. Even if a new high water mark was set every minute, the ATmega328's 100k write
+ * cycles would last years.
  */
-#define OCTAVE 12
-#define TWO_OCTAVE 24
-#define TWELFTH 31 // 2 Octaves + 7
-#define DEFAULT_OUTPUT_VELOCITY 100
+#define STATS_EEPROM_ADDRESS 0
+#define STATS_SLOT_COUNT 16
+#define STATS_SAVE_INTERVAL_MS 60000UL
 
 /**
- * MIDI Channels
+ * On the Nano every stop pin except D20/A6 can raise a pin change interrupt, so the stop pins are
+ * only decoded after one of them moved. Define STOP_POLLING to read every pin on every loop instead.
  */
-#define SwellChannel 3 // swell keyboard midi input
-#define GreatChannel 2 // Great keyboard midi input
-#define PedalChannel 1 // Pedal keyboard midi input
+#if defined(__AVR_ATmega328P__) && !defined(STOP_POLLING)
+#define STOP_PIN_CHANGE_INTERRUPTS
+#endif
+
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE 64
+#endif
 
+#ifdef ORGAN_PROFILING
 /**
- * Output Channels
+ * How often to send one stage histogram as a SysEx message when profiling. One stage is sent at
+ * a time to keep each blocking write short.
  */
-#define PrincipalPipesChannel 13
-#define StringPipesChannel 14
-#define FlutePipesChannel 15
-#define ReedPipesChannel 16
+#define PROFILE_REPORT_INTERVAL_MS 1000
+#endif
 
-// Organ Stop Switch Pins
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Program State
+//
 
 /**
- * Swell Stop Switches
+ * Execution flags to handle different program states
  */
-#define SwellOpenDiapason8_PIN_7 7    // Swell Stop Open Diapason 8
-#define SwellStoppedDiapason8_PIN_6 6 // Swell Stop Stopped Diapason 8
-#define SwellPrincipal4_PIN_5 5       // Swell Stop Principal 4
-#define SwellFlute4_PIN_4 4           // Swell Stop Principal 4
-#define SwellFifteenth2_PIN_3 3       // Swell Stop Fifteenth 2
-#define SwellTwelfth22thirds_PIN_2 2  // Swell Stop twelfth 2 2/3
+boolean panicking = false; // Let functions know if we're in panic mode
 
 /**
- * Great Stop Switches
+ * Cooperative tasks run by loop(), see Scheduler.h
  */
-#define GreatOpenDiapason8_PIN_15 15  // Great Stop Open Diapason 8
-#define GreatLieblich8_PIN_14 14      // Great Stop Lieblich 8
-#define GreatSalicional8_PIN_13 13    // Great Stop Salicional 8 NEED TO REMOVE ARDUINO LED TO MAKE THIS WORK
-#define GreatGemsHorn4_PIN_12 12      // Great Stop GemsHorn 4 dont know yet
-#define GreatSalicet4_PIN_11 11       // Great Stop Salicet 4
-#define GreatNazard22thirds_PIN_10 10 // Great Stop Nazard 2 2/3
-#define GreatHorn8_PIN_9 9            // Great Stop Horn 8
-#define GreatClarion4_PIN_8 8         // Great Stop Clarion 4
+Task inputTask = {0, INPUT_TASK_BUDGET_MICROS, 0, 0, 0};
+Task computeTask = {0, COMPUTE_TASK_BUDGET_MICROS, 0, 0, 0};
+Task outputTask = {0, OUTPUT_TASK_BUDGET_MICROS, 0, 0, 0};
+
+// Where calculateOutputNotes() is up to between slices
+byte computeKeyboard = 0;
+byte computeCursor = 0;
+byte computePitch = 0;
+byte computeRank = 0;
+byte computeWord = 0;
+byte computeStopPin = 0;
+Bitmap128 computeKeys;           // Keys of a coupled division left to route this pass
+byte computeDiffBytes = 0;       // Bytes diffed so far in this slice
+boolean computeDiffing = false;
+boolean computeRestarted = false; // The build has already started again once this pass
+boolean routingDirty = true;      // The keys or stops changed since the last build started
+boolean fullBuildDue = true;      // The keys changed or the banks were cleared, so a stop change can't be patched in
+uint32_t routedStopWord = 0;      // The stops the committed bank was routed with, bit n = pin n
+
+// Bit per input port whose serial input buffer was full the last time readMidi() looked, so a burst
+// that keeps it full is only counted as one overrun
+byte rxFullPorts = 0;
 
 /**
- * Pedal Stop Switches
+ * State Arrays for Input and Output channels
  */
-#define PedalBassFlute8_PIN_20 20 // Pedal BassFlute 8. Need to analogRead this pin
-#define PedalBourdon16_PIN_19 19  // Pedal Bourdon 16
+#ifdef COMPACT_STATE
+StopBits StopSwitchStates = {}; // One bit per stop, see COMPACT_STATE in OrganConfig.h
+#else
+boolean StopSwitchStates[STOP_STATES_SIZE] = {};
+#endif
 
 /**
- *
- * Coupler Stops
- *
- * From: https://www.ibiblio.org/pipeorgan/Pages/Console.html
- *
- * "For example, the Great to Pedal coupler means that stops that stops in the Great division will now
- * be controlled by the pedal board. This is especially useful on organs that only have 16' and 8'
- * pedal stops. However, the stops on the Great will still sound if keys on the Great manual are played."
- *
- * Couplers can also connect manuals at a specific range. For example, a Swell to Great 4' means that all the
- * stops currently playing in the Swell will be copied to the Great manual an octave higher than their regular
- * pitch on the Swell. So, an 8' flute in the Swell will sound at 8' pitch on the swell but at 4' pitch on the
- * great. Common ranges of these types of couplers are 16', and 4'. While this type of coupler is helpful, it
- * is not a necessary part of the organ so you may find organs which do not have them.
- *
+ * Stop switches as read from the pins, bit n = pin n. StopSwitchStates only changes once these have
+ * settled, see StopDebouncer.h
  */
-#define SwellToGreat_PIN_18 18 // Send the Swell Stops to the Great Keyboard (Great Plays Swell and Great Stops)
-#define SwellToPedal_PIN_17 17 // Send the Swell Stops to the Pedal Keyboard (Pedal Plays Swell and Pedal Stops)
-#define GreatToPedal_PIN_16 16 // Send the Great Stops to the Pedal Keyboard (Pedal Plays Great and Pedal Stops)
-                               // Note: If Both the SwellToPedal and GreatToPedal are enabled, The pedals play All Stops
-
-#define PanicButton_PIN_21 21 // Pin D21/A7 is analog input only
-
-////////////////////////////////////////////////////////////////////////////////////////////////////
-//
-// Program State
-//
+uint32_t rawStopWord = 0;
+StopDebouncer stopDebouncer = {};
 
+#ifdef STOP_PIN_CHANGE_INTERRUPTS
 /**
- * Execution flags to handle different program states
+ * Port snapshots latched by the pin change interrupts, and whether one has fired since the loop
+ * last decoded them
  */
-boolean panicking = false;       // Let functions know if we're in panic mode
-boolean handlerExecuted = false; // Keeps track of whether a note was handled or not
+volatile byte stopPortB = 0;
+volatile byte stopPortC = 0;
+volatile byte stopPortD = 0;
+volatile boolean stopsDirty = false;
+unsigned long lastAnalogStopRead = 0; // D20/A6 can't interrupt, so it's still polled
+#endif
 
+#ifdef ORGAN_PROFILING
 /**
- * State Arrays for Input and Output channels
+ * Per stage timing histograms. See LoopProfiler.h
  */
-#define STOP_STATES_SIZE 21
-boolean StopSwitchStates[STOP_STATES_SIZE] = {};
+ProfileHistogram profileHistograms[PROFILE_STAGE_COUNT] = {};
+unsigned long lastProfileReport = 0;
+byte nextProfileReportStage = 0;
+#endif
 
-#define NOTES_SIZE 128
-#define NOTES_BITMAP_ARRAY_SIZE 16 // NOTES_SIZE / 8
-// Each state needs to hold
+// State for the input keyboards, indexed by Division
+Bitmap128 KeyboardStates[DIVISION_COUNT] = {};
 
-// State for the input keyboards
-byte SwellState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte GreatState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte PedalState[NOTES_BITMAP_ARRAY_SIZE] = {};
+// Keys held down on each keyboard, kept in step with the states above. See HeldKeys.h
+HeldKeyList HeldKeys[DIVISION_COUNT] = {};
 
-// State for the output channels
-byte PrincipalPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte StringPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte FlutePipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte ReedPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
+// State for the output channels, in two banks indexed by Rank. The pipes are playing the committed
+// bank, and the compute task builds the next state in the other one before they swap
+Bitmap128 RankBanks[2][RANK_COUNT] = {};
+byte committedBank = 0;
 
-// Temporary state to combinie keboard and stop states
-byte NewPrincipalPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte NewStringPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte NewFlutePipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
-byte NewReedPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
+#ifdef SHIFT_REGISTER_OUTPUT
+/**
+ * The pipes are driven from shift registers instead of MIDI, see ShiftRegisterOutput.h. A frame
+ * goes out after every routing pass that changed a pipe.
+ */
+struct SpiShiftBus
+{
+  void transfer(byte value) { SPI.transfer(value); }
+  void latch()
+  {
+    digitalWrite(SHIFT_REGISTER_LATCH_PIN, HIGH);
+    digitalWrite(SHIFT_REGISTER_LATCH_PIN, LOW);
+  }
+};
+SpiShiftBus shiftBus;
+byte shiftFrame[SHIFT_REGISTER_FRAME_BYTES];
+boolean pipesChanged = false;   // The diff found a pipe to change in this pass
+boolean shiftFrameDirty = true; // The committed bank hasn't been sent to the registers yet
+#endif
+
+#ifndef SHIFT_REGISTER_OUTPUT
+// Where the background resync is up to, see BackgroundResync.h. The shift registers are sent the
+// whole state every time, so they don't need it.
+ResyncCursor resync;
+#endif
+
+#ifdef ONSET_SCHEDULING
+// Pipes waiting to start, see OnsetScheduler.h
+OnsetScheduler onsetScheduler;
+#endif
+
+#ifdef PIPE_FRAME_OUTPUT
+/**
+ * The pipes are driven by boards that take binary frames instead of MIDI, see PipeFrames.h. The
+ * output task sends each rank whatever differs from what its board was last sent, so the banks
+ * aren't diffed pipe by pipe in this mode.
+ */
+Bitmap128 SentRanks[RANK_COUNT] = {};
+byte pipeFrameSequences[OUTPUT_PORT_COUNT] = {};
+uint16_t bitmapFramesDue = (1 << RANK_COUNT) - 1; // Bit per rank, the boards start out unknown
+uint16_t resyncFramesDue = 0;                      // The bitmap frames above the background resync asked for
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -242,6 +362,9 @@ byte NewReedPipesState[NOTES_BITMAP_ARRAY_SIZE] = {};
 // Setup
 void setupMidi();
 void setupPins();
+#ifdef STOP_PIN_CHANGE_INTERRUPTS
+void setupStopInterrupts();
+#endif
 
 // Panic
 void checkForPanic();
@@ -252,41 +375,95 @@ void panic();
 void handleMidiNoteOn(byte channel, byte pitch, byte velocity);
 void handleMidiNoteOff(byte channel, byte pitch, byte velocity);
 void handleMidiNote(byte channel, byte pitch, byte velocity, boolean value);
-void readMidi();
-void sendMidi();
+void handleKeyboardNote(byte keyboard, byte pitch, boolean value);
+#ifdef SEPARATE_MANUAL_INPUTS
+template <byte Keyboard>
+void handleManualNoteOn(byte channel, byte pitch, byte velocity);
+template <byte Keyboard>
+void handleManualNoteOff(byte channel, byte pitch, byte velocity);
+#endif
+void readMidi(Task &task);
+void sendMidi(Task &task);
 
 // State Management
 void resetStateArrays();
-boolean setNoteState(byte noteBitmap[], byte pitch, boolean val);
-void setNoteStateOn(byte noteBitmap[], byte pitch, int channel);
-void setNoteStateOff(byte noteBitmap[], byte pitch, int channel);
+#ifndef PIPE_FRAME_OUTPUT
+void queuePipeChange(byte rank, byte pitch, boolean val);
+#endif
 void readStopSwitchStates();
+void readRawStopWord();
+void unpackStopWord(uint32_t stopWord);
+void setStopSwitchState(byte pin, boolean val);
 #ifdef LOCAL_TESTING_MODE
 // Testint functions
 void pullOutAllTheStops();
 #endif
-void resetNewState();
 
 // Calculate Output
-void calculateOutputNotes();
-void updateOutputState(byte outputState[], byte newState[], int channel, byte pitch);
-void enableNoteForSwellSwitches(byte pitch);
-void enableNoteForGreatSwitches(byte pitch);
-void enableNoteForPedalSwitches(byte pitch);
+void calculateOutputNotes(Task &task);
+boolean buildIsStale();
 
 // Bitmap function
-void setBitmapBit(byte bitmap[], byte index, byte val);
-bool getBitmapBit(byte bitmap[], byte index);
-void printNoteBitmap(byte bitmap[]);
+void printNoteBitmap(const Bitmap128 &bitmap);
 
 // Output Ring Buffer
+#if !defined(SHIFT_REGISTER_OUTPUT) && !defined(PIPE_FRAME_OUTPUT)
 void resetOutputBuffer();
-boolean pushToOutputBuffer(byte channel, byte pitch, boolean val);
-boolean popAndSendMidi();
+boolean pushToOutputBuffer(byte rank, byte pitch, boolean val);
+boolean outputBufferHasRoom(byte rank, byte count);
+boolean popAndSendMidi(byte port);
+#endif
+#ifdef ONSET_SCHEDULING
+boolean releaseOnset(byte rank, byte pitch);
+#endif
+#ifndef SHIFT_REGISTER_OUTPUT
+void sendResyncWindow();
+#endif
+
+#ifdef SHIFT_REGISTER_OUTPUT
+// Shift Register Output
+void sendShiftFrame();
+#endif
+
+#ifdef PIPE_FRAME_OUTPUT
+// Pipe Frame Output
+boolean sendPipeFrame(byte rank);
+#endif
 
 // IO Helpers
 void digitalReadSwitch(byte pin);
 void analogReadSwitch(byte pin);
+#ifdef STOP_PIN_CHANGE_INTERRUPTS
+boolean latchStopPorts();
+#endif
+
+// SysEx
+void handleSysEx(byte *message, unsigned size);
+byte appendSysExValue(byte message[], byte length, unsigned long value, byte byteCount);
+void sendDebounceReport();
+void sendFilterReport();
+void sendSchedulerReport();
+#ifndef SHIFT_REGISTER_OUTPUT
+void sendResyncReport();
+#endif
+#ifdef ONSET_SCHEDULING
+void sendOnsetReport();
+#endif
+
+// Persistent Stats
+void loadStats();
+void saveStatsIfDue();
+void resetStats();
+void sendStatsReport();
+void recordLoopTime(unsigned long loopMicros);
+void recordOutputQueueDepth(int depth);
+void recordRxOverrun();
+void recordPanic();
+
+#ifdef ORGAN_PROFILING
+// Profiling
+void sendProfileReport();
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -300,8 +477,25 @@ void setup()
 {
   setupMidi();
   setupPins();
+  // Take the stops as they are at power on, without waiting for them to settle
+  readRawStopWord();
+  resetStopDebouncer(stopDebouncer, rawStopWord, millis());
+  unpackStopWord(stopDebouncer.stable);
+#ifdef STOP_PIN_CHANGE_INTERRUPTS
+  setupStopInterrupts();
+#endif
+  PROFILE_BEGIN();
+#ifndef SHIFT_REGISTER_OUTPUT
+  resetResyncCursor(resync);
+#endif
+#ifdef ONSET_SCHEDULING
+  resetOnsetScheduler(onsetScheduler);
+#endif
+  loadStats();
   // Start with a panic to send out MIDI Off to all pipe notes
   panic();
+  // Let anyone listening know how close we came to dropping notes since the stats were reset
+  sendStatsReport();
 }
 
 /**
@@ -309,8 +503,11 @@ void setup()
  */
 void setupMidi()
 {
+  // Only the keyboards' notes and our own SysEx get through to the parser
+  resetMidiInputFilter(serialMIDI.filter, keyboardChannelMask(), SYSEX_MANUFACTURER_ID);
   MIDI.setHandleNoteOn(handleMidiNoteOn);
   MIDI.setHandleNoteOff(handleMidiNoteOff);
+  MIDI.setHandleSystemExclusive(handleSysEx);
   MIDI.begin(MIDI_CHANNEL_OMNI);
 #ifdef LOCAL_TESTING_MODE
   // We need to use 115200 for the 'Hairless MIDI Serial Bridge so we can
@@ -319,6 +516,31 @@ void setupMidi()
   Serial.begin(115200);
 #endif
   MIDI.turnThruOff();
+#if defined(SEPARATE_MANUAL_INPUTS)
+  INPUT_MIDI[1 + SWELL]->setHandleNoteOn(handleManualNoteOn<SWELL>);
+  INPUT_MIDI[1 + SWELL]->setHandleNoteOff(handleManualNoteOff<SWELL>);
+  INPUT_MIDI[1 + GREAT]->setHandleNoteOn(handleManualNoteOn<GREAT>);
+  INPUT_MIDI[1 + GREAT]->setHandleNoteOff(handleManualNoteOff<GREAT>);
+  INPUT_MIDI[1 + PEDAL]->setHandleNoteOn(handleManualNoteOn<PEDAL>);
+  INPUT_MIDI[1 + PEDAL]->setHandleNoteOff(handleManualNoteOff<PEDAL>);
+  for (byte port = 1; port < INPUT_PORT_COUNT; port++)
+  {
+    // A keyboard's own input plays whatever the channel, and it has no SysEx handler
+    resetMidiInputFilter(INPUT_TRANSPORTS[port]->filter, 0xFFFF, MIDI_FILTER_NO_SYSEX);
+    INPUT_MIDI[port]->begin(MIDI_CHANNEL_OMNI);
+    INPUT_MIDI[port]->turnThruOff();
+  }
+#elif defined(__AVR_ATmega2560__)
+  for (byte port = 1; port < OUTPUT_PORT_COUNT; port++)
+  {
+    OUTPUT_MIDI[port]->begin(MIDI_CHANNEL_OFF);
+    OUTPUT_MIDI[port]->turnThruOff();
+  }
+  // Send only. Turning the receivers off hands D15, D17 and D19 back to the stop switches
+  UCSR1B &= ~_BV(RXEN1);
+  UCSR2B &= ~_BV(RXEN2);
+  UCSR3B &= ~_BV(RXEN3);
+#endif
 }
 
 /**
@@ -326,29 +548,35 @@ void setupMidi()
  */
 void setupPins()
 {
-  pinMode(SwellOpenDiapason8_PIN_7, INPUT);
-  pinMode(SwellStoppedDiapason8_PIN_6, INPUT);
-  pinMode(SwellPrincipal4_PIN_5, INPUT);
-  pinMode(SwellFlute4_PIN_4, INPUT);
-  pinMode(SwellFifteenth2_PIN_3, INPUT);
-  pinMode(SwellTwelfth22thirds_PIN_2, INPUT);
-
-  pinMode(GreatOpenDiapason8_PIN_15, INPUT);
-  pinMode(GreatLieblich8_PIN_14, INPUT);
-  pinMode(GreatSalicional8_PIN_13, INPUT);
-  pinMode(GreatGemsHorn4_PIN_12, INPUT);
-  pinMode(GreatSalicet4_PIN_11, INPUT);
-  pinMode(GreatNazard22thirds_PIN_10, INPUT);
-  pinMode(GreatHorn8_PIN_9, INPUT);
-  pinMode(GreatClarion4_PIN_8, INPUT);
-
-  pinMode(PedalBassFlute8_PIN_20, INPUT);
-  pinMode(PedalBourdon16_PIN_19, INPUT);
-
-  pinMode(SwellToGreat_PIN_18, INPUT);
-  pinMode(SwellToPedal_PIN_17, INPUT);
-  pinMode(GreatToPedal_PIN_16, INPUT);
-  pinMode(PanicButton_PIN_21, INPUT);
+  pinMode(stopInputPin(SwellOpenDiapason8_PIN_7), INPUT);
+  pinMode(stopInputPin(SwellStoppedDiapason8_PIN_6), INPUT);
+  pinMode(stopInputPin(SwellPrincipal4_PIN_5), INPUT);
+  pinMode(stopInputPin(SwellFlute4_PIN_4), INPUT);
+  pinMode(stopInputPin(SwellFifteenth2_PIN_3), INPUT);
+  pinMode(stopInputPin(SwellTwelfth22thirds_PIN_2), INPUT);
+
+  pinMode(stopInputPin(GreatOpenDiapason8_PIN_15), INPUT);
+  pinMode(stopInputPin(GreatLieblich8_PIN_14), INPUT);
+  pinMode(stopInputPin(GreatSalicional8_PIN_13), INPUT);
+  pinMode(stopInputPin(GreatGemsHorn4_PIN_12), INPUT);
+  pinMode(stopInputPin(GreatSalicet4_PIN_11), INPUT);
+  pinMode(stopInputPin(GreatNazard22thirds_PIN_10), INPUT);
+  pinMode(stopInputPin(GreatHorn8_PIN_9), INPUT);
+  pinMode(stopInputPin(GreatClarion4_PIN_8), INPUT);
+
+  pinMode(stopInputPin(PedalBassFlute8_PIN_20), INPUT);
+  pinMode(stopInputPin(PedalBourdon16_PIN_19), INPUT);
+
+  pinMode(stopInputPin(SwellToGreat_PIN_18), INPUT);
+  pinMode(stopInputPin(SwellToPedal_PIN_17), INPUT);
+  pinMode(stopInputPin(GreatToPedal_PIN_16), INPUT);
+  pinMode(stopInputPin(PanicButton_PIN_21), INPUT);
+
+#ifdef SHIFT_REGISTER_OUTPUT
+  pinMode(SHIFT_REGISTER_LATCH_PIN, OUTPUT);
+  digitalWrite(SHIFT_REGISTER_LATCH_PIN, LOW);
+  SPI.begin();
+#endif
 }
 
 /**
@@ -356,16 +584,24 @@ void setupPins()
  */
 void loop()
 {
-  checkForPanic();        // Panic if panic button is pressed
-  readMidi();             // Keep input buffer clear. Gotta go fast.
-  readStopSwitchStates(); // Update the Stop Switch states
-#ifdef LOCAL_TESTING_MODE
-  pullOutAllTheStops(); // ALL THE STOPS!!!
+  PROFILE_SCOPE(STAGE_LOOP);
+  unsigned long loopStart = micros();
+  checkForPanic(); // Panic if panic button is pressed
+
+  // The input gets a turn before each of the others, so it's never more than one slice away
+  PROFILE_STAGE(STAGE_READ_MIDI, runTask(inputTask, readMidi));
+  PROFILE_STAGE(STAGE_CALCULATE, {
+    PROFILE_SCOPE(computeDiffing ? STAGE_CALC_DIFF : STAGE_CALC_BUILD);
+    runTask(computeTask, calculateOutputNotes);
+  });
+  PROFILE_STAGE(STAGE_READ_MIDI, runTask(inputTask, readMidi));
+  PROFILE_STAGE(STAGE_SEND_MIDI, runTask(outputTask, sendMidi));
+
+  recordLoopTime(micros() - loopStart);
+  saveStatsIfDue(); // Writes at most one EEPROM byte per loop, never blocks
+#ifdef ORGAN_PROFILING
+  sendProfileReport();
 #endif
-  readMidi(); // Keep input buffer clear. Gotta go fast.
-  calculateOutputNotes();
-  readMidi(); // Keep input buffer clear. Gotta go fast.
-  sendMidi(); // Send a batch of midi messages from the output ring buffer
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -378,6 +614,7 @@ void loop()
  */
 void checkForPanic()
 {
+  PROFILE_SCOPE(STAGE_CHECK_PANIC);
   // TODO 01: Determine the correct evaluation for the panic button based on using a pulldown resistor or not
   // on the analog input pin.
   boolean panicButtonOn = false; // analogRead(PanicButton_PIN_21) > 200 // Pin D21/A7 is analog input only
@@ -402,6 +639,7 @@ void checkForPanic()
  */
 void panicAndPause()
 {
+  recordPanic();
   panic();
   panicking = true;
 
@@ -410,8 +648,11 @@ void panicAndPause()
   unsigned long end = start + waitTime;
   while (millis() < end)
   {
-    // Read the input buffers the entire time to keep them clear
-    MIDI.read();
+    // Read every input buffer the entire time to keep them clear
+    for (byte port = 0; port < INPUT_PORT_COUNT; port++)
+    {
+      INPUT_MIDI[port]->read();
+    }
   }
   panicking = false;
   // Time to relax, now that it's all over. Grab a beer :D
@@ -425,23 +666,56 @@ void panic()
 {
 
   panicking = true;
-  handlerExecuted = false;
 
-  // Send MIDI OFF messages to every pipe channel for every note
-  for (int pitch = 0; pitch < NOTES_SIZE; pitch++)
-  {
-
-    MIDI.sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, StringPipesChannel);
-    MIDI.sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, PrincipalPipesChannel);
-    MIDI.sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, FlutePipesChannel);
-    MIDI.sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, ReedPipesChannel);
-    Serial.flush();
+  resetStateArrays();
+#if !defined(SHIFT_REGISTER_OUTPUT) && !defined(PIPE_FRAME_OUTPUT)
+  resetOutputBuffer();
+#endif
+#ifdef ONSET_SCHEDULING
+  clearPendingOnsets(onsetScheduler);
+#endif
 
-    MIDI.read(); // Keep consuming the input buffer. It will be ignored in the panic state
+#if defined(SHIFT_REGISTER_OUTPUT)
+  // Both banks are clear, so this turns every pipe off at once
+  sendShiftFrame();
+#elif defined(PIPE_FRAME_OUTPUT)
+  // Both banks are clear, so a bitmap frame per rank turns every pipe off
+  bitmapFramesDue = (1 << RANK_COUNT) - 1;
+  resyncFramesDue = 0;
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    while (!sendPipeFrame(rank))
+    {
+      // Wait for room in the output buffer
+    }
+  }
+  for (byte port = 0; port < OUTPUT_PORT_COUNT; port++)
+  {
+    OUTPUT_SERIALS[port]->flush();
   }
+#else
+  // Send MIDI OFF messages to every pipe channel for every pipe it has
+  for (int pitch = PIPES_LOWEST_PITCH; pitch <= PIPES_HIGHEST_PITCH; pitch++)
+  {
+    for (byte rank = 0; rank < RANK_COUNT; rank++)
+    {
+      if (inRange(RANK_RANGES[rank], pitch))
+      {
+        OUTPUT_MIDI[RANK_OUTPUT_PORTS[rank]]->sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, RANK_CHANNELS[rank]);
+      }
+    }
+    for (byte port = 0; port < OUTPUT_PORT_COUNT; port++)
+    {
+      OUTPUT_SERIALS[port]->flush();
+    }
 
-  resetStateArrays();
-  resetOutputBuffer();
+    // Keep consuming the input buffers. It will be ignored in the panic state
+    for (byte port = 0; port < INPUT_PORT_COUNT; port++)
+    {
+      INPUT_MIDI[port]->read();
+    }
+  }
+#endif
 
   panicking = false;
 }
@@ -481,6 +755,21 @@ void handleMidiNoteOff(byte channel, byte pitch, byte velocity)
  * Sets the state of an incoming midi note.
  */
 void handleMidiNote(byte channel, byte pitch, byte velocity, boolean value)
+{
+  for (byte keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    if (KEYBOARD_CHANNELS[keyboard] == channel)
+    {
+      handleKeyboardNote(keyboard, pitch, value);
+      return;
+    }
+  }
+}
+
+/**
+ * Sets the state of a key on a keyboard
+ */
+void handleKeyboardNote(byte keyboard, byte pitch, boolean value)
 {
   if (panicking)
   {
@@ -488,56 +777,119 @@ void handleMidiNote(byte channel, byte pitch, byte velocity, boolean value)
     // Ignore the note
     return;
   }
-  handlerExecuted = true;
-  switch (channel)
+  if (!inRange(KEYBOARD_RANGES[keyboard], pitch))
   {
-  case SwellChannel:
-    setBitmapBit(SwellState, pitch, value);
-    break;
-  case GreatChannel:
-    setBitmapBit(GreatState, pitch, value);
-    break;
-  case PedalChannel:
-    setBitmapBit(PedalState, pitch, value);
-    break;
+    // There's no such key on the keyboard, so don't let it cost anything further down
+    return;
   }
+  setHeldKey(KeyboardStates[keyboard], HeldKeys[keyboard], pitch, value);
+  routingDirty = true;
+  fullBuildDue = true;
+}
+
+#ifdef SEPARATE_MANUAL_INPUTS
+/**
+ * Handlers for a keyboard's own input. The input already says which keyboard it is, so the channel
+ * doesn't matter.
+ */
+template <byte Keyboard>
+void handleManualNoteOn(byte channel, byte pitch, byte velocity)
+{
+  handleKeyboardNote(Keyboard, pitch, ON);
+}
+
+template <byte Keyboard>
+void handleManualNoteOff(byte channel, byte pitch, byte velocity)
+{
+  handleKeyboardNote(Keyboard, pitch, OFF);
 }
+#endif
 
 /**
- * Reads all incoming midi messages. This will  block until no MIDI.read() calls
- * result in a handler being executed. This should be called AGGRESSIVELY for best
- * performance. The handlers only record what notes were pressed, the application
- * loop will make calculate what needs to be done with the state of the notes.
+ * Input task. Reads the MIDI messages waiting in the serial input buffers until they're empty or
+ * the task's budget is used up. The inputs take turns one message at a time, each filled by its own
+ * UART's receive interrupt. The handlers only record what notes were pressed, the compute task
+ * works out what needs to be done with the state of the notes.
+ *
+ * Asking a transport what's available runs the input filter, which drops the clock, active sensing,
+ * controllers and the rest on the spot, so the parser only runs for bytes it has to see.
  */
-void readMidi()
+void readMidi(Task &task)
 {
+  for (byte port = 0; port < INPUT_PORT_COUNT; port++)
+  {
+    byte portBit = 1 << port;
+    if (INPUT_SERIALS[port]->available() >= SERIAL_RX_BUFFER_SIZE - 1)
+    {
+      // The serial input buffer is full, so the UART has started dropping incoming bytes
+      if (!(rxFullPorts & portBit))
+      {
+        recordRxOverrun();
+      }
+      rxFullPorts |= portBit;
+    }
+    else
+    {
+      rxFullPorts &= ~portBit;
+    }
+  }
+  boolean read;
   do
   {
-    // Read incoming messages until there are no more messages to read. This is
-    // to prevent potential buffering issues if there are too many incoming messages
-    // at once.
-    handlerExecuted = false;
-    MIDI.read();
-  } while (!panicking && handlerExecuted);
+    read = false;
+    for (byte port = 0; port < INPUT_PORT_COUNT; port++)
+    {
+      if (INPUT_TRANSPORTS[port]->available() > 0)
+      {
+        INPUT_MIDI[port]->read();
+        read = true;
+      }
+    }
+  } while (read && !taskOverBudget(task));
 }
 
 /**
- * Send midi messages from the Output Ring Buffer. This will send up to
- * MAX_MIDI_SENDS_PER_CALL message. readMidi() is called in between each sent note
- * to ensure we're keeping the input buffer clear.
+ * Output task. Sends MIDI messages from each port's output queue while the port's serial output
+ * buffer has room for them, so a send never has to wait for the UART. The ports take turns one
+ * message at a time, and each UART's transmit interrupt drains its own buffer in parallel.
  */
-void sendMidi()
+void sendMidi(Task &task)
 {
-  for (int i = 0; i < MAX_MIDI_SENDS_PER_CALL; i++)
+#if defined(SHIFT_REGISTER_OUTPUT)
+  if (shiftFrameDirty)
+  {
+    sendShiftFrame();
+  }
+#elif defined(PIPE_FRAME_OUTPUT)
+  for (byte rank = 0; rank < RANK_COUNT && !taskOverBudget(task); rank++)
   {
-    if (!popAndSendMidi())
+    sendPipeFrame(rank);
+  }
+  if (resyncWindowDue(resync, millis()))
+  {
+    sendResyncWindow();
+  }
+#else
+#ifdef ONSET_SCHEDULING
+  releaseOnsets(onsetScheduler, millis(), releaseOnset);
+#endif
+  boolean sent;
+  do
+  {
+    sent = false;
+    for (byte port = 0; port < OUTPUT_PORT_COUNT; port++)
     {
-      // The buffer must be empty, nothing left to do for this send batch
-      return;
+      if (OUTPUT_SERIALS[port]->availableForWrite() >= MIDI_MESSAGE_MAX_BYTES && popAndSendMidi(port))
+      {
+        sent = true;
+      }
     }
-    readMidi(); // Keep input buffer clear. Gotta go fast
+  } while (sent && !taskOverBudget(task));
+  if (resyncWindowDue(resync, millis()))
+  {
+    sendResyncWindow();
   }
-  // Serial.flush();
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -547,82 +899,77 @@ void sendMidi()
 
 void resetStateArrays()
 {
-  for (int i = 0; i < NOTES_BITMAP_ARRAY_SIZE; i++)
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
   {
-    FlutePipesState[i] = 0;
-    PrincipalPipesState[i] = 0;
-    StringPipesState[i] = 0;
-    ReedPipesState[i] = 0;
-
-    NewFlutePipesState[i] = 0;
-    NewPrincipalPipesState[i] = 0;
-    NewStringPipesState[i] = 0;
-    NewReedPipesState[i] = 0;
+    RankBanks[0][rank].clear();
+    RankBanks[1][rank].clear();
   }
+  routingDirty = true; // Route the keys that are still held back onto the cleared pipes
+  fullBuildDue = true;
 }
 
+#ifndef PIPE_FRAME_OUTPUT
 /**
- * Makes sure the note is on in the given bitmap
- *
- * If the note state changed, then send the midi channel note on message to the channel.
- *
+ * Queue up the midi output message for a pipe that changed between the committed and next banks
  */
-void setNoteStateOn(byte noteBitmap[], byte pitch, int channel)
+void queuePipeChange(byte rank, byte pitch, boolean val)
 {
-  // Set the state. If it changed, queue up a midi output message
-  if (setNoteState(noteBitmap, pitch, ON))
+#if defined(SHIFT_REGISTER_OUTPUT)
+  // The whole frame goes out once the banks have swapped
+  pipesChanged = true;
+#else
+#ifdef ONSET_SCHEDULING
+  if (val)
   {
-    if (!pushToOutputBuffer(channel, pitch, ON))
-    {
-      panicAndPause();
-    }
+    scheduleOnset(onsetScheduler, rank, pitch, millis()); // Sent when releaseOnsets() has room for it
+    return;
   }
-}
-
-/**
- * Makes sure the note is off in the given bitmap
- *
- * If the note state changed, then send the midi channel note off message to the channel.
- *
- */
-void setNoteStateOff(byte noteBitmap[], byte pitch, int channel)
-{
-  // Set the state. If it changed, queue up a midi output message
-  if (setNoteState(noteBitmap, pitch, OFF))
+  if (cancelOnset(onsetScheduler, rank, pitch))
   {
-    if (!pushToOutputBuffer(channel, pitch, OFF))
-    {
-      panicAndPause();
-    }
+    return; // It never started
   }
+#endif
+  if (!pushToOutputBuffer(rank, pitch, val))
+  {
+    panicAndPause();
+  }
+#endif
 }
+#endif
 
 /**
- * Sets the note state to the specified value. 0 for off, 1 for on.
- * @param noteBitmap The note bitmap to change
- * @param pitch The note index/pitch to change in the mask
- * @param val false for off, true for on
- *
- * @return true if it changed, false if it did not change
+ * Read and update the state of all read switches. A stop only changes once it has settled, so a
+ * bouncing contact doesn't send a wave of notes for every bounce.
  */
-boolean setNoteState(byte noteBitmap[], byte pitch, boolean val)
+void readStopSwitchStates()
 {
-  if (pitch >= 0 && pitch < NOTES_SIZE)
+  PROFILE_SCOPE(STAGE_READ_STOPS);
+#ifdef STOP_PIN_CHANGE_INTERRUPTS
+  boolean moved = latchStopPorts();
+  if (millis() - lastAnalogStopRead >= STOP_SAMPLE_INTERVAL_MS)
   {
-    boolean current = getBitmapBit(noteBitmap, pitch);
-    setBitmapBit(noteBitmap, pitch, val);
-    return current != val;
+    lastAnalogStopRead = millis();
+    analogReadSwitch(PedalBassFlute8_PIN_20);
+    moved = true;
   }
-  else
+  if (!moved && !stopsSettling(stopDebouncer, rawStopWord))
   {
-    return false;
+    // Nothing has moved since the stops last settled
+    return;
+  }
+#else
+  readRawStopWord();
+#endif
+  if (debounceStops(stopDebouncer, rawStopWord, millis()))
+  {
+    unpackStopWord(stopDebouncer.stable);
   }
 }
 
 /**
- * Read and update the state of all read switches
+ * Read every stop switch pin into rawStopWord
  */
-void readStopSwitchStates()
+void readRawStopWord()
 {
   digitalReadSwitch(SwellOpenDiapason8_PIN_7);
   digitalReadSwitch(SwellStoppedDiapason8_PIN_6);
@@ -650,50 +997,64 @@ void readStopSwitchStates()
   digitalReadSwitch(GreatToPedal_PIN_16);
 }
 
-#ifdef LOCAL_TESTING_MODE
 /**
- * Test function to ignore stop switches and enable everything!
+ * Copy a packed stop word into StopSwitchStates
  */
-void pullOutAllTheStops()
+void unpackStopWord(uint32_t stopWord)
 {
-  StopSwitchStates[SwellOpenDiapason8_PIN_7] = true;
-  StopSwitchStates[SwellStoppedDiapason8_PIN_6] = true;
-  StopSwitchStates[SwellPrincipal4_PIN_5] = true;
-  StopSwitchStates[SwellFlute4_PIN_4] = true;
-  StopSwitchStates[SwellFifteenth2_PIN_3] = true;
-  StopSwitchStates[SwellTwelfth22thirds_PIN_2] = true;
-
-  StopSwitchStates[GreatOpenDiapason8_PIN_15] = true;
-  StopSwitchStates[GreatLieblich8_PIN_14] = true;
-  StopSwitchStates[GreatSalicional8_PIN_13] = true;
-  StopSwitchStates[GreatGemsHorn4_PIN_12] = true;
-  StopSwitchStates[GreatSalicet4_PIN_11] = true;
-  StopSwitchStates[GreatNazard22thirds_PIN_10] = true;
-  StopSwitchStates[GreatHorn8_PIN_9] = true;
-  StopSwitchStates[GreatClarion4_PIN_8] = true;
-
-  StopSwitchStates[PedalBassFlute8_PIN_20] = true; // Principal and String
-  StopSwitchStates[PedalBourdon16_PIN_19] = true;  // Flute
-
-  StopSwitchStates[SwellToGreat_PIN_18] = true;
-  StopSwitchStates[SwellToPedal_PIN_17] = true;
-  StopSwitchStates[GreatToPedal_PIN_16] = true;
+#ifdef COMPACT_STATE
+  StopSwitchStates.word = stopWord;
+#else
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    StopSwitchStates[pin] = (stopWord >> pin) & 1;
+  }
+#endif
+  routingDirty = true;
 }
+
+/**
+ * Set one stop in StopSwitchStates, whichever way it's stored
+ */
+void setStopSwitchState(byte pin, boolean val)
+{
+#ifdef COMPACT_STATE
+  setStopBit(StopSwitchStates.word, pin, val);
+#else
+  StopSwitchStates[pin] = val;
 #endif
+}
 
+#ifdef LOCAL_TESTING_MODE
 /**
- * Resets the state bitmaps for all new states. Ready for calculating
+ * Test function to ignore stop switches and enable everything!
  */
-void resetNewState()
+void pullOutAllTheStops()
 {
-  for (int i = 0; i < NOTES_BITMAP_ARRAY_SIZE; i++)
-  {
-    NewFlutePipesState[i] = 0;
-    NewPrincipalPipesState[i] = 0;
-    NewStringPipesState[i] = 0;
-    NewReedPipesState[i] = 0;
-  }
+  setStopSwitchState(SwellOpenDiapason8_PIN_7, ON);
+  setStopSwitchState(SwellStoppedDiapason8_PIN_6, ON);
+  setStopSwitchState(SwellPrincipal4_PIN_5, ON);
+  setStopSwitchState(SwellFlute4_PIN_4, ON);
+  setStopSwitchState(SwellFifteenth2_PIN_3, ON);
+  setStopSwitchState(SwellTwelfth22thirds_PIN_2, ON);
+
+  setStopSwitchState(GreatOpenDiapason8_PIN_15, ON);
+  setStopSwitchState(GreatLieblich8_PIN_14, ON);
+  setStopSwitchState(GreatSalicional8_PIN_13, ON);
+  setStopSwitchState(GreatGemsHorn4_PIN_12, ON);
+  setStopSwitchState(GreatSalicet4_PIN_11, ON);
+  setStopSwitchState(GreatNazard22thirds_PIN_10, ON);
+  setStopSwitchState(GreatHorn8_PIN_9, ON);
+  setStopSwitchState(GreatClarion4_PIN_8, ON);
+
+  setStopSwitchState(PedalBassFlute8_PIN_20, ON); // Principal and String
+  setStopSwitchState(PedalBourdon16_PIN_19, ON);  // Flute
+
+  setStopSwitchState(SwellToGreat_PIN_18, ON);
+  setStopSwitchState(SwellToPedal_PIN_17, ON);
+  setStopSwitchState(GreatToPedal_PIN_16, ON);
 }
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -701,336 +1062,864 @@ void resetNewState()
 //
 
 /**
- * Combine with keyboard states into the new output states. Update output states with
- * temporary states, comparing to send MIDI On/Off messages.
+ * Compute task. Combine with keyboard states into the next bank of output states, and compare it
+ * with the committed bank to send MIDI On/Off messages. A pass only runs when the keys or stops have
+ * changed since the last one.
+ *
+ * A pass takes as many slices as it needs, yielding whenever the budget runs out, and the diff also
+ * yields every DIFF_BYTES_PER_SLICE bytes. The input task runs between slices and can change the
+ * keyboards part way through building, which is why the held keys are walked from the end of the
+ * list (see HeldKeys.h). If it does, the build starts again from the top, once a pass, so fast
+ * playing can't hold the output up. Once the diff has started, the pipes it has already queued
+ * belong to this build, so it finishes, and the next pass starts straight after with the change.
+ * The banks only change here, so the diff always sees one consistent build.
+ *
+ * When the only change since the last pass is one drawstop, the committed bank is copied and
+ * patched with that stop's pipes instead (see applyStopChange() in OrganEngine.h), which is a few
+ * bitmap operations rather than a walk of every held key.
  */
-void calculateOutputNotes()
+void calculateOutputNotes(Task &task)
 {
-  // Clear out the temp state, so it can be constructed by combining the keyboard states and the active stop switches
-  resetNewState();
+  TASK_BEGIN(task);
 
-  readMidi(); // Keep input buffer clear. Gotta go fast.
+  readStopSwitchStates(); // Update the Stop Switch states
+#ifdef LOCAL_TESTING_MODE
+  pullOutAllTheStops(); // ALL THE STOPS!!!
+#endif
 
-  // Build up the temporary state for each note/keyboard/stop switch combination
-  for (int pitch = 0; pitch < NOTES_SIZE; pitch++)
+  if (routingDirty)
   {
-    if (getBitmapBit(SwellState, pitch))
-    { // This note is pressed down on the Swell keyboard
-      enableNoteForSwellSwitches(pitch);
-    }
-    readMidi(); // Keep input buffer clear. Gotta go fast.
-    if (getBitmapBit(GreatState, pitch))
-    { // This note is pressed down on the Great keyboard
-      enableNoteForGreatSwitches(pitch);
-      if (StopSwitchStates[SwellToGreat_PIN_18]) // Coupler to combine Swell with Pedal
+    computeDiffing = false;
+#ifndef LOCAL_TESTING_MODE // pullOutAllTheStops() changes the stops behind the stop word's back
+    computeStopPin = fullBuildDue ? NO_SINGLE_STOP_CHANGE : singleStopChange(routedStopWord, stopDebouncer.stable);
+    if (computeStopPin != NO_SINGLE_STOP_CHANGE)
+    {
+      // One stop moved and nothing else, so only its pipes change
+      routingDirty = false;
+      routedStopWord = stopDebouncer.stable;
+      for (computeRank = 0; computeRank < RANK_COUNT; computeRank++)
       {
-        // TODO 02: Do we need to transpose up or down any octaves here?
-        enableNoteForSwellSwitches(pitch);
+        RankBanks[committedBank ^ 1][computeRank] = RankBanks[committedBank][computeRank];
       }
+      applyStopChange(StopSwitchStates, KeyboardStates, RankBanks[committedBank ^ 1], computeStopPin);
     }
-    readMidi(); // Keep input buffer clear. Gotta go fast.. Gotta go fast.
-
-    if (getBitmapBit(PedalState, pitch))
-    { // This note is pressed down on the Pedal keyboard
-      enableNoteForPedalSwitches(pitch);
-      if (StopSwitchStates[SwellToPedal_PIN_17]) // Coupler to combine Swell with Pedal
+    else
+#endif
+    {
+      // Build up the next bank for each held key/stop switch combination. See OrganEngine.h
+      computeRestarted = false;
+      for (;;)
       {
-        // TODO 03: Do we need to transpose up or down any octaves here?
-        enableNoteForSwellSwitches(pitch);
+        routingDirty = false;
+        fullBuildDue = false;
+        routedStopWord = stopDebouncer.stable;
+        resetNewState(RankBanks[committedBank ^ 1]);
+        for (computeKeyboard = 0; computeKeyboard < DIVISION_COUNT && !buildIsStale(); computeKeyboard++)
+        {
+          computeCursor = HeldKeys[computeKeyboard].overflowed || divisionIsCoupled(StopSwitchStates, computeKeyboard)
+                              ? 0
+                              : HeldKeys[computeKeyboard].count;
+          for (; computeCursor > 0 && !buildIsStale(); computeCursor--)
+          {
+            if (computeCursor <= HeldKeys[computeKeyboard].count)
+            {
+              enableNoteForDivisionSwitches(StopSwitchStates, RankBanks[committedBank ^ 1], computeKeyboard,
+                                            HeldKeys[computeKeyboard].keys[computeCursor - 1]);
+            }
+            TASK_YIELD_IF_OVER_BUDGET(task);
+          }
+          if (HeldKeys[computeKeyboard].overflowed || divisionIsCoupled(StopSwitchStates, computeKeyboard))
+          {
+            // Coupled (the coupled keyboards come in as shifted bitmaps), or too many keys for the list
+            // (maybe only since this pass started), so go through the division's key bitmap
+            computeKeys = keysPlayingDivision(StopSwitchStates, KeyboardStates, computeKeyboard);
+            while (computeKeys.any() && !buildIsStale())
+            {
+              computePitch = computeKeys.lowest();
+              computeKeys.set(computePitch, false);
+              enableNoteForDivisionSwitches(StopSwitchStates, RankBanks[committedBank ^ 1], computeKeyboard,
+                                            computePitch);
+              TASK_YIELD_IF_OVER_BUDGET(task);
+            }
+          }
+        }
+        if (!buildIsStale())
+        {
+          break;
+        }
+        computeRestarted = true;
       }
-      if (StopSwitchStates[GreatToPedal_PIN_16]) // Coupler to combine Great with Pedal
+    }
+
+    // The next bank now contains all of the active notes. Send MIDI Off/On messages for any output notes
+    // that are different in the committed bank, then make the next bank the committed one.
+#ifndef PIPE_FRAME_OUTPUT
+    // Pipe frames skip the diff, as sendPipeFrame() compares the committed bank with what each board was
+    // last sent, which also covers any frame it couldn't send yet
+    computeDiffing = true;
+    computeDiffBytes = 0;
+    for (computeRank = 0; computeRank < RANK_COUNT; computeRank++)
+    {
+      for (computeWord = 0; computeWord < BITMAP_WORD_COUNT; computeWord++)
       {
-        // TODO 04: Do we need to transpose up or down any octaves here?
-        enableNoteForGreatSwitches(pitch);
+#ifndef SHIFT_REGISTER_OUTPUT
+        // Every pipe in the word might change, so wait until the rank's queue has room for all of them
+        while (!outputBufferHasRoom(computeRank, BITMAP_WORD_BITS))
+        {
+          TASK_YIELD(task);
+        }
+#endif
+        diffRankWord(RankBanks[committedBank][computeRank], RankBanks[committedBank ^ 1][computeRank], computeRank,
+                     computeWord, queuePipeChange);
+        computeDiffBytes += sizeof(BitmapWord);
+        if (computeDiffBytes >= DIFF_BYTES_PER_SLICE || taskOverBudget(task))
+        {
+          computeDiffBytes = 0;
+          TASK_YIELD(task);
+        }
       }
-      readMidi(); // Keep input buffer clear. Gotta go fast.
     }
-    readMidi(); // Keep input buffer clear. Gotta go fast.
+    computeDiffing = false;
+#endif
+    committedBank ^= 1;
+#ifdef SHIFT_REGISTER_OUTPUT
+    shiftFrameDirty = shiftFrameDirty || pipesChanged;
+    pipesChanged = false;
+#endif
   }
 
-  // The temp output states now contain all of the active notes. Update the current output state and send
-  // MIDI Off/On messages for any output notes that have changed.
-  for (byte pitch = 0; pitch < NOTES_SIZE; pitch++)
+  TASK_END(task);
+}
+
+/**
+ * true if the keys or stops changed under a build that can still start again
+ */
+boolean buildIsStale()
+{
+  return routingDirty && !computeRestarted;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Bitmap Functions
+//
+// See Bitmap128.h for the rest of them
+//
+
+/**
+ * Debug function for printing a state
+ */
+void printNoteBitmap(const Bitmap128 &bitmap)
+{
+  for (byte i = 0; i < BITMAP_WORD_COUNT; i++)
   {
-    updateOutputState(FlutePipesState, NewFlutePipesState, FlutePipesChannel, pitch);
-
-    readMidi(); // Keep input buffer clear. Gotta go fast.
-    updateOutputState(PrincipalPipesState, NewPrincipalPipesState, PrincipalPipesChannel, pitch);
-    readMidi(); // Keep input buffer clear. Gotta go fast.
-    updateOutputState(StringPipesState, NewStringPipesState, StringPipesChannel, pitch);
-    readMidi(); // Keep input buffer clear. Gotta go fast.
-    updateOutputState(ReedPipesState, NewReedPipesState, ReedPipesChannel, pitch);
-
-    // Prevent buffer issues by proactively reading and writing pending messages
-    // It's safe to do here because reading new midi notes will will not effect the output states
-    readMidi(); // Keep input buffer clear. Gotta go fast.
-    sendMidi();
+    Serial.print(bitmap.words[i], BIN);
   }
+  Serial.println();
 }
 
-void updateOutputState(byte outputState[], byte newState[], int channel, byte pitch)
+#if !defined(SHIFT_REGISTER_OUTPUT) && !defined(PIPE_FRAME_OUTPUT)
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Output Ring Buffer
+//
+
+// One queue per MIDI output port, see OutputQueue.h. The other output modes send straight from the
+// rank banks, so they don't need the SRAM.
+OutputQueue OutputQueues[OUTPUT_PORT_COUNT] = {};
+static_assert(OUTPUT_QUEUE_SIZE >= BITMAP_WORD_BITS, "The diff waits for room for a whole bitmap word");
+
+/**
+ * Clear every output queue
+ */
+void resetOutputBuffer()
 {
-  if (getBitmapBit(newState, pitch))
+  for (byte port = 0; port < OUTPUT_PORT_COUNT; port++)
   {
-    setNoteStateOn(outputState, pitch, channel);
+    resetOutputQueue(OutputQueues[port]);
   }
-  else
+}
+
+/**
+ * Pushes midi information to the output queue of the rank's port
+ *
+ * @returns false if the queue is full, true if the note was added to the queue
+ */
+boolean pushToOutputBuffer(byte rank, byte pitch, boolean val)
+{
+  OutputQueue &queue = OutputQueues[RANK_OUTPUT_PORTS[rank]];
+  if (!pushOutputQueue(queue, RANK_CHANNELS[rank], pitch, val))
   {
-    setNoteStateOff(outputState, pitch, channel);
+    return false;
   }
+  recordOutputQueueDepth(queue.size);
+  return true;
+}
+
+/**
+ * true if the output queue of the rank's port has room for count more notes
+ */
+boolean outputBufferHasRoom(byte rank, byte count)
+{
+  return outputQueueRoom(OutputQueues[RANK_OUTPUT_PORTS[rank]]) >= count;
 }
 
 /**
- * Updates output notes based on the state of the swell stop switched for the
- * given pitch being on
+ * Remove an encoded midi message from a port's queue and send it on the port.
  *
- * @param pitch The pitch to enable notes for based on stop switch state for Swell
+ * @returns false if the queue is empty, true if a MIDI.send__() was called
  */
-void enableNoteForSwellSwitches(byte pitch)
+boolean popAndSendMidi(byte port)
 {
-  if (StopSwitchStates[SwellOpenDiapason8_PIN_7]) // Swell Stop To Principal Pipes
+  byte channel;
+  byte pitch;
+  boolean val;
+  if (!popOutputQueue(OutputQueues[port], channel, pitch, val))
   {
-    setNoteState(NewPrincipalPipesState, pitch, ON);
+    // Queue is empty, nothing to send
+    return false;
   }
-  if (StopSwitchStates[SwellStoppedDiapason8_PIN_6]) // Swell Stop To Flute Pipes
+
+  // Send the note
+  if (val)
   {
-    setNoteState(NewFlutePipesState, pitch, ON);
+    OUTPUT_MIDI[port]->sendNoteOn(pitch, DEFAULT_OUTPUT_VELOCITY, channel);
   }
-  if (StopSwitchStates[SwellPrincipal4_PIN_5]) // Swell Stop To Principal Pipes + 1 Octave
+  else
   {
-    setNoteState(NewPrincipalPipesState, pitch + OCTAVE, ON);
+    OUTPUT_MIDI[port]->sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, channel);
   }
-  if (StopSwitchStates[SwellFlute4_PIN_4]) // Swell Stop To Flute Pipes + 1 & 2 Octave
+  return true;
+}
+
+#ifdef ONSET_SCHEDULING
+/**
+ * Send a pipe the onset scheduler has released
+ *
+ * @returns false if the rank's queue is full, so it stays pending
+ */
+boolean releaseOnset(byte rank, byte pitch)
+{
+  return pushToOutputBuffer(rank, pitch, ON);
+}
+#endif
+#endif
+
+#ifdef SHIFT_REGISTER_OUTPUT
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Shift Register Output
+//
+
+/**
+ * Send the committed bank out to the shift registers
+ */
+void sendShiftFrame()
+{
+  buildShiftRegisterFrame(RankBanks[committedBank], shiftFrame);
+  SPI.beginTransaction(SPISettings(SHIFT_REGISTER_SPI_HZ, MSBFIRST, SPI_MODE0));
+  sendShiftRegisterFrame(shiftBus, shiftFrame);
+  SPI.endTransaction();
+  shiftFrameDirty = false;
+}
+#endif
+
+#ifdef PIPE_FRAME_OUTPUT
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Pipe Frame Output
+//
+
+/**
+ * Send a frame with the rank's changes since its last frame, if it has any and there's room for
+ * the biggest frame in the output buffer
+ *
+ * @return false if the rank still has something to send
+ */
+boolean sendPipeFrame(byte rank)
+{
+  const Bitmap128 &pipes = RankBanks[committedBank][rank];
+  boolean bitmapDue = bitmapFramesDue & (1 << rank);
+  if (!bitmapDue && pipes == SentRanks[rank])
   {
-    setNoteState(NewFlutePipesState, pitch + OCTAVE, ON);
-    setNoteState(NewFlutePipesState, pitch + TWO_OCTAVE, ON);
+    return true;
   }
-  if (StopSwitchStates[SwellFifteenth2_PIN_3]) // Swell Stop To Principal Pipes + 2 Octave
+  byte port = RANK_OUTPUT_PORTS[rank];
+  if (OUTPUT_SERIALS[port]->availableForWrite() < PIPE_FRAME_MAX_BYTES)
   {
-    setNoteState(NewPrincipalPipesState, pitch + TWO_OCTAVE, ON);
+    return false;
   }
-  if (StopSwitchStates[SwellTwelfth22thirds_PIN_2]) // Swell Stop To Principal Pipes + 2 Octave and a fifth
+  byte frame[PIPE_FRAME_MAX_BYTES];
+  byte length = encodePipeFrame(pipeFrameSequences[port]++, rank, SentRanks[rank], pipes, bitmapDue, frame);
+  OUTPUT_SERIALS[port]->write(frame, length);
+  SentRanks[rank] = pipes;
+  bitmapFramesDue &= ~(1 << rank);
+  if (resyncFramesDue & (1 << rank))
   {
-    setNoteState(NewPrincipalPipesState, pitch + TWELFTH, ON);
+    // Count what the frame really took, the narrower ranks' bitmaps are shorter
+    resync.bytes += length;
+    resyncFramesDue &= ~(1 << rank);
   }
+  return true;
 }
+#endif
 
+#ifndef SHIFT_REGISTER_OUTPUT
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Background Resync
+//
+
+#ifdef PIPE_FRAME_OUTPUT
 /**
- * Updates output notes based on the state of the swell stop switched for the
- * given pitch being on
- *
- * @param pitch The pitch to enable notes for based on stop switch state for Great Switches
+ * Have the next rank sent as a bitmap frame, as long as every rank is up to date
  */
-void enableNoteForGreatSwitches(byte pitch)
+void sendResyncWindow()
 {
-  if (StopSwitchStates[GreatOpenDiapason8_PIN_15]) // Great Stop To Principal Pipes
-  {
-    setNoteState(NewPrincipalPipesState, pitch, ON);
-  }
-  if (StopSwitchStates[GreatLieblich8_PIN_14]) // Great Stop To Flute Pipes
+  if (bitmapFramesDue != 0)
   {
-    setNoteState(NewFlutePipesState, pitch, ON);
-  }
-  if (StopSwitchStates[GreatSalicional8_PIN_13]) // Great Stop To String Pipes
-  {
-    setNoteState(NewStringPipesState, pitch, ON);
+    return;
   }
-  if (StopSwitchStates[GreatGemsHorn4_PIN_12]) // TODO 05: Great Stop To DONT KNOW YET
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
   {
-    setNoteState(NewPrincipalPipesState, pitch + OCTAVE, ON);
+    if (RankBanks[committedBank][rank] != SentRanks[rank])
+    {
+      return;
+    }
   }
-  if (StopSwitchStates[GreatSalicet4_PIN_11]) // TODO 06: Great Stop To DONT KNOW YET
+  bitmapFramesDue |= 1 << resync.rank;
+  resyncFramesDue |= 1 << resync.rank; // sendPipeFrame() adds the frame's bytes once it's sent
+  resync.pipes += RANK_RANGES[resync.rank].highest - RANK_RANGES[resync.rank].lowest + 1;
+  advanceResyncRank(resync);
+  resync.lastWindow = millis();
+}
+#else
+/**
+ * Re-send the state of the next window of pipes, as long as nothing real is waiting to go out.
+ * The queues only empty out between routing passes once everything the committed bank changed has
+ * been sent, so the committed bank is what the pipes were last told.
+ */
+void sendResyncWindow()
+{
+  if (computeTask.resume != 0)
   {
-    setNoteState(NewStringPipesState, pitch + OCTAVE, ON);
+    return; // Part of the next bank may have been sent already
   }
-  if (StopSwitchStates[GreatNazard22thirds_PIN_10]) // Great Stop To Flute Rank Plus a third
+  for (byte port = 0; port < OUTPUT_PORT_COUNT; port++)
   {
-    setNoteState(NewFlutePipesState, pitch + TWELFTH, ON);
+    if (OutputQueues[port].size != 0)
+    {
+      return;
+    }
   }
-  if (StopSwitchStates[GreatHorn8_PIN_9]) // Great Stop To Reeds
+#ifdef ONSET_SCHEDULING
+  if (onsetsPending(onsetScheduler))
   {
-    setNoteState(NewReedPipesState, pitch, ON);
+    return;
   }
-  if (StopSwitchStates[GreatClarion4_PIN_8]) // Great Stop To Reeds + Octave
+#endif
+  for (byte i = 0; i < RESYNC_WINDOW_PIPES; i++)
   {
-    setNoteState(NewReedPipesState, pitch + OCTAVE, ON);
+    byte port = RANK_OUTPUT_PORTS[resync.rank];
+    if (OUTPUT_SERIALS[port]->availableForWrite() < MIDI_MESSAGE_MAX_BYTES)
+    {
+      return; // Carry on from here next time
+    }
+    if (!RankBanks[committedBank][resync.rank].get(resync.pitch))
+    {
+      OUTPUT_MIDI[port]->sendNoteOff(resync.pitch, DEFAULT_OUTPUT_VELOCITY, RANK_CHANNELS[resync.rank]);
+      resync.bytes += MIDI_MESSAGE_MAX_BYTES;
+    }
+#ifdef RESYNC_REASSERT_ON
+    else
+    {
+      OUTPUT_MIDI[port]->sendNoteOn(resync.pitch, DEFAULT_OUTPUT_VELOCITY, RANK_CHANNELS[resync.rank]);
+      resync.bytes += MIDI_MESSAGE_MAX_BYTES;
+    }
+#endif
+    resync.pipes++;
+    advanceResyncPipe(resync);
   }
+  resync.lastWindow = millis();
+}
+#endif
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// IO Helpers
+//
+
+/**
+ * Read the specified digital pin into the raw stop word
+ */
+void digitalReadSwitch(byte pin)
+{
+  setStopBit(rawStopWord, pin, digitalRead(stopInputPin(pin)) == HIGH);
+}
+
+/**
+ * Read the specific analog pin into the raw stop word
+ */
+void analogReadSwitch(byte pin)
+{
+  setStopBit(rawStopWord, pin, analogRead(stopInputPin(pin)) > 200);
+}
+
+#ifdef STOP_PIN_CHANGE_INTERRUPTS
+/**
+ * Stop pins D2-D7 are PD2-PD7, D8-D13 are PB0-PB5 and D14-D19 (A0-A5) are PC0-PC5, so the three
+ * port snapshots drop straight into the stop word. D0/D1 are the MIDI UART and aren't watched.
+ */
+#define STOP_PORT_D_MASK 0xFC
+#define STOP_PORT_B_MASK 0x3F
+#define STOP_PORT_C_MASK 0x3F
+
+/**
+ * Take a snapshot of the stop ports and turn on their pin change interrupts
+ */
+void setupStopInterrupts()
+{
+  noInterrupts();
+  stopPortB = PINB;
+  stopPortC = PINC;
+  stopPortD = PIND;
+  stopsDirty = true;
+  PCMSK0 = STOP_PORT_B_MASK;
+  PCMSK1 = STOP_PORT_C_MASK;
+  PCMSK2 = STOP_PORT_D_MASK;
+  PCICR = _BV(PCIE0) | _BV(PCIE1) | _BV(PCIE2);
+  interrupts();
 }
 
 /**
- * Updates output notes based on the state of the swell stop switched for the
- * given pitch being on
+ * If a stop pin changed since last time, decode the port snapshots into rawStopWord
  *
- * @param pitch The pitch to enable notes for based on stop switch state for Pedal Switches
+ * @return true if a stop pin changed
  */
-void enableNoteForPedalSwitches(byte pitch)
+boolean latchStopPorts()
 {
-  if (StopSwitchStates[PedalBassFlute8_PIN_20]) // Great Stop to Principal and String
+  if (!stopsDirty)
   {
-    setNoteState(NewPrincipalPipesState, pitch, ON);
-    setNoteState(NewStringPipesState, pitch, ON);
-  }
-  if (StopSwitchStates[PedalBourdon16_PIN_19]) // Great Stop To Bourdon Pipes (Flute)
-  {
-    setNoteState(NewFlutePipesState, pitch, ON);
+    return false;
   }
+  noInterrupts();
+  byte portB = stopPortB;
+  byte portC = stopPortC;
+  byte portD = stopPortD;
+  stopsDirty = false;
+  interrupts();
+
+  uint32_t digitalStops = (portD & STOP_PORT_D_MASK) | ((uint32_t)(portB & STOP_PORT_B_MASK) << 8) |
+                          ((uint32_t)(portC & STOP_PORT_C_MASK) << 14);
+  rawStopWord = (rawStopWord & ((uint32_t)1 << PedalBassFlute8_PIN_20)) | digitalStops;
+  return true;
 }
 
+/**
+ * Pin change interrupts. Keep these tiny, they share the CPU with the UART receive interrupt.
+ */
+ISR(PCINT0_vect)
+{
+  stopPortB = PINB;
+  stopsDirty = true;
+}
+
+ISR(PCINT1_vect)
+{
+  stopPortC = PINC;
+  stopsDirty = true;
+}
+
+ISR(PCINT2_vect)
+{
+  stopPortD = PIND;
+  stopsDirty = true;
+}
+#endif
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// Bitmap Functions
+// SysEx
 //
 
 /**
- * Sets a single bit to on or off in the provided noteState bitmap
+ * Handler called by the MIDI Library for incoming SysEx messages. Only our own diagnostic
+ * commands are understood, everything else is ignored.
+ *
+ * @param message The full message, including the 0xF0 and 0xF7 boundaries
+ * @param size Number of bytes in the message
  */
-void setBitmapBit(byte bitmap[], byte index, byte val)
+void handleSysEx(byte *message, unsigned size)
 {
-  int byteIndex = index >> 3;
-  int bitOffset = index & 7;
-
-  if (val)
-  { // Set the bit to 1
-    bitmap[byteIndex] |= (1 << bitOffset);
+  if (size < 4 || message[1] != SYSEX_MANUFACTURER_ID)
+  {
+    return;
   }
-  else
-  { // Set the bit to 0
-    bitmap[byteIndex] &= ~(1 << bitOffset);
+  switch (message[2])
+  {
+  case SYSEX_STATS_REPORT:
+    sendStatsReport();
+    break;
+  case SYSEX_STATS_RESET:
+    resetStats();
+    sendStatsReport();
+    break;
+  case SYSEX_DEBOUNCE_REPORT:
+    sendDebounceReport();
+    break;
+  case SYSEX_SCHEDULER_REPORT:
+    sendSchedulerReport();
+    break;
+  case SYSEX_FILTER_REPORT:
+    sendFilterReport();
+    break;
+#ifdef PIPE_FRAME_OUTPUT
+  case SYSEX_PIPE_RESYNC:
+    bitmapFramesDue = (1 << RANK_COUNT) - 1;
+    break;
+#endif
+#ifndef SHIFT_REGISTER_OUTPUT
+  case SYSEX_RESYNC_REPORT:
+    sendResyncReport();
+    break;
+#endif
+#ifdef ONSET_SCHEDULING
+  case SYSEX_ONSET_REPORT:
+    sendOnsetReport();
+    break;
+#endif
   }
 }
 
 /**
- * Sets a single bit to on or off in the provided noteState bitmap
+ * SysEx data bytes only have 7 bits, so values are split into 7 bit chunks, lowest first.
+ *
+ * @returns the new length of the message
  */
-bool getBitmapBit(byte bitmap[], byte index)
+byte appendSysExValue(byte message[], byte length, unsigned long value, byte byteCount)
 {
-  int byteIndex = index >> 3;
-  int bitOffset = index & 7;
-  return (bitmap[byteIndex] >> bitOffset) & 1;
+  for (byte i = 0; i < byteCount; i++)
+  {
+    message[length++] = value & 0x7F;
+    value >>= 7;
+  }
+  return length;
 }
 
 /**
- * Debug function for printing a state
+ * Reports how many times the stop word changed since power on, how many of those changes made it
+ * through the debouncer, and how many recomputes it prevented
  */
-void printNoteBitmap(byte bitmap[])
+void sendDebounceReport()
 {
-  for (int i = 0; i < NOTES_BITMAP_ARRAY_SIZE; i++)
+  byte message[2 + 5 * 3];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_DEBOUNCE_REPORT;
+  length = appendSysExValue(message, length, stopDebouncer.rawChanges, 5);
+  length = appendSysExValue(message, length, stopDebouncer.stableChanges, 5);
+  length = appendSysExValue(message, length, bounceRecomputesPrevented(stopDebouncer), 5);
+  MIDI.sendSysEx(length, message);
+}
+
+/**
+ * Reports how many messages the input filter dropped, added up over every input: realtime, control
+ * changes, aftertouch, other SysEx and everything else (5 bytes each, in MidiDropClass order)
+ */
+void sendFilterReport()
+{
+  byte message[2 + 5 * MIDI_DROP_CLASS_COUNT];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_FILTER_REPORT;
+  for (byte dropClass = 0; dropClass < MIDI_DROP_CLASS_COUNT; dropClass++)
   {
-    Serial.print(bitmap[i], BIN);
+    uint32_t dropped = 0;
+    for (byte port = 0; port < INPUT_PORT_COUNT; port++)
+    {
+      dropped += INPUT_TRANSPORTS[port]->filter.dropped[dropClass];
+    }
+    length = appendSysExValue(message, length, dropped, 5);
   }
-  Serial.println();
+  MIDI.sendSysEx(length, message);
+}
+
+/**
+ * Reports how many slices of each task (input, compute, output) ran over budget, and the longest
+ * slice of each in microseconds
+ */
+void sendSchedulerReport()
+{
+  const Task *tasks[] = {&inputTask, &computeTask, &outputTask};
+  byte message[2 + 3 * (3 + 3)];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_SCHEDULER_REPORT;
+  for (byte i = 0; i < 3; i++)
+  {
+    length = appendSysExValue(message, length, tasks[i]->overruns, 3);
+    length = appendSysExValue(message, length, tasks[i]->worstSliceMicros, 3);
+  }
+  MIDI.sendSysEx(length, message);
+}
+
+#ifndef SHIFT_REGISTER_OUTPUT
+/**
+ * Reports what the background resync has cost: the bytes it has sent on the output ports and the
+ * pipes it has refreshed (5 bytes each), and how many times it has been round every pipe (3 bytes)
+ */
+void sendResyncReport()
+{
+  byte message[2 + 5 + 5 + 3];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_RESYNC_REPORT;
+  length = appendSysExValue(message, length, resync.bytes, 5);
+  length = appendSysExValue(message, length, resync.pipes, 5);
+  length = appendSysExValue(message, length, resync.sweeps, 3);
+  MIDI.sendSysEx(length, message);
 }
+#endif
+
+#ifdef ONSET_SCHEDULING
+/**
+ * Reports how much the onset scheduler has delayed the pipes: pipes started and pipes held back a
+ * slice or more (5 bytes each), the total delay in milliseconds over every pipe started (5 bytes,
+ * divide by the pipes for the average), and the longest delay in milliseconds (3 bytes)
+ */
+void sendOnsetReport()
+{
+  byte message[2 + 5 + 5 + 5 + 3];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_ONSET_REPORT;
+  length = appendSysExValue(message, length, onsetScheduler.onsets, 5);
+  length = appendSysExValue(message, length, onsetScheduler.delayedOnsets, 5);
+  length = appendSysExValue(message, length, onsetScheduler.totalDelayMs, 5);
+  length = appendSysExValue(message, length, onsetScheduler.worstDelayMs, 3);
+  MIDI.sendSysEx(length, message);
+}
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// Output Ring Buffer
+// Persistent Stats
+//
+// High water marks that survive a power cycle, so we can tell whether the brain came close to
+// dropping notes during the last service without having a laptop attached at the time.
 //
 
-// We're using words to store the note in the lower byte and the channel and on/off in the upper byte
-word outputRingBuffer[RING_BUFFER_MAX_SIZE] = {};
-
-int outputRingHead = 0; // Start of buffer (where to read from)
-int outputRingTail = 0; // End of buffer (where to write to)
-int outputRingSize = 0; // Number of pending output bytes. If this ever gets bigger than the max size, panic!
+struct PersistentStats
+{
+  unsigned long worstLoopMicros; // Longest loop() pass, not counting passes that panicked
+  word peakOutputQueueDepth;     // Most notes ever waiting in the output ring buffer
+  word rxOverruns;               // Times a serial input buffer filled up, saturates at 0xFFFF
+  word panics;                   // Times panicAndPause() was triggered
+};
 
 /**
- * Clear the buffer by resetting the head, tail, and size. No need to
- * write over existing data in the buffer array.
+ * One EEPROM slot. The checksum is written last, so a slot that was only partially written when
+ * the power went out is ignored and the previous slot is used instead.
  */
-void resetOutputBuffer()
+struct StatsRecord
+{
+  word sequence;
+  PersistentStats stats;
+  byte checksum;
+};
+
+PersistentStats stats = {};
+boolean statsDirty = false;            // Something changed since the last save
+boolean statsLoopPanicked = false;     // Don't count the panic wait as loop time
+word statsSequence = 0;                // Sequence number of the newest saved record
+byte statsSlot = STATS_SLOT_COUNT - 1; // Slot holding the newest saved record
+unsigned long lastStatsSave = 0;
+
+// The record being written, one byte per loop() pass
+StatsRecord statsWriteRecord;
+byte statsWriteIndex = sizeof(StatsRecord); // Equal to the record size when no write is in progress
+
+byte statsChecksum(const StatsRecord &record)
 {
-  outputRingHead = 0;
-  outputRingTail = 0;
-  outputRingSize = 0;
+  const byte *bytes = (const byte *)&record;
+  byte checksum = 0x5A; // Blank (0xFF) or zeroed EEPROM never has a valid checksum
+  for (byte i = 0; i < sizeof(StatsRecord) - 1; i++)
+  {
+    checksum ^= bytes[i];
+  }
+  return checksum;
 }
 
 /**
- * Pushes midi information to the output ring buffer
- *
- * @returns false if the buffer is full, true if the note was added to the buffer
+ * Find the newest valid record in the EEPROM slots and load it. Sequence numbers are compared
+ * with serial number arithmetic, so they can wrap around.
  */
-boolean pushToOutputBuffer(byte channel, byte pitch, boolean val)
+void loadStats()
 {
-  // Check if the buffer is full (it will start overwriting queued notes if we don't do something about it)
-  if (outputRingSize >= RING_BUFFER_MAX_SIZE)
+  boolean found = false;
+  StatsRecord newest;
+  for (byte slot = 0; slot < STATS_SLOT_COUNT; slot++)
   {
-    return false; // The buffer is full, cannot add or we will overflow
+    StatsRecord record;
+    EEPROM.get(STATS_EEPROM_ADDRESS + slot * sizeof(StatsRecord), record);
+    if (record.checksum != statsChecksum(record))
+    {
+      continue;
+    }
+    if (!found || (int16_t)(record.sequence - newest.sequence) > 0)
+    {
+      found = true;
+      newest = record;
+      statsSlot = slot;
+    }
   }
 
-  // encode the note into a space efficient word (2 bytes)
-  word encodedNote = pitch | (channel << 8) | ((val ? 1 : 0) << 15);
-
-  // Add it to the buffer and advance the tail pointer
-  outputRingBuffer[outputRingTail++] = encodedNote;
-  outputRingSize++;
-
-  // Check if we're past the edge of the array so we can loop back around for the next one
-  if (outputRingTail >= RING_BUFFER_MAX_SIZE - 1)
+  if (found)
   {
-    outputRingTail = 0;
+    stats = newest.stats;
+    statsSequence = newest.sequence;
   }
-
-  return true;
 }
 
 /**
- * Remove an encoded midi message from the buffer and send it.
+ * Start saving the stats to the next slot if they changed and STATS_SAVE_INTERVAL_MS has passed
+ * since the last save. Otherwise, continue a save in progress.
  *
- * @returns false if the buffer is empty, true if a MIDI.send__() was called
+ * An EEPROM byte write takes about 3.3ms, but the hardware does it in the background. We only hand
+ * it a new byte when it's done with the last one, so this never blocks the loop.
  */
-boolean popAndSendMidi()
+void saveStatsIfDue()
 {
-  if (outputRingSize <= 0)
+  if (statsWriteIndex < sizeof(StatsRecord))
   {
-    // Buffer is empty, nothing to send
-    return false;
+    if (eeprom_is_ready())
+    {
+      int address = STATS_EEPROM_ADDRESS + statsSlot * sizeof(StatsRecord) + statsWriteIndex;
+      EEPROM.update(address, ((byte *)&statsWriteRecord)[statsWriteIndex]);
+      statsWriteIndex++;
+    }
+    return;
   }
 
-  // Get the next encoded midi message and advance the head pointer
-  word encodedNote = outputRingBuffer[outputRingHead++];
-  outputRingSize--;
+  unsigned long now = millis();
+  if (!statsDirty || now - lastStatsSave < STATS_SAVE_INTERVAL_MS)
+  {
+    return;
+  }
+  lastStatsSave = now;
+  statsDirty = false;
+
+  statsSequence++;
+  statsSlot = (statsSlot + 1) % STATS_SLOT_COUNT;
+  statsWriteRecord.sequence = statsSequence;
+  statsWriteRecord.stats = stats;
+  statsWriteRecord.checksum = statsChecksum(statsWriteRecord);
+  statsWriteIndex = 0;
+}
 
-  // Decode the midi note information
-  byte pitch = encodedNote & 0x00FF;
-  byte channel = (encodedNote >> 8) & 0b01111111;
-  bool val = (encodedNote >> 15) == 1;
+/**
+ * Clear the stats. The cleared values are saved like any other change.
+ */
+void resetStats()
+{
+  stats = PersistentStats();
+  statsDirty = true;
+  lastStatsSave = millis() - STATS_SAVE_INTERVAL_MS;
+}
 
-  // Send the note
-  if (val)
+/**
+ * Send the stats as a SysEx message.
+ *
+ * Message body: manufacturer ID, SYSEX_STATS_REPORT, worst loop time in microseconds (5 bytes),
+ * then the peak output queue depth, RX overruns and panics (3 bytes each). See appendSysExValue().
+ */
+void sendStatsReport()
+{
+  byte message[2 + 5 + 3 * 3];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_STATS_REPORT;
+  length = appendSysExValue(message, length, stats.worstLoopMicros, 5);
+  length = appendSysExValue(message, length, stats.peakOutputQueueDepth, 3);
+  length = appendSysExValue(message, length, stats.rxOverruns, 3);
+  length = appendSysExValue(message, length, stats.panics, 3);
+  MIDI.sendSysEx(length, message);
+}
+
+void recordLoopTime(unsigned long loopMicros)
+{
+  if (statsLoopPanicked)
   {
-    MIDI.sendNoteOn(pitch, DEFAULT_OUTPUT_VELOCITY, channel);
+    statsLoopPanicked = false;
+    return;
   }
-  else
+  if (loopMicros > stats.worstLoopMicros)
   {
-    MIDI.sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, channel);
+    stats.worstLoopMicros = loopMicros;
+    statsDirty = true;
   }
+}
 
-  // Check if we're past the edge of the array so we can loop back around
-  if (outputRingHead >= RING_BUFFER_MAX_SIZE - 1)
+void recordOutputQueueDepth(int depth)
+{
+  if ((word)depth > stats.peakOutputQueueDepth)
   {
-    outputRingHead = 0;
+    stats.peakOutputQueueDepth = depth;
+    statsDirty = true;
   }
+}
 
-  return true;
+void recordRxOverrun()
+{
+  if (stats.rxOverruns < 0xFFFF)
+  {
+    stats.rxOverruns++;
+    statsDirty = true;
+  }
+}
+
+void recordPanic()
+{
+  stats.panics++;
+  statsDirty = true;
+  statsLoopPanicked = true;
 }
 
+#ifdef ORGAN_PROFILING
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //
-// IO Helpers
+// Profiling
 //
 
 /**
- * Read the specified digital pin into a StopSwitchState
+ * Sends the histogram of one profiled stage as a SysEx message every PROFILE_REPORT_INTERVAL_MS,
+ * cycling through the stages. The pipe boards ignore SysEx, so this can run during a service.
+ *
+ * Message body: manufacturer ID, SYSEX_PROFILE_REPORT, stage, then PROFILE_BUCKET_COUNT bucket
+ * counts followed by the max ticks. See appendSysExValue() for how the values are encoded.
  */
-void digitalReadSwitch(byte pin)
+void sendProfileReport()
 {
-  StopSwitchStates[pin] = digitalRead(pin) == HIGH;
-}
+  unsigned long now = millis();
+  if (now - lastProfileReport < PROFILE_REPORT_INTERVAL_MS)
+  {
+    return;
+  }
+  lastProfileReport = now;
+
+  const ProfileHistogram &histogram = profileHistograms[nextProfileReportStage];
+  byte message[3 + (PROFILE_BUCKET_COUNT + 1) * 3];
+  byte length = 0;
+  message[length++] = SYSEX_MANUFACTURER_ID;
+  message[length++] = SYSEX_PROFILE_REPORT;
+  message[length++] = nextProfileReportStage;
+  for (byte i = 0; i < PROFILE_BUCKET_COUNT; i++)
+  {
+    length = appendSysExValue(message, length, histogram.buckets[i], 3);
+  }
+  length = appendSysExValue(message, length, histogram.maxTicks, 3);
+  MIDI.sendSysEx(length, message);
 
-/**
- * Read the specific analog pin into a StopSwitchState
- */
-void analogReadSwitch(byte pin)
-{
-  StopSwitchStates[pin] = analogRead(pin) > 200;
-}
\ No newline at end of file
+  nextProfileReportStage = (nextProfileReportStage + 1) % PROFILE_STAGE_COUNT;
+}
+#endif
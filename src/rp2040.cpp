@@ -0,0 +1,180 @@
+/**
+ * LMNC Organ Brain - RP2040 Dual Core Firmware
+ *
+ * The two core version of the brain, see Pipeline.h. Core 0 runs setup() and loop(): MIDI input
+ * and the stop switches. Core 1 runs setup1() and loop1(): routing and MIDI output. Both cores use
+ * Serial1 (UART0, TX on GP0, RX on GP1), core 0 only reading and core 1 only writing, each through
+ * its own MIDI Library instance so neither touches the other's state.
+ *
+ * The stop switches are on the GPIOs with the same numbers as their Nano pins, so the routing in
+ * OrganConfig.h works unchanged. The diagnostics (SysEx reports, EEPROM stats and profiling) are
+ * still AVR only.
+ *
+ * Only built by env:pico, which leaves out main.cpp.
+ */
+#ifdef ARDUINO_ARCH_RP2040
+
+#include <Arduino.h>
+#include <MIDI.h>
+#include <atomic>
+
+#include "OrganConfig.h"
+#include "StopDebouncer.h"
+#include "Pipeline.h"
+
+MIDI_CREATE_INSTANCE(SerialUART, Serial1, MIDI);
+MIDI_CREATE_INSTANCE(SerialUART, Serial1, MIDI_OUT);
+
+const byte STOP_PINS[] = {
+    SwellOpenDiapason8_PIN_7, SwellStoppedDiapason8_PIN_6, SwellPrincipal4_PIN_5, SwellFlute4_PIN_4,
+    SwellFifteenth2_PIN_3, SwellTwelfth22thirds_PIN_2, GreatOpenDiapason8_PIN_15, GreatLieblich8_PIN_14,
+    GreatSalicional8_PIN_13, GreatGemsHorn4_PIN_12, GreatSalicet4_PIN_11, GreatNazard22thirds_PIN_10,
+    GreatHorn8_PIN_9, GreatClarion4_PIN_8, PedalBassFlute8_PIN_20, PedalBourdon16_PIN_19,
+    SwellToGreat_PIN_18, SwellToPedal_PIN_17, GreatToPedal_PIN_16,
+};
+
+/**
+ * Shared between the cores. Both queues start out empty from static initialisation, before either
+ * core runs.
+ */
+Pipeline pipeline;
+std::atomic<bool> outputReady(false); // Core 0 has started Serial1, so core 1 can send
+
+// Core 0
+StopDebouncer stopDebouncer = {};
+boolean stopWordPending = false; // The stops changed, but the stop queue was full
+
+// Core 1
+RoutingCore routingCore;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Forward Declarations
+//
+
+// Core 0
+void handleMidiNoteOn(byte channel, byte pitch, byte velocity);
+void handleMidiNoteOff(byte channel, byte pitch, byte velocity);
+void handleMidiNote(byte channel, byte pitch, boolean value);
+uint32_t readRawStopWord();
+
+// Core 1
+void sendPipeChange(byte rank, byte pitch, boolean on);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Core 0: Input
+//
+
+void setup()
+{
+  for (byte pin : STOP_PINS)
+  {
+    pinMode(pin, INPUT);
+  }
+  resetStopDebouncer(stopDebouncer, readRawStopWord(), millis());
+  stopWordPending = true;
+
+  MIDI.setHandleNoteOn(handleMidiNoteOn);
+  MIDI.setHandleNoteOff(handleMidiNoteOff);
+  MIDI.begin(MIDI_CHANNEL_OMNI);
+  MIDI.turnThruOff();
+  outputReady.store(true, std::memory_order_release);
+}
+
+void loop()
+{
+  // A message queues at most one key, so only read while there's room for one. Otherwise the input
+  // waits in the UART's buffer until core 1 catches up.
+  while (spscQueueHasRoom(pipeline.keys, 1) && MIDI.read())
+  {
+  }
+
+  if (debounceStops(stopDebouncer, readRawStopWord(), millis()))
+  {
+    stopWordPending = true;
+  }
+  if (stopWordPending && pushSpscQueue(pipeline.stops, stopDebouncer.stable))
+  {
+    stopWordPending = false;
+  }
+}
+
+void handleMidiNoteOn(byte channel, byte pitch, byte velocity)
+{
+  handleMidiNote(channel, pitch, true);
+}
+
+void handleMidiNoteOff(byte channel, byte pitch, byte velocity)
+{
+  handleMidiNote(channel, pitch, false);
+}
+
+void handleMidiNote(byte channel, byte pitch, boolean value)
+{
+  for (byte keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    if (KEYBOARD_CHANNELS[keyboard] == channel)
+    {
+      pushKeyEvent(pipeline, keyboard, pitch, value); // loop() made sure there's room
+      return;
+    }
+  }
+}
+
+/**
+ * Every stop switch as a packed word, bit n = pin n
+ */
+uint32_t readRawStopWord()
+{
+  uint32_t stopWord = 0;
+  for (byte pin : STOP_PINS)
+  {
+    setStopBit(stopWord, pin, digitalRead(pin) == HIGH);
+  }
+  return stopWord;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Core 1: Routing and Output
+//
+
+void setup1()
+{
+  resetRoutingCore(routingCore);
+  while (!outputReady.load(std::memory_order_acquire))
+  {
+  }
+
+  // Start with every pipe off, like the AVR's panic at power on
+  for (int pitch = PIPES_LOWEST_PITCH; pitch <= PIPES_HIGHEST_PITCH; pitch++)
+  {
+    for (byte rank = 0; rank < RANK_COUNT; rank++)
+    {
+      if (inRange(RANK_RANGES[rank], pitch))
+      {
+        sendPipeChange(rank, pitch, false);
+      }
+    }
+  }
+}
+
+void loop1()
+{
+  runRoutingPass(pipeline, routingCore, sendPipeChange);
+}
+
+void sendPipeChange(byte rank, byte pitch, boolean on)
+{
+  if (on)
+  {
+    MIDI_OUT.sendNoteOn(pitch, DEFAULT_OUTPUT_VELOCITY, RANK_CHANNELS[rank]);
+  }
+  else
+  {
+    MIDI_OUT.sendNoteOff(pitch, DEFAULT_OUTPUT_VELOCITY, RANK_CHANNELS[rank]);
+  }
+}
+
+#endif // ARDUINO_ARCH_RP2040
@@ -1,101 +1,982 @@
+/**
+ * LMNC Organ Brain - Unit tests and microbenchmarks for the header-only code in include/
+ *
+ * Run on the Nano with `pio test -e nanoatmega328` or on the host with `pio test -e native`. The
+ * benchmarks print the time per operation with TEST_MESSAGE, so run with -v to see them.
+ */
+#ifdef ARDUINO
 #include <Arduino.h>
+#else
+#include <chrono>
+#endif
+#include <stdio.h>
+#include <unity.h>
+
+#include "Bitmap128.h"
+#include "HeldKeys.h"
+#include "StopDebouncer.h"
+#include "OrganEngine.h"
+#include "OutputQueue.h"
+#include "ShiftRegisterOutput.h"
+#include "PipeFrames.h"
+#include "BackgroundResync.h"
+#include "OnsetScheduler.h"
+#include "MidiInputFilter.h"
+
+// The scheduler tests drive the clock themselves
+unsigned long fakeMicros = 0;
+#define TASK_MICROS() fakeMicros
+#include "Scheduler.h"
+
+void setUp() {}
+void tearDown() {}
 
-#define u_long unsigned long
-
-const byte NOTES_SIZE = 128;
-const byte NOTES_STATE_ARRAY_SIZE = NOTES_SIZE / 32;
-// Each state needs to hold
-
-// State for the input keyboards
-u_long SwellState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long GreatState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long PedalState[NOTES_STATE_ARRAY_SIZE] = {};
-
-//State for the output channels
-u_long PrincipalPipesState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long StringPipesState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long FlutePipesState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long ReedPipesState[NOTES_STATE_ARRAY_SIZE] = {};
-
-//Temporary state to combinie keboard and stop states
-u_long TempPrincipalPipesState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long TempStringPipesState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long TempFlutePipesState[NOTES_STATE_ARRAY_SIZE] = {};
-u_long TempReedPipesState[NOTES_STATE_ARRAY_SIZE] = {};
-
-
-//////////////////////////////////////////
-//  State aray functions
-///////////////
-
-void resetStateArrays(){
-    for(int i = 0; i < NOTES_STATE_ARRAY_SIZE; i++){
-      FlutePipesState[i] = (u_long) 0;
-      PrincipalPipesState[i] = (u_long) 0;
-      StringPipesState[i] = (u_long) 0;
-      ReedPipesState[i] = (u_long) 0;
-
-      TempFlutePipesState[i] = (u_long) 0;
-      TempPrincipalPipesState[i] = (u_long) 0;
-      TempStringPipesState[i] = (u_long) 0;
-      TempReedPipesState[i] = (u_long) 0;
+/**
+ * Bitmap with the given pitches on. The list ends at the first pitch over 127.
+ */
+Bitmap128 bitmapOf(const int *pitches)
+{
+  Bitmap128 bitmap = {};
+  for (; *pitches < 128; pitches++)
+  {
+    bitmap.set(*pitches, true);
+  }
+  return bitmap;
+}
+
+const int END = 128;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Tests
+//
+
+void test_set_and_get_every_bit()
+{
+  Bitmap128 bitmap = {};
+  for (int pitch = 0; pitch < 128; pitch++)
+  {
+    bitmap.set(pitch, true);
+    for (int other = 0; other < 128; other++)
+    {
+      TEST_ASSERT_EQUAL(other <= pitch, bitmap.get(other));
     }
+  }
+  for (int pitch = 0; pitch < 128; pitch++)
+  {
+    bitmap.set(pitch, false);
+    TEST_ASSERT_FALSE(bitmap.get(pitch));
+  }
+  TEST_ASSERT_FALSE(bitmap.any());
+}
+
+void test_byte_layout_matches_old_bitmaps()
+{
+  // Pitch n used to be bit n % 8 of byte n / 8
+  const int pitches[] = {0, 9, 63, 64, 127, END};
+  Bitmap128 bitmap = bitmapOf(pitches);
+  const byte *bytes = (const byte *)&bitmap;
+  TEST_ASSERT_EQUAL_HEX8(0x01, bytes[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x02, bytes[1]);
+  TEST_ASSERT_EQUAL_HEX8(0x80, bytes[7]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, bytes[8]);
+  TEST_ASSERT_EQUAL_HEX8(0x80, bytes[15]);
+}
+
+void test_count()
+{
+  Bitmap128 bitmap = {};
+  TEST_ASSERT_EQUAL(0, bitmap.count());
+  const int pitches[] = {0, 7, 8, 63, 64, 100, 127, END};
+  TEST_ASSERT_EQUAL(7, bitmapOf(pitches).count());
+  for (int pitch = 0; pitch < 128; pitch++)
+  {
+    bitmap.set(pitch, true);
+  }
+  TEST_ASSERT_EQUAL(128, bitmap.count());
+}
+
+void test_or_and_not_xor()
+{
+  const int a[] = {1, 60, 64, 127, END};
+  const int b[] = {60, 64, 100, END};
+  const int either[] = {1, 60, 64, 100, 127, END};
+  const int both[] = {60, 64, END};
+  const int onlyA[] = {1, 127, END};
+  const int oneOf[] = {1, 100, 127, END};
+
+  TEST_ASSERT_TRUE((bitmapOf(a) | bitmapOf(b)) == bitmapOf(either));
+  TEST_ASSERT_TRUE((bitmapOf(a) & bitmapOf(b)) == bitmapOf(both));
+  TEST_ASSERT_TRUE(bitmapOf(a).andNot(bitmapOf(b)) == bitmapOf(onlyA));
+  TEST_ASSERT_TRUE((bitmapOf(a) ^ bitmapOf(b)) == bitmapOf(oneOf));
+  TEST_ASSERT_TRUE(bitmapOf(a) != bitmapOf(b));
+}
+
+void test_shift_up()
+{
+  const int pitches[] = {0, 7, 60, 63, 115, 127, END};
+  const int octaveUp[] = {12, 19, 72, 75, 127, END};
+  const int twoOctavesUp[] = {24, 31, 84, 87, END};
+  TEST_ASSERT_TRUE((bitmapOf(pitches) << 0) == bitmapOf(pitches));
+  TEST_ASSERT_TRUE((bitmapOf(pitches) << 12) == bitmapOf(octaveUp));
+  TEST_ASSERT_TRUE((bitmapOf(pitches) << 24) == bitmapOf(twoOctavesUp));
+
+  // Across more than a whole word, whatever the word width
+  const int lowest[] = {0, END};
+  const int shifted[] = {100, END};
+  TEST_ASSERT_TRUE((bitmapOf(lowest) << 100) == bitmapOf(shifted));
+  TEST_ASSERT_FALSE((bitmapOf(pitches) << 128).any());
+}
+
+void test_shift_down()
+{
+  const int pitches[] = {0, 11, 12, 64, 70, 127, END};
+  const int octaveDown[] = {0, 52, 58, 115, END};
+  TEST_ASSERT_TRUE((bitmapOf(pitches) >> 0) == bitmapOf(pitches));
+  TEST_ASSERT_TRUE((bitmapOf(pitches) >> 12) == bitmapOf(octaveDown));
+
+  const int highest[] = {127, END};
+  const int shifted[] = {27, END};
+  TEST_ASSERT_TRUE((bitmapOf(highest) >> 100) == bitmapOf(shifted));
+  TEST_ASSERT_FALSE((bitmapOf(pitches) >> 128).any());
+}
+
+void test_clip_and_lowest()
+{
+  const int pitches[] = {0, 35, 36, 60, 96, 97, 127, END};
+  const int clipped[] = {36, 60, 96, END};
+  Bitmap128 bitmap = bitmapOf(pitches);
+  TEST_ASSERT_EQUAL(0, bitmap.lowest());
+  TEST_ASSERT_TRUE(bitmap.clip(36, 96) == bitmapOf(clipped));
+  TEST_ASSERT_EQUAL(36, bitmap.lowest());
+  TEST_ASSERT_TRUE(bitmapOf(pitches).clip(0, 127) == bitmapOf(pitches));
+
+  const int top[] = {127, END};
+  TEST_ASSERT_EQUAL(127, bitmapOf(top).lowest());
+  TEST_ASSERT_TRUE(bitmapOf(top).clip(127, 127) == bitmapOf(top));
+}
+
+void test_set_bit_iteration()
+{
+  const int pitches[] = {0, 5, 63, 64, 65, 120, 127, END};
+  Bitmap128 bitmap = bitmapOf(pitches);
+  int index = 0;
+  for (byte pitch : bitmap.setBits())
+  {
+    TEST_ASSERT_EQUAL(pitches[index], pitch);
+    index++;
+  }
+  TEST_ASSERT_EQUAL(7, index);
+
+  Bitmap128 empty = {};
+  for (byte pitch : empty.setBits())
+  {
+    TEST_FAIL_MESSAGE("Empty bitmap has no set bits");
+    (void)pitch;
+  }
+}
+
+void test_held_keys_follow_presses_and_releases()
+{
+  Bitmap128 keyboard = {};
+  HeldKeyList held = {};
+  setHeldKey(keyboard, held, 60, true);
+  setHeldKey(keyboard, held, 64, true);
+  setHeldKey(keyboard, held, 60, true); // Repeated Note On
+  setHeldKey(keyboard, held, 67, true);
+  TEST_ASSERT_EQUAL(3, held.count);
+
+  setHeldKey(keyboard, held, 60, false);
+  setHeldKey(keyboard, held, 60, false); // Repeated Note Off
+  setHeldKey(keyboard, held, 200, true); // Out of range
+  TEST_ASSERT_EQUAL(2, held.count);
+  TEST_ASSERT_FALSE(keyboard.get(60));
+  for (byte i = 0; i < held.count; i++)
+  {
+    TEST_ASSERT_TRUE(held.keys[i] == 64 || held.keys[i] == 67);
+    TEST_ASSERT_TRUE(keyboard.get(held.keys[i]));
+  }
+}
+
+void test_held_keys_overflow_and_recover()
+{
+  Bitmap128 keyboard = {};
+  HeldKeyList held = {};
+  for (int pitch = 0; pitch <= MAX_HELD_KEYS; pitch++)
+  {
+    setHeldKey(keyboard, held, pitch, true);
+  }
+  TEST_ASSERT_TRUE(held.overflowed);
+  TEST_ASSERT_EQUAL(MAX_HELD_KEYS + 1, keyboard.count());
+
+  // Letting go of one key makes them all fit again
+  setHeldKey(keyboard, held, 3, false);
+  TEST_ASSERT_FALSE(held.overflowed);
+  TEST_ASSERT_EQUAL(MAX_HELD_KEYS, held.count);
+  for (byte i = 0; i < held.count; i++)
+  {
+    TEST_ASSERT_TRUE(keyboard.get(held.keys[i]));
+  }
+}
+
+void test_debouncer_waits_for_a_stop_to_settle()
+{
+  StopDebouncer debouncer;
+  resetStopDebouncer(debouncer, 0, 0);
+  uint32_t now = 0;
+  int changes = 0;
+  for (int sample = 0; sample < STOP_DEBOUNCE_SAMPLES; sample++)
+  {
+    now += STOP_SAMPLE_INTERVAL_MS;
+    changes += debounceStops(debouncer, 1UL << 7, now);
+  }
+  TEST_ASSERT_EQUAL(1, changes);
+  TEST_ASSERT_EQUAL(1UL << 7, debouncer.stable);
+  TEST_ASSERT_EQUAL(0, bounceRecomputesPrevented(debouncer));
+  TEST_ASSERT_FALSE(stopsSettling(debouncer, 1UL << 7));
+  TEST_ASSERT_TRUE(stopsSettling(debouncer, 0));
+}
+
+void test_debouncer_ignores_bounces()
+{
+  StopDebouncer debouncer;
+  resetStopDebouncer(debouncer, 0, 0);
+  uint32_t now = 0;
+  // Contact bounces for a few ms on every loop, then settles on
+  for (int loop = 0; loop < 6; loop++)
+  {
+    now += 1;
+    TEST_ASSERT_FALSE(debounceStops(debouncer, (loop & 1) ? 0 : 1UL << 7, now));
+  }
+  int changes = 0;
+  for (int loop = 0; loop < STOP_SETTLE_MS * 2; loop++)
+  {
+    now += 1;
+    changes += debounceStops(debouncer, 1UL << 7, now);
+  }
+  TEST_ASSERT_EQUAL(1, changes);
+  TEST_ASSERT_EQUAL(1UL << 7, debouncer.stable);
+  // 7 raw changes, 1 recompute
+  TEST_ASSERT_EQUAL(6, bounceRecomputesPrevented(debouncer));
+
+  // A short glitch never makes it through
+  now += 1;
+  debounceStops(debouncer, 0, now);
+  now += 1;
+  debounceStops(debouncer, 1UL << 7, now);
+  TEST_ASSERT_EQUAL(1UL << 7, debouncer.stable);
+  TEST_ASSERT_EQUAL(8, bounceRecomputesPrevented(debouncer));
+}
+
+void test_rank_diff_finds_changed_pipes()
+{
+  const int committedPitches[] = {40, 60, END};
+  const int nextPitches[] = {41, 60, 120, END}; // 120 is above the String rank's compass
+  Bitmap128 committed = bitmapOf(committedPitches);
+  Bitmap128 next = bitmapOf(nextPitches);
+  Bitmap128 turnedOn = {};
+  Bitmap128 turnedOff = {};
+  for (byte word = 0; word < BITMAP_WORD_COUNT; word++)
+  {
+    diffRankWord(committed, next, STRING_RANK, word, [&](byte rank, byte pitch, boolean on)
+    {
+      TEST_ASSERT_EQUAL(STRING_RANK, rank);
+      (on ? turnedOn : turnedOff).set(pitch, true);
+    });
+  }
+  TEST_ASSERT_EQUAL(1, turnedOn.count());
+  TEST_ASSERT_TRUE(turnedOn.get(41));
+  TEST_ASSERT_EQUAL(1, turnedOff.count());
+  TEST_ASSERT_TRUE(turnedOff.get(40));
+}
+
+void test_output_queue_wraps_and_fills()
+{
+  static OutputQueue queue;
+  resetOutputQueue(queue);
+  byte channel;
+  byte pitch;
+  boolean val;
+  // Go round the ring a few times, then fill it up
+  for (int i = 0; i < OUTPUT_QUEUE_SIZE * 3; i++)
+  {
+    TEST_ASSERT_TRUE(pushOutputQueue(queue, 13 + i % 4, i % 128, i & 1));
+    TEST_ASSERT_TRUE(popOutputQueue(queue, channel, pitch, val));
+    TEST_ASSERT_EQUAL(13 + i % 4, channel);
+    TEST_ASSERT_EQUAL(i % 128, pitch);
+    TEST_ASSERT_EQUAL(i & 1, val);
+  }
+  for (int i = 0; i < OUTPUT_QUEUE_SIZE; i++)
+  {
+    TEST_ASSERT_TRUE(pushOutputQueue(queue, 16, 127, true));
+  }
+  TEST_ASSERT_FALSE(pushOutputQueue(queue, 16, 127, true));
+  TEST_ASSERT_EQUAL(OUTPUT_QUEUE_SIZE, queue.size);
+  resetOutputQueue(queue);
+  TEST_ASSERT_FALSE(popOutputQueue(queue, channel, pitch, val));
 }
 
 /**
- * Sets a single bit to on or off in the provided noteState array
-*/
-void setStateBit(u_long noteState[], byte stateIndex, boolean value){
-  byte arrayIndex = stateIndex / 32;
-  byte offset = stateIndex % 32; 
-  u_long chunk = noteState[arrayIndex];
-  u_long editMask = 1L << offset;
-  noteState[arrayIndex] = value ? (chunk | editMask) : (chunk & ~editMask);
+ * The compute task waits for room for a whole bitmap word before diffing it, so a word that
+ * changes every pipe it has still never overflows the queue
+ */
+void test_a_word_diff_fits_once_there_is_room_for_it()
+{
+  static OutputQueue queue;
+  resetOutputQueue(queue);
+  TEST_ASSERT_EQUAL(OUTPUT_QUEUE_SIZE, outputQueueRoom(queue));
+  while (outputQueueRoom(queue) >= BITMAP_WORD_BITS)
+  {
+    TEST_ASSERT_TRUE(pushOutputQueue(queue, 16, 127, true));
+  }
+  TEST_ASSERT_EQUAL(BITMAP_WORD_BITS - 1, outputQueueRoom(queue));
+  byte channel;
+  byte pitch;
+  boolean val;
+  TEST_ASSERT_TRUE(popOutputQueue(queue, channel, pitch, val));
+  TEST_ASSERT_EQUAL(BITMAP_WORD_BITS, outputQueueRoom(queue));
+
+  // Every pipe of the word the rank's lowest pipe is in turns on
+  byte word = RANK_RANGES[PRINCIPAL_RANK].lowest / BITMAP_WORD_BITS;
+  Bitmap128 committed = {};
+  Bitmap128 next = {};
+  next.words[word] = (BitmapWord)~(BitmapWord)0;
+  int queued = 0;
+  diffRankWord(committed, next, PRINCIPAL_RANK, word, [&](byte rank, byte changedPitch, boolean on)
+  {
+    TEST_ASSERT_TRUE(pushOutputQueue(queue, RANK_CHANNELS[rank], changedPitch, on));
+    queued++;
+  });
+  TEST_ASSERT_TRUE(queued > 0);
+  TEST_ASSERT_EQUAL(BITMAP_WORD_BITS - queued, outputQueueRoom(queue));
 }
 
-boolean getStateBit(u_long noteState[], byte stateIndex){
-  byte arrayIndex = stateIndex / 32;
-  byte offset = stateIndex % 32; 
-  u_long chunk = noteState[arrayIndex];
-  chunk = chunk >> offset; //put the bit we want in the lowest bit position
-  return (chunk & 1) == 1; // see if that bit is enabled
+int stepsDone = 0;
+int step = 0;
+
+/**
+ * Takes 10us a step, for 10 steps
+ */
+void steppingTask(Task &task)
+{
+  TASK_BEGIN(task);
+  for (step = 0; step < 10; step++)
+  {
+    fakeMicros += 10;
+    stepsDone++;
+    TASK_YIELD_IF_OVER_BUDGET(task);
+  }
+  TASK_END(task);
 }
 
-boolean printBuffer(u_long noteState[]){
-  for(int i = 0; i < 128; i++){
-    Serial.print(noteState[0], BIN);
-    Serial.print(noteState[1], BIN);
-    Serial.print(noteState[2], BIN);
-    Serial.print(noteState[3], BIN);
+/**
+ * Stands in for the SPI bus and latch pin, and keeps the bytes of the last frame in the order they
+ * were shifted out
+ */
+struct RecordingShiftBus
+{
+  byte shifted[SHIFT_REGISTER_FRAME_BYTES + 1];
+  int count;
+  int latches;
+  void transfer(byte value)
+  {
+    if (count < (int)sizeof(shifted))
+    {
+      shifted[count] = value;
+    }
+    count++;
+  }
+  void latch() { latches++; }
+};
+
+void test_shift_register_frame_layout()
+{
+  static Bitmap128 rankStates[RANK_COUNT];
+  static byte frame[SHIFT_REGISTER_FRAME_BYTES];
+  TEST_ASSERT_EQUAL(44, SHIFT_REGISTER_FRAME_BYTES);
+  resetNewState(rankStates);
+  rankStates[PRINCIPAL_RANK].set(36, true);
+  rankStates[PRINCIPAL_RANK].set(127, true);
+  rankStates[STRING_RANK].set(36, true);
+  rankStates[STRING_RANK].set(108, true);
+  rankStates[STRING_RANK].set(110, true); // Past the top of the String compass, has no output
+  rankStates[REED_RANK].set(45, true);
+  buildShiftRegisterFrame(rankStates, frame);
+
+  TEST_ASSERT_EQUAL_HEX8(0x01, frame[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x08, frame[11]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, frame[12]);
+  TEST_ASSERT_EQUAL_HEX8(0x01, frame[21]);
+  TEST_ASSERT_EQUAL_HEX8(0x02, frame[35]);
+  int pipes = 0;
+  for (int i = 0; i < SHIFT_REGISTER_FRAME_BYTES; i++)
+  {
+    for (byte b = frame[i]; b; b &= b - 1)
+    {
+      pipes++;
+    }
+  }
+  TEST_ASSERT_EQUAL(5, pipes);
+
+  // The far end of the chain goes out first, then one latch
+  RecordingShiftBus bus = {};
+  sendShiftRegisterFrame(bus, frame);
+  TEST_ASSERT_EQUAL(SHIFT_REGISTER_FRAME_BYTES, bus.count);
+  TEST_ASSERT_EQUAL(1, bus.latches);
+  for (int i = 0; i < SHIFT_REGISTER_FRAME_BYTES; i++)
+  {
+    TEST_ASSERT_EQUAL_HEX8(frame[SHIFT_REGISTER_FRAME_BYTES - 1 - i], bus.shifted[i]);
   }
-  Serial.println();
 }
 
-void printBuffers(){
+/**
+ * Encode the change from sent to next for the flute rank and feed it to the decoder
+ */
+byte sendTestPipeFrame(PipeFrameDecoder &decoder, byte &sequence, Bitmap128 &sent, const Bitmap128 &next,
+                       boolean full, boolean deliver = true)
+{
+  byte frame[PIPE_FRAME_MAX_BYTES];
+  byte length = encodePipeFrame(sequence++, FLUTE_RANK, sent, next, full, frame);
+  sent = next;
+  for (byte i = 0; deliver && i < length; i++)
+  {
+    decodePipeFrameByte(decoder, frame[i]);
+  }
+  return frame[2] >> 4;
+}
+
+void test_pipe_frames_pick_the_shortest_encoding_and_resync()
+{
+  static PipeFrameDecoder decoder;
+  resetPipeFrameDecoder(decoder);
+  TEST_ASSERT_TRUE(pipeFramesNeedResync(decoder));
+  byte sequence = 250; // Wraps round
+  Bitmap128 sent = {};
+  Bitmap128 next = {};
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    byte frame[PIPE_FRAME_MAX_BYTES];
+    TEST_ASSERT_EQUAL(PIPE_FRAME_MAX_BYTES, encodePipeFrame(sequence++, rank, sent, next, true, frame));
+    for (byte i = 0; i < PIPE_FRAME_MAX_BYTES; i++)
+    {
+      decodePipeFrameByte(decoder, frame[i]);
+    }
+  }
+  TEST_ASSERT_FALSE(pipeFramesNeedResync(decoder));
+
+  // A few pipes go as notes, a run of whole octaves as ranges of bytes, a big change as the bitmap
+  next.set(60, true);
+  next.set(67, true);
+  TEST_ASSERT_EQUAL(PIPE_FRAME_NOTES, sendTestPipeFrame(decoder, sequence, sent, next, false));
+  TEST_ASSERT_TRUE(decoder.ranks[FLUTE_RANK] == next);
+  for (byte i = 5; i < 9; i++)
+  {
+    next.setByte(i, 0xFF);
+  }
+  TEST_ASSERT_EQUAL(PIPE_FRAME_RUNS, sendTestPipeFrame(decoder, sequence, sent, next, false));
+  TEST_ASSERT_TRUE(decoder.ranks[FLUTE_RANK] == next);
+  for (byte i = 0; i < BITMAP_BYTES; i += 2)
+  {
+    next.setByte(i, 0x5A ^ i);
+  }
+  TEST_ASSERT_EQUAL(PIPE_FRAME_BITMAP, sendTestPipeFrame(decoder, sequence, sent, next, false));
+  TEST_ASSERT_TRUE(decoder.ranks[FLUTE_RANK] == next);
+  TEST_ASSERT_EQUAL(0, decoder.lostFrames + decoder.badFrames);
 
-  printBuffer(FlutePipesState);
-  printBuffer(PrincipalPipesState);
-  printBuffer(StringPipesState);
-  printBuffer(ReedPipesState);
+  // A SysEx reply on the same port between two frames is skipped over while hunting for the sync byte
+  const byte reply[] = {0xF0, 0x7D, 0x02, 0x75, 0x7F, 0x00, 0x75, 0xF7}; // Data bytes are all below 0x80
+  for (byte i = 0; i < sizeof(reply); i++)
+  {
+    TEST_ASSERT_FALSE(decodePipeFrameByte(decoder, reply[i]));
+  }
+  next.set(61, true);
+  TEST_ASSERT_EQUAL(PIPE_FRAME_NOTES, sendTestPipeFrame(decoder, sequence, sent, next, false));
+  TEST_ASSERT_TRUE(decoder.ranks[FLUTE_RANK] == next);
+  TEST_ASSERT_EQUAL(0, decoder.lostFrames + decoder.badFrames);
+
+  // A lost frame means the deltas after it can't be trusted until a bitmap frame comes
+  next.set(100, !next.get(100));
+  sendTestPipeFrame(decoder, sequence, sent, next, false, false);
+  next.set(101, !next.get(101));
+  sendTestPipeFrame(decoder, sequence, sent, next, false);
+  TEST_ASSERT_EQUAL(1, decoder.lostFrames);
+  TEST_ASSERT_TRUE(pipeFramesNeedResync(decoder));
+  TEST_ASSERT_TRUE(decoder.ranks[FLUTE_RANK] != next);
+  sendTestPipeFrame(decoder, sequence, sent, next, true);
+  TEST_ASSERT_TRUE(decoder.ranks[FLUTE_RANK] == next);
+
+  // So does a corrupted one
+  byte frame[PIPE_FRAME_MAX_BYTES];
+  next.set(40, true);
+  byte length = encodePipeFrame(sequence++, FLUTE_RANK, sent, next, false, frame);
+  frame[PIPE_FRAME_HEADER_BYTES] ^= 0x01;
+  for (byte i = 0; i < length; i++)
+  {
+    decodePipeFrameByte(decoder, frame[i]);
+  }
+  TEST_ASSERT_EQUAL(1, decoder.badFrames);
+  TEST_ASSERT_TRUE(pipeFramesNeedResync(decoder));
 }
 
-void loop()
+void test_resync_sweeps_every_pipe_once()
+{
+  ResyncCursor cursor;
+  resetResyncCursor(cursor);
+  static Bitmap128 visited[RANK_COUNT];
+  resetNewState(visited);
+  int pipes = 0;
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    pipes += RANK_RANGES[rank].highest - RANK_RANGES[rank].lowest + 1;
+  }
+  for (int i = 0; i < pipes; i++)
+  {
+    TEST_ASSERT_TRUE(inRange(RANK_RANGES[cursor.rank], cursor.pitch));
+    TEST_ASSERT_FALSE(visited[cursor.rank].get(cursor.pitch));
+    visited[cursor.rank].set(cursor.pitch, true);
+    TEST_ASSERT_EQUAL(0, cursor.sweeps);
+    advanceResyncPipe(cursor);
+  }
+  TEST_ASSERT_EQUAL(1, cursor.sweeps);
+  TEST_ASSERT_EQUAL(0, cursor.rank);
+  TEST_ASSERT_EQUAL(RANK_RANGES[0].lowest, cursor.pitch);
+
+  cursor.lastWindow = 1000;
+  TEST_ASSERT_FALSE(resyncWindowDue(cursor, 1000 + RESYNC_INTERVAL_MS - 1));
+  TEST_ASSERT_TRUE(resyncWindowDue(cursor, 1000 + RESYNC_INTERVAL_MS));
+}
+
+int releasedOnsets;
+boolean releaseTestOnset(byte, byte)
+{
+  releasedOnsets++;
+  return true;
+}
+
+void test_onsets_are_capped_per_slice()
 {
-  printBuffers();
+  static OnsetScheduler scheduler;
+  resetOnsetScheduler(scheduler);
+  releasedOnsets = 0;
+  for (byte pitch = 36; pitch < 36 + 2 * ONSET_CAP_PER_SLICE + 1; pitch++)
+  {
+    scheduleOnset(scheduler, STRING_RANK, pitch, 1000);
+  }
+  // A pipe that turns off again before it started never sounds
+  TEST_ASSERT_TRUE(cancelOnset(scheduler, STRING_RANK, 36 + 2 * ONSET_CAP_PER_SLICE));
+  TEST_ASSERT_FALSE(cancelOnset(scheduler, STRING_RANK, 100));
+
+  releaseOnsets(scheduler, 1000, releaseTestOnset);
+  TEST_ASSERT_EQUAL(ONSET_CAP_PER_SLICE, releasedOnsets);
+  TEST_ASSERT_TRUE(scheduler.pending[STRING_RANK].get(36 + ONSET_CAP_PER_SLICE));
+  releaseOnsets(scheduler, 1000 + ONSET_SLICE_MS - 1, releaseTestOnset);
+  TEST_ASSERT_EQUAL(ONSET_CAP_PER_SLICE, releasedOnsets);
+  releaseOnsets(scheduler, 1000 + ONSET_SLICE_MS, releaseTestOnset);
+  TEST_ASSERT_EQUAL(2 * ONSET_CAP_PER_SLICE, releasedOnsets);
+  TEST_ASSERT_FALSE(onsetsPending(scheduler));
 
-  resetStateArrays();
-  
-  printBuffers();
+  TEST_ASSERT_EQUAL(2 * ONSET_CAP_PER_SLICE, scheduler.onsets);
+  TEST_ASSERT_EQUAL(ONSET_CAP_PER_SLICE, scheduler.delayedOnsets);
+  TEST_ASSERT_EQUAL(ONSET_SLICE_MS, scheduler.worstDelayMs);
+  TEST_ASSERT_EQUAL(ONSET_CAP_PER_SLICE * ONSET_SLICE_MS, scheduler.totalDelayMs);
+}
 
-  for(byte i = 0; i < 128; i++){
-    setStateBit(FlutePipesState, i, true);
-    printBuffer(FlutePipesState);
-    Serial.println(getStateBit(FlutePipesState, i));
-    Serial.println
+/**
+ * Keeps the String rank busy with a new low chord every slice. The high pipe still gets its turn,
+ * and the delays stay within a couple of sweeps instead of growing as long as the playing goes on.
+ */
+void test_onsets_take_turns_under_sustained_playing()
+{
+  static OnsetScheduler scheduler;
+  resetOnsetScheduler(scheduler);
+  releasedOnsets = 0;
+  scheduleOnset(scheduler, STRING_RANK, 90, 1000);
+  int highReleasedAfter = -1;
+  for (int slice = 0; slice < 100; slice++)
+  {
+    unsigned long now = 1000 + slice * ONSET_SLICE_MS;
+    for (byte key = 0; key < ONSET_CAP_PER_SLICE; key++)
+    {
+      scheduleOnset(scheduler, STRING_RANK, 40 + (slice * ONSET_CAP_PER_SLICE + key) % 24, now);
+    }
+    releaseOnsets(scheduler, now, releaseTestOnset);
+    if (highReleasedAfter < 0 && !scheduler.pending[STRING_RANK].get(90))
+    {
+      highReleasedAfter = slice;
+    }
   }
+  TEST_ASSERT_TRUE(highReleasedAfter >= 0 && highReleasedAfter < 10);
+  TEST_ASSERT_TRUE(scheduler.worstDelayMs < 2 * (24 / ONSET_CAP_PER_SLICE + 1) * ONSET_SLICE_MS);
+}
 
-  
+void test_stop_change_patches_the_same_pipes_as_a_full_build()
+{
+  const int swell[] = {48, 52, 55, 60, END};
+  const int great[] = {48, 60, 67, 72, END};
+  const int pedal[] = {36, 48, END};
+  Bitmap128 keyboardStates[DIVISION_COUNT];
+  keyboardStates[SWELL] = bitmapOf(swell);
+  keyboardStates[GREAT] = bitmapOf(great);
+  keyboardStates[PEDAL] = bitmapOf(pedal);
+  boolean stops[STOP_STATES_SIZE] = {};
+  stops[SwellToGreat_PIN_18] = true;
+  stops[GreatToPedal_PIN_16] = true;
+  stops[GreatOpenDiapason8_PIN_15] = true; // Shares pipes with the Swell 8' and 4' Principal stops
+  stops[SwellFlute4_PIN_4] = true;
 
-  
+  Bitmap128 patched[RANK_COUNT];
+  Bitmap128 expected[RANK_COUNT];
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    uint32_t stopWord = 0;
+    for (byte stop = 0; stop < STOP_STATES_SIZE; stop++)
+    {
+      setStopBit(stopWord, stop, stops[stop]);
+    }
+    uint32_t changedWord = stopWord ^ (1UL << pin);
+    byte changedPin = singleStopChange(stopWord, changedWord);
+    if (pin == SwellToGreat_PIN_18 || pin == SwellToPedal_PIN_17 || pin == GreatToPedal_PIN_16)
+    {
+      TEST_ASSERT_EQUAL(NO_SINGLE_STOP_CHANGE, changedPin);
+      continue;
+    }
+    TEST_ASSERT_EQUAL(pin, changedPin);
 
-}
\ No newline at end of file
+    // Flip it and back again, so every stop is tried both ways
+    for (byte flip = 0; flip < 2; flip++)
+    {
+      buildNewRankStates(stops, keyboardStates, patched);
+      stops[pin] = !stops[pin];
+      applyStopChange(stops, keyboardStates, patched, pin);
+      buildNewRankStates(stops, keyboardStates, expected);
+      for (byte rank = 0; rank < RANK_COUNT; rank++)
+      {
+        TEST_ASSERT_TRUE(patched[rank] == expected[rank]);
+      }
+    }
+  }
+  TEST_ASSERT_EQUAL(NO_SINGLE_STOP_CHANGE, singleStopChange(0, 0));
+  TEST_ASSERT_EQUAL(NO_SINGLE_STOP_CHANGE, singleStopChange(0, 0x30));
+}
+
+/**
+ * The console's couplers are all unison so far, so these try the same coupler stops as 4' and 16'
+ */
+const CouplerRoute TRANSPOSING_COUPLERS[] PROGMEM = {
+    {SwellToGreat_PIN_18, GREAT, SWELL, COUPLER_4_FOOT},
+    {GreatToPedal_PIN_16, PEDAL, GREAT, COUPLER_16_FOOT},
+};
+#define TRANSPOSING_COUPLER_COUNT (sizeof(TRANSPOSING_COUPLERS) / sizeof(TRANSPOSING_COUPLERS[0]))
+
+/**
+ * Coupled keys have to land on the same pipes as pressing the transposed keys on the division's
+ * own keyboard, and keys transposed out of its compass are dropped
+ */
+void checkTransposingCoupler(byte division, const Bitmap128 &expectedKeys,
+                             const Bitmap128 (&keyboardStates)[DIVISION_COUNT], const boolean (&stops)[STOP_STATES_SIZE])
+{
+  Bitmap128 keys = keysPlayingDivision(stops, keyboardStates, division, TRANSPOSING_COUPLERS,
+                                       TRANSPOSING_COUPLER_COUNT);
+  TEST_ASSERT_TRUE(keys == expectedKeys);
+
+  Bitmap128 coupled[RANK_COUNT];
+  buildNewRankStates(stops, keyboardStates, coupled, TRANSPOSING_COUPLERS, TRANSPOSING_COUPLER_COUNT);
+  Bitmap128 pressed[DIVISION_COUNT];
+  for (byte keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    pressed[keyboard] = keyboardStates[keyboard];
+  }
+  pressed[division] = expectedKeys;
+  boolean uncoupled[STOP_STATES_SIZE];
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    uncoupled[pin] = stops[pin] && pin != SwellToGreat_PIN_18 && pin != SwellToPedal_PIN_17 &&
+                     pin != GreatToPedal_PIN_16;
+  }
+  Bitmap128 expected[RANK_COUNT];
+  buildNewRankStates(uncoupled, pressed, expected);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    TEST_ASSERT_TRUE(coupled[rank] == expected[rank]);
+  }
+}
+
+void test_4_foot_coupler_drops_keys_past_the_top_of_the_compass()
+{
+  const int great[] = {36, 60, 84, 85, 96, END}; // The Swell's compass ends at 96
+  const int swell[] = {40, END};
+  const int playingSwell[] = {40, 48, 72, 96, END};
+  Bitmap128 keyboardStates[DIVISION_COUNT] = {};
+  keyboardStates[GREAT] = bitmapOf(great);
+  keyboardStates[SWELL] = bitmapOf(swell);
+  boolean stops[STOP_STATES_SIZE] = {};
+  stops[SwellToGreat_PIN_18] = true;
+  stops[SwellOpenDiapason8_PIN_7] = true;
+  stops[SwellFlute4_PIN_4] = true;
+  stops[GreatHorn8_PIN_9] = true;
+  checkTransposingCoupler(SWELL, bitmapOf(playingSwell), keyboardStates, stops);
+}
+
+void test_16_foot_coupler_drops_keys_past_the_bottom_of_the_compass()
+{
+  const int pedal[] = {36, 47, 48, 60, 67, END}; // The Great's compass starts at 36
+  const int great[] = {72, END};
+  const int playingGreat[] = {36, 48, 55, 72, END};
+  Bitmap128 keyboardStates[DIVISION_COUNT] = {};
+  keyboardStates[PEDAL] = bitmapOf(pedal);
+  keyboardStates[GREAT] = bitmapOf(great);
+  boolean stops[STOP_STATES_SIZE] = {};
+  stops[GreatToPedal_PIN_16] = true;
+  stops[GreatOpenDiapason8_PIN_15] = true;
+  stops[GreatClarion4_PIN_8] = true;
+  stops[PedalBourdon16_PIN_19] = true;
+  checkTransposingCoupler(GREAT, bitmapOf(playingGreat), keyboardStates, stops);
+}
+
+void test_packed_stops_route_like_the_boolean_array()
+{
+  const int swell[] = {60, 64, 67, END};
+  const int great[] = {48, 72, END};
+  const int pedal[] = {36, 43, END};
+  Bitmap128 keyboardStates[DIVISION_COUNT];
+  keyboardStates[SWELL] = bitmapOf(swell);
+  keyboardStates[GREAT] = bitmapOf(great);
+  keyboardStates[PEDAL] = bitmapOf(pedal);
+  boolean stops[STOP_STATES_SIZE] = {};
+  stops[SwellToGreat_PIN_18] = true;
+  stops[SwellToPedal_PIN_17] = true;
+  stops[SwellPrincipal4_PIN_5] = true;
+  stops[GreatHorn8_PIN_9] = true;
+  stops[PedalBourdon16_PIN_19] = true;
+  StopBits packed = {0};
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    setStopBit(packed.word, pin, stops[pin]);
+    TEST_ASSERT_EQUAL(stops[pin], packed[pin]);
+  }
+
+  Bitmap128 fromPacked[RANK_COUNT];
+  Bitmap128 fromArray[RANK_COUNT];
+  buildNewRankStates(packed, keyboardStates, fromPacked);
+  buildNewRankStates(stops, keyboardStates, fromArray);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    TEST_ASSERT_TRUE(fromPacked[rank] == fromArray[rank]);
+  }
+
+  stops[SwellPrincipal4_PIN_5] = false;
+  setStopBit(packed.word, SwellPrincipal4_PIN_5, false);
+  applyStopChange(packed, keyboardStates, fromPacked, SwellPrincipal4_PIN_5);
+  buildNewRankStates(stops, keyboardStates, fromArray);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    TEST_ASSERT_TRUE(fromPacked[rank] == fromArray[rank]);
+  }
+}
+
+/**
+ * Stands in for a serial port, with a stream of input bytes to read
+ */
+struct ScriptedSerial
+{
+  const byte *input;
+  int length;
+  int next;
+  void begin(long) {}
+  int available() { return length - next; }
+  int read() { return input[next++]; }
+  void write(byte) {}
+};
+
+void test_input_filter_only_lets_keyboard_notes_and_our_sysex_through()
+{
+  const byte input[] = {
+      0xF8, 0x92, 60, 0xFE, 100, // Swell Note On with Timing Clock and Active Sensing in the middle
+      61, 100,                   // Running status
+      0xB0, 7, 100, 1, 64,       // Two controller changes, the second on running status
+      0xA1, 60, 10, 0xD1, 20,    // Polyphonic and channel pressure
+      0x95, 60, 100,             // Note On on a channel without a keyboard
+      0xF0, 0x43, 1, 2, 0xF7,    // Someone else's SysEx
+      0xF0, 0x7D, 0x02, 0xF7,    // Ours
+      62, 0,                     // Data without a status after the SysEx
+      0xE0, 0, 64, 0x80, 36, 0,  // Pitch bend, then a Pedal Note Off
+  };
+  const byte expected[] = {0x92, 60, 100, 61, 100, 0xF0, 0x7D, 0x02, 0xF7, 0x80, 36, 0};
+  ScriptedSerial serial = {input, sizeof(input), 0};
+  FilteredSerialMIDI<ScriptedSerial> transport(serial);
+  resetMidiInputFilter(transport.filter, keyboardChannelMask(), 0x7D);
+
+  byte admitted[sizeof(input)];
+  unsigned count = 0;
+  while (transport.available() > 0)
+  {
+    admitted[count++] = transport.read();
+  }
+  TEST_ASSERT_EQUAL(sizeof(expected), count);
+  for (unsigned i = 0; i < count; i++)
+  {
+    TEST_ASSERT_EQUAL(expected[i], admitted[i]);
+  }
+  TEST_ASSERT_EQUAL(2, transport.filter.dropped[DROP_REALTIME]);
+  TEST_ASSERT_EQUAL(2, transport.filter.dropped[DROP_CONTROL_CHANGE]);
+  TEST_ASSERT_EQUAL(2, transport.filter.dropped[DROP_AFTERTOUCH]);
+  TEST_ASSERT_EQUAL(1, transport.filter.dropped[DROP_SYSEX]);
+  TEST_ASSERT_EQUAL(2, transport.filter.dropped[DROP_OTHER]);
+}
+
+void test_task_resumes_where_it_yielded()
+{
+  Task task = {0, 25, 0, 0, 0};
+  stepsDone = 0;
+  runTask(task, steppingTask);
+  TEST_ASSERT_EQUAL(3, stepsDone); // Over budget after the third step
+  TEST_ASSERT_EQUAL(1, task.overruns);
+  TEST_ASSERT_EQUAL(30, task.worstSliceMicros);
+  runTask(task, steppingTask);
+  TEST_ASSERT_EQUAL(6, stepsDone);
+  runTask(task, steppingTask);
+  runTask(task, steppingTask);
+  TEST_ASSERT_EQUAL(10, stepsDone);
+  TEST_ASSERT_EQUAL(0, task.resume); // Finished, the next slice starts again from the top
+  TEST_ASSERT_EQUAL(3, task.overruns); // The last slice only had one step
+
+  task.budgetMicros = 1000;
+  runTask(task, steppingTask);
+  TEST_ASSERT_EQUAL(20, stepsDone);
+  TEST_ASSERT_EQUAL(3, task.overruns);
+  TEST_ASSERT_EQUAL(100, task.worstSliceMicros);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Microbenchmarks
+//
+
+#define BENCH_ITERATIONS 1000
+
+unsigned long benchMicros()
+{
+#ifdef ARDUINO
+  return micros();
+#else
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/**
+ * Keeps the optimizer from throwing away results we never look at
+ */
+volatile byte benchSink;
+
+void reportBenchmark(const char *name, unsigned long elapsedMicros)
+{
+  char message[64];
+  snprintf(message, sizeof(message), "%-12s %lu ns/op", name, elapsedMicros * 1000UL / BENCH_ITERATIONS);
+  TEST_MESSAGE(message);
+}
+
+/**
+ * A registration's worth of work: one 4' and one 16' stop on an 8 note chord
+ */
+void test_benchmarks()
+{
+  const int pitches[] = {36, 40, 43, 48, 52, 55, 60, 64, END};
+  Bitmap128 keys = bitmapOf(pitches);
+  Bitmap128 rank = {};
+  unsigned long start;
+
+  start = benchMicros();
+  for (int i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    rank |= keys << 12;
+    rank |= keys >> 12;
+    benchSink = rank.words[0];
+  }
+  reportBenchmark("shift+or", benchMicros() - start);
+
+  start = benchMicros();
+  for (int i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    benchSink = (rank ^ keys).count();
+  }
+  reportBenchmark("xor+count", benchMicros() - start);
+
+  start = benchMicros();
+  for (int i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    for (byte pitch : rank.setBits())
+    {
+      benchSink = pitch;
+    }
+  }
+  reportBenchmark("iterate", benchMicros() - start);
+
+  start = benchMicros();
+  for (int i = 0; i < BENCH_ITERATIONS; i++)
+  {
+    for (int pitch = 0; pitch < 128; pitch++)
+    {
+      if (rank.get(pitch))
+      {
+        benchSink = pitch;
+      }
+    }
+  }
+  reportBenchmark("scan 128", benchMicros() - start);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Runner
+//
+
+int runTests()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_set_and_get_every_bit);
+  RUN_TEST(test_byte_layout_matches_old_bitmaps);
+  RUN_TEST(test_count);
+  RUN_TEST(test_or_and_not_xor);
+  RUN_TEST(test_shift_up);
+  RUN_TEST(test_shift_down);
+  RUN_TEST(test_clip_and_lowest);
+  RUN_TEST(test_set_bit_iteration);
+  RUN_TEST(test_held_keys_follow_presses_and_releases);
+  RUN_TEST(test_held_keys_overflow_and_recover);
+  RUN_TEST(test_debouncer_waits_for_a_stop_to_settle);
+  RUN_TEST(test_debouncer_ignores_bounces);
+  RUN_TEST(test_rank_diff_finds_changed_pipes);
+  RUN_TEST(test_output_queue_wraps_and_fills);
+  RUN_TEST(test_a_word_diff_fits_once_there_is_room_for_it);
+  RUN_TEST(test_shift_register_frame_layout);
+  RUN_TEST(test_pipe_frames_pick_the_shortest_encoding_and_resync);
+  RUN_TEST(test_resync_sweeps_every_pipe_once);
+  RUN_TEST(test_onsets_are_capped_per_slice);
+  RUN_TEST(test_onsets_take_turns_under_sustained_playing);
+  RUN_TEST(test_stop_change_patches_the_same_pipes_as_a_full_build);
+  RUN_TEST(test_4_foot_coupler_drops_keys_past_the_top_of_the_compass);
+  RUN_TEST(test_16_foot_coupler_drops_keys_past_the_bottom_of_the_compass);
+  RUN_TEST(test_packed_stops_route_like_the_boolean_array);
+  RUN_TEST(test_input_filter_only_lets_keyboard_notes_and_our_sysex_through);
+  RUN_TEST(test_task_resumes_where_it_yielded);
+  RUN_TEST(test_benchmarks);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup()
+{
+  delay(2000); // Give the test runner time to open the serial port
+  runTests();
+}
+
+void loop()
+{
+}
+#else
+int main()
+{
+  return runTests();
+}
+#endif
@@ -0,0 +1,345 @@
+/**
+ * LMNC Organ Brain - Batch Router (host only)
+ *
+ * Computes the four rank bitmaps for many (stops, keys) states at once, for tools that sweep the
+ * whole state space. It uses the same routing tables as the firmware (OrganConfig.h), but works a
+ * whole 128 note bitmap at a time: couplers OR keyboards together, then every pulled stop ORs its
+ * division's keys into its rank, shifted up by its transposition.
+ *
+ * Three implementations give identical results:
+ *  - routeBatchScalar: plain 64-bit words, works everywhere
+ *  - routeBatchSSE2:   one state per 128-bit register (any x86-64)
+ *  - routeBatchAVX2:   two states per 256-bit register, only called if the CPU supports it
+ *
+ * Coupled keys are clipped to the compass of the division they're coupled to. The SIMD ones only
+ * do unison couplers, which is every coupler on the console so far. routeBatch() picks the fastest
+ * one available that can route the table, and falls back to the scalar one if a coupler
+ * transposes. tools/equivalence.cpp checks it against the firmware engine and tools/bench.cpp
+ * compares their speed.
+ *
+ * The bitmaps have the same layout as the firmware's Bitmap128 note bitmaps on a little-endian
+ * host: pitch n is bit n % 64 of word n / 64.
+ */
+#ifndef BATCH_ROUTER_H
+#define BATCH_ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "OrganConfig.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BATCH_ROUTER_X86 1
+#include <immintrin.h>
+#endif
+
+struct alignas(16) RouteBitmap
+{
+  uint64_t lo; // Pitches 0-63
+  uint64_t hi; // Pitches 64-127
+};
+
+struct RouteState
+{
+  uint32_t stops; // Bit n set = the stop on pin n is pulled
+  RouteBitmap keys[DIVISION_COUNT];
+};
+
+struct RouteResult
+{
+  RouteBitmap ranks[RANK_COUNT];
+};
+
+/**
+ * A routing table entry with the stop pin turned into a bit of RouteState::stops
+ */
+struct BatchRoute
+{
+  uint32_t stopBit;
+  byte from; // Source Division (for couplers, the keyboard)
+  byte to;   // Rank (for couplers, the Division)
+  int8_t transpose;
+};
+
+struct BatchRoutingTable
+{
+  BatchRoute stops[STOP_ROUTE_COUNT];
+  BatchRoute couplers[COUPLER_ROUTE_COUNT];
+  RouteBitmap compasses[DIVISION_COUNT]; // Coupled keys are clipped to these
+  bool plainCouplers;                    // No coupler needs shifting
+};
+
+/**
+ * Every pitch from lowest to highest
+ */
+inline RouteBitmap compassBitmap(const PitchRange &range)
+{
+  RouteBitmap bitmap = {0, 0};
+  for (int pitch = range.lowest; pitch <= range.highest; pitch++)
+  {
+    (pitch < 64 ? bitmap.lo : bitmap.hi) |= 1ULL << (pitch % 64);
+  }
+  return bitmap;
+}
+
+inline BatchRoutingTable loadBatchRoutingTable()
+{
+  BatchRoutingTable table;
+  for (size_t i = 0; i < STOP_ROUTE_COUNT; i++)
+  {
+    StopRoute route = readStopRoute(i);
+    table.stops[i] = {(uint32_t)1 << route.stopPin, route.division, route.rank, (int8_t)route.transpose};
+  }
+  table.plainCouplers = true;
+  for (size_t i = 0; i < COUPLER_ROUTE_COUNT; i++)
+  {
+    CouplerRoute coupler = readCouplerRoute(i);
+    table.couplers[i] = {(uint32_t)1 << coupler.stopPin, coupler.keyboard, coupler.division, coupler.transpose};
+    table.plainCouplers = table.plainCouplers && coupler.transpose == 0;
+  }
+  for (int division = 0; division < DIVISION_COUNT; division++)
+  {
+    table.compasses[division] = compassBitmap(KEYBOARD_RANGES[division]);
+  }
+  return table;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Scalar
+//
+
+/**
+ * Shift a bitmap up by n (< 64) semitones. Notes shifted past the top are dropped.
+ */
+inline RouteBitmap shiftUp(RouteBitmap bitmap, int n)
+{
+  if (n == 0)
+  {
+    return bitmap;
+  }
+  return {bitmap.lo << n, (bitmap.hi << n) | (bitmap.lo >> (64 - n))};
+}
+
+/**
+ * Shift a bitmap up (n > 0) or down (n < 0) by any number of semitones
+ */
+inline RouteBitmap shiftBy(RouteBitmap bitmap, int n)
+{
+  if (n >= 64)
+  {
+    return {0, bitmap.lo << (n - 64)};
+  }
+  if (n >= 0)
+  {
+    return shiftUp(bitmap, n);
+  }
+  if (n <= -64)
+  {
+    return {bitmap.hi >> (-n - 64), 0};
+  }
+  return {(bitmap.lo >> -n) | (bitmap.hi << (64 + n)), bitmap.hi >> -n};
+}
+
+inline void routeBatchScalar(const BatchRoutingTable &table, const RouteState *states, RouteResult *results,
+                             size_t count)
+{
+  for (size_t s = 0; s < count; s++)
+  {
+    const RouteState &state = states[s];
+    RouteBitmap divisionKeys[DIVISION_COUNT];
+    for (int division = 0; division < DIVISION_COUNT; division++)
+    {
+      divisionKeys[division] = state.keys[division];
+    }
+    for (const BatchRoute &coupler : table.couplers)
+    {
+      uint64_t mask = (state.stops & coupler.stopBit) ? ~0ULL : 0;
+      RouteBitmap coupled = shiftBy(state.keys[coupler.from], coupler.transpose);
+      divisionKeys[coupler.to].lo |= coupled.lo & table.compasses[coupler.to].lo & mask;
+      divisionKeys[coupler.to].hi |= coupled.hi & table.compasses[coupler.to].hi & mask;
+    }
+
+    RouteResult &result = results[s];
+    for (int rank = 0; rank < RANK_COUNT; rank++)
+    {
+      result.ranks[rank] = {0, 0};
+    }
+    for (const BatchRoute &route : table.stops)
+    {
+      uint64_t mask = (state.stops & route.stopBit) ? ~0ULL : 0;
+      RouteBitmap shifted = shiftUp(divisionKeys[route.from], route.transpose);
+      result.ranks[route.to].lo |= shifted.lo & mask;
+      result.ranks[route.to].hi |= shifted.hi & mask;
+    }
+  }
+}
+
+#ifdef BATCH_ROUTER_X86
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SSE2
+//
+// SSE2 has no 128-bit bit shift, so shift both 64-bit halves and carry the bits that cross from
+// the low half into the high half. Shifting by 64 or more gives 0, so a transposition of 0 needs no
+// special case.
+//
+
+inline void routeBatchSSE2(const BatchRoutingTable &table, const RouteState *states, RouteResult *results, size_t count)
+{
+  __m128i shiftCounts[STOP_ROUTE_COUNT];
+  __m128i carryCounts[STOP_ROUTE_COUNT];
+  for (size_t i = 0; i < STOP_ROUTE_COUNT; i++)
+  {
+    shiftCounts[i] = _mm_cvtsi32_si128(table.stops[i].transpose);
+    carryCounts[i] = _mm_cvtsi32_si128(64 - table.stops[i].transpose);
+  }
+  __m128i compasses[DIVISION_COUNT];
+  for (int division = 0; division < DIVISION_COUNT; division++)
+  {
+    compasses[division] = _mm_load_si128((const __m128i *)&table.compasses[division]);
+  }
+
+  for (size_t s = 0; s < count; s++)
+  {
+    const RouteState &state = states[s];
+    __m128i keys[DIVISION_COUNT];
+    __m128i divisionKeys[DIVISION_COUNT];
+    for (int division = 0; division < DIVISION_COUNT; division++)
+    {
+      keys[division] = _mm_load_si128((const __m128i *)&state.keys[division]);
+      divisionKeys[division] = keys[division];
+    }
+    for (const BatchRoute &coupler : table.couplers)
+    {
+      __m128i mask = _mm_and_si128(_mm_set1_epi32((state.stops & coupler.stopBit) ? -1 : 0),
+                                   compasses[coupler.to]);
+      divisionKeys[coupler.to] = _mm_or_si128(divisionKeys[coupler.to], _mm_and_si128(keys[coupler.from], mask));
+    }
+
+    __m128i ranks[RANK_COUNT];
+    for (int rank = 0; rank < RANK_COUNT; rank++)
+    {
+      ranks[rank] = _mm_setzero_si128();
+    }
+    for (size_t i = 0; i < STOP_ROUTE_COUNT; i++)
+    {
+      const BatchRoute &route = table.stops[i];
+      __m128i mask = _mm_set1_epi32((state.stops & route.stopBit) ? -1 : 0);
+      __m128i source = divisionKeys[route.from];
+      __m128i shifted = _mm_or_si128(_mm_sll_epi64(source, shiftCounts[i]),
+                                     _mm_srl_epi64(_mm_slli_si128(source, 8), carryCounts[i]));
+      ranks[route.to] = _mm_or_si128(ranks[route.to], _mm_and_si128(shifted, mask));
+    }
+    for (int rank = 0; rank < RANK_COUNT; rank++)
+    {
+      _mm_store_si128((__m128i *)&results[s].ranks[rank], ranks[rank]);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// AVX2
+//
+// Two states side by side, one per 128-bit lane. _mm256_slli_si256 shifts within each lane, which
+// is exactly the low-to-high carry we need.
+//
+
+__attribute__((target("avx2"))) inline __m256i loadPair(const RouteBitmap &a, const RouteBitmap &b)
+{
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *)&a)),
+                                 _mm_load_si128((const __m128i *)&b), 1);
+}
+
+__attribute__((target("avx2"))) inline __m256i stopMaskPair(uint32_t stopsA, uint32_t stopsB, uint32_t stopBit)
+{
+  return _mm256_setr_epi64x((stopsA & stopBit) ? -1 : 0, (stopsA & stopBit) ? -1 : 0,
+                            (stopsB & stopBit) ? -1 : 0, (stopsB & stopBit) ? -1 : 0);
+}
+
+__attribute__((target("avx2"))) inline void routeBatchAVX2(const BatchRoutingTable &table, const RouteState *states,
+                                                           RouteResult *results, size_t count)
+{
+  __m128i shiftCounts[STOP_ROUTE_COUNT];
+  __m128i carryCounts[STOP_ROUTE_COUNT];
+  for (size_t i = 0; i < STOP_ROUTE_COUNT; i++)
+  {
+    shiftCounts[i] = _mm_cvtsi32_si128(table.stops[i].transpose);
+    carryCounts[i] = _mm_cvtsi32_si128(64 - table.stops[i].transpose);
+  }
+  __m256i compasses[DIVISION_COUNT];
+  for (int division = 0; division < DIVISION_COUNT; division++)
+  {
+    compasses[division] = loadPair(table.compasses[division], table.compasses[division]);
+  }
+
+  size_t s = 0;
+  for (; s + 1 < count; s += 2)
+  {
+    const RouteState &a = states[s];
+    const RouteState &b = states[s + 1];
+    __m256i keys[DIVISION_COUNT];
+    __m256i divisionKeys[DIVISION_COUNT];
+    for (int division = 0; division < DIVISION_COUNT; division++)
+    {
+      keys[division] = loadPair(a.keys[division], b.keys[division]);
+      divisionKeys[division] = keys[division];
+    }
+    for (const BatchRoute &coupler : table.couplers)
+    {
+      __m256i mask = _mm256_and_si256(stopMaskPair(a.stops, b.stops, coupler.stopBit), compasses[coupler.to]);
+      divisionKeys[coupler.to] = _mm256_or_si256(divisionKeys[coupler.to], _mm256_and_si256(keys[coupler.from], mask));
+    }
+
+    __m256i ranks[RANK_COUNT];
+    for (int rank = 0; rank < RANK_COUNT; rank++)
+    {
+      ranks[rank] = _mm256_setzero_si256();
+    }
+    for (size_t i = 0; i < STOP_ROUTE_COUNT; i++)
+    {
+      const BatchRoute &route = table.stops[i];
+      __m256i mask = stopMaskPair(a.stops, b.stops, route.stopBit);
+      __m256i source = divisionKeys[route.from];
+      __m256i shifted = _mm256_or_si256(_mm256_sll_epi64(source, shiftCounts[i]),
+                                        _mm256_srl_epi64(_mm256_slli_si256(source, 8), carryCounts[i]));
+      ranks[route.to] = _mm256_or_si256(ranks[route.to], _mm256_and_si256(shifted, mask));
+    }
+    for (int rank = 0; rank < RANK_COUNT; rank++)
+    {
+      _mm_store_si128((__m128i *)&results[s].ranks[rank], _mm256_castsi256_si128(ranks[rank]));
+      _mm_store_si128((__m128i *)&results[s + 1].ranks[rank], _mm256_extracti128_si256(ranks[rank], 1));
+    }
+  }
+
+  // Odd one out
+  routeBatchSSE2(table, states + s, results + s, count - s);
+}
+#endif // BATCH_ROUTER_X86
+
+/**
+ * Route a batch of states with the fastest implementation this CPU supports
+ */
+inline void routeBatch(const BatchRoutingTable &table, const RouteState *states, RouteResult *results, size_t count)
+{
+#ifdef BATCH_ROUTER_X86
+  static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+  if (!table.plainCouplers)
+  {
+    routeBatchScalar(table, states, results, count);
+  }
+  else if (hasAVX2)
+  {
+    routeBatchAVX2(table, states, results, count);
+  }
+  else
+  {
+    routeBatchSSE2(table, states, results, count);
+  }
+#else
+  routeBatchScalar(table, states, results, count);
+#endif
+}
+
+#endif // BATCH_ROUTER_H
@@ -0,0 +1,540 @@
+/**
+ * LMNC Organ Brain - Benchmarks (host tool)
+ *
+ * Host-side speed comparisons for the routing code. Numbers from a workstation don't translate
+ * directly to the Nano, but the relative cost of two approaches usually does.
+ *
+ * Build and run from the project root:
+ *   g++ -std=c++17 -O2 -Iinclude -Itools tools/bench.cpp -o bench && ./bench [name filter]
+ *
+ * With a filter, only the benchmarks whose name contains it are run.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "OrganEngine.h"
+#include "BatchRouter.h"
+#include "PipeFrames.h"
+
+/**
+ * Keeps the optimizer from throwing away results we never look at
+ */
+volatile uint64_t benchSink;
+
+uint64_t benchRandom(uint64_t &state)
+{
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Keys a keyboard really has. The engine only routes keys inside KEYBOARD_RANGES, since the firmware
+ * drops the rest before they get to it, so the checks below would fail on anything else.
+ */
+int compassKeys(int keyboard)
+{
+  return KEYBOARD_RANGES[keyboard].highest - KEYBOARD_RANGES[keyboard].lowest + 1;
+}
+
+int randomKey(uint64_t &seed, int keyboard)
+{
+  return KEYBOARD_RANGES[keyboard].lowest + benchRandom(seed) % compassKeys(keyboard);
+}
+
+/**
+ * Times fn(), which does `items` units of work per call, and prints items per second
+ */
+template <typename Fn>
+double benchmark(const char *name, uint64_t items, Fn fn)
+{
+  using namespace std::chrono;
+  fn(); // Warm up
+  int repetitions = 0;
+  auto start = steady_clock::now();
+  double seconds = 0;
+  do
+  {
+    fn();
+    repetitions++;
+    seconds = duration<double>(steady_clock::now() - start).count();
+  } while (seconds < 0.5);
+  double perSecond = items * repetitions / seconds;
+  printf("  %-40s %14.0f /s\n", name, perSecond);
+  return perSecond;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Rank Bitmaps: firmware engine vs batch router
+//
+
+/**
+ * Random registrations with chords of up to 20 keys per keyboard
+ */
+std::vector<RouteState> makeRouteStates(size_t count)
+{
+  std::vector<RouteState> states(count);
+  uint64_t seed = 1;
+  for (RouteState &state : states)
+  {
+    state.stops = (uint32_t)benchRandom(seed) & (((1UL << STOP_STATES_SIZE) - 1) & ~3UL);
+    for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+    {
+      RouteBitmap &keys = state.keys[keyboard];
+      keys = {0, 0};
+      int held = benchRandom(seed) % 21;
+      for (int i = 0; i < held; i++)
+      {
+        int pitch = randomKey(seed, keyboard);
+        (pitch < 64 ? keys.lo : keys.hi) |= 1ULL << (pitch % 64);
+      }
+    }
+  }
+  return states;
+}
+
+void benchRankBitmaps()
+{
+  printf("Rank bitmaps (states)\n");
+  const size_t count = 1 << 16;
+  std::vector<RouteState> states = makeRouteStates(count);
+  std::vector<RouteResult> expected(count);
+  std::vector<RouteResult> results(count);
+  BatchRoutingTable table = loadBatchRoutingTable();
+
+  // The per-pitch routing the firmware runs
+  benchmark("firmware engine", count / 16, [&]()
+  {
+    Bitmap128 rankBitmaps[RANK_COUNT];
+    Bitmap128 keyboards[DIVISION_COUNT];
+    for (size_t s = 0; s < count / 16; s++)
+    {
+      boolean stopSwitchStates[STOP_STATES_SIZE];
+      for (int pin = 0; pin < STOP_STATES_SIZE; pin++)
+      {
+        stopSwitchStates[pin] = (states[s].stops >> pin) & 1;
+      }
+      memcpy(keyboards, states[s].keys, sizeof(keyboards)); // Same layout on a little-endian host
+      buildNewRankStates(stopSwitchStates, keyboards, rankBitmaps);
+      memcpy(&expected[s], rankBitmaps, sizeof(RouteResult));
+    }
+  });
+
+  std::vector<RouteResult> engineResults(expected.begin(), expected.begin() + count / 16);
+  routeBatchScalar(table, states.data(), expected.data(), count);
+  if (memcmp(engineResults.data(), expected.data(), engineResults.size() * sizeof(RouteResult)) != 0)
+  {
+    printf("  !! Scalar results differ from the firmware engine\n");
+  }
+  benchmark("batch scalar", count, [&]()
+  {
+    routeBatchScalar(table, states.data(), results.data(), count);
+    benchSink = results[0].ranks[0].lo;
+  });
+#ifdef BATCH_ROUTER_X86
+  benchmark("batch SSE2", count, [&]()
+  {
+    routeBatchSSE2(table, states.data(), results.data(), count);
+    benchSink = results[0].ranks[0].lo;
+  });
+  if (memcmp(results.data(), expected.data(), count * sizeof(RouteResult)) != 0)
+  {
+    printf("  !! SSE2 results differ from scalar\n");
+  }
+  if (__builtin_cpu_supports("avx2"))
+  {
+    benchmark("batch AVX2", count, [&]()
+    {
+      routeBatchAVX2(table, states.data(), results.data(), count);
+      benchSink = results[0].ranks[0].lo;
+    });
+    if (memcmp(results.data(), expected.data(), count * sizeof(RouteResult)) != 0)
+    {
+      printf("  !! AVX2 results differ from scalar\n");
+    }
+  }
+  else
+  {
+    printf("  %-40s %14s\n", "batch AVX2", "(not supported)");
+  }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Held Keys: scanning every key vs walking the held key lists
+//
+
+/**
+ * Routes one keyboard state over and over with every stop pulled, both ways
+ */
+void benchHeldKeysAt(int keysPerKeyboard)
+{
+  boolean stopSwitchStates[STOP_STATES_SIZE];
+  for (int pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    stopSwitchStates[pin] = true;
+  }
+  Bitmap128 keyboardBitmaps[DIVISION_COUNT] = {};
+  HeldKeyList heldKeyLists[DIVISION_COUNT] = {};
+  uint64_t seed = keysPerKeyboard;
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    // The pedalboard has fewer keys than the manuals, so it can only hold all of them
+    while (keyboardBitmaps[keyboard].count() < std::min(keysPerKeyboard, compassKeys(keyboard)))
+    {
+      setHeldKey(keyboardBitmaps[keyboard], heldKeyLists[keyboard], randomKey(seed, keyboard), true);
+    }
+  }
+  Bitmap128 rankBitmaps[RANK_COUNT];
+
+  const int passes = 1000;
+  char name[64];
+  snprintf(name, sizeof(name), "%d keys/manual, scan compass", keysPerKeyboard);
+  benchmark(name, passes, [&]()
+  {
+    for (int i = 0; i < passes; i++)
+    {
+      buildNewRankStates(stopSwitchStates, keyboardBitmaps, rankBitmaps);
+      benchSink = rankBitmaps[0].words[0];
+    }
+  });
+  Bitmap128 scanned = rankBitmaps[0];
+
+  snprintf(name, sizeof(name), "%d keys/manual, held keys%s", keysPerKeyboard,
+           keysPerKeyboard > MAX_HELD_KEYS ? " (overflowed)" : "");
+  benchmark(name, passes, [&]()
+  {
+    for (int i = 0; i < passes; i++)
+    {
+      buildNewRankStatesFromHeldKeys(stopSwitchStates, keyboardBitmaps, heldKeyLists, rankBitmaps);
+      benchSink = rankBitmaps[0].words[0];
+    }
+  });
+  if (rankBitmaps[0] != scanned)
+  {
+    printf("  !! Held key results differ from the scan\n");
+  }
+}
+
+void benchHeldKeys()
+{
+  printf("Held keys (routing passes, every stop pulled)\n");
+  // Typical playing, a full list, and every key of a 61 note manual
+  benchHeldKeysAt(2);
+  benchHeldKeysAt(10);
+  benchHeldKeysAt(MAX_HELD_KEYS);
+  benchHeldKeysAt(61);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Rank Banks: reset, build and copy back per pitch vs building into a second bank and swapping
+//
+
+/**
+ * Alternates between two chords, so every pass has pipes to turn on and off, and counts the changes
+ * each way of diffing finds
+ */
+void benchRankBanks()
+{
+  printf("Rank banks (routing passes, every stop pulled, chord changes every pass)\n");
+  boolean stopSwitchStates[STOP_STATES_SIZE];
+  for (int pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    stopSwitchStates[pin] = true;
+  }
+  Bitmap128 keyboardBitmaps[2][DIVISION_COUNT] = {};
+  HeldKeyList heldKeyLists[2][DIVISION_COUNT] = {};
+  uint64_t seed = 37;
+  for (int chord = 0; chord < 2; chord++)
+  {
+    for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+    {
+      while (keyboardBitmaps[chord][keyboard].count() < 6)
+      {
+        setHeldKey(keyboardBitmaps[chord][keyboard], heldKeyLists[chord][keyboard], randomKey(seed, keyboard), true);
+      }
+    }
+  }
+
+  const int passes = 1000;
+  uint64_t copyChanges = 0;
+  benchmark("reset, build, diff and copy per pitch", passes, [&]()
+  {
+    Bitmap128 committed[RANK_COUNT] = {};
+    Bitmap128 next[RANK_COUNT];
+    copyChanges = 0;
+    for (int i = 0; i < passes; i++)
+    {
+      buildNewRankStatesFromHeldKeys(stopSwitchStates, keyboardBitmaps[i & 1], heldKeyLists[i & 1], next);
+      for (int pitch = PIPES_LOWEST_PITCH; pitch <= PIPES_HIGHEST_PITCH; pitch++)
+      {
+        for (byte rank = 0; rank < RANK_COUNT; rank++)
+        {
+          if (inRange(RANK_RANGES[rank], pitch))
+          {
+            copyChanges += setNoteState(committed[rank], pitch, next[rank].get(pitch));
+          }
+        }
+      }
+    }
+    benchSink = committed[0].words[0];
+  });
+
+  uint64_t bankChanges = 0;
+  benchmark("build into next bank, XOR diff and swap", passes, [&]()
+  {
+    Bitmap128 banks[2][RANK_COUNT] = {};
+    byte committed = 0;
+    bankChanges = 0;
+    for (int i = 0; i < passes; i++)
+    {
+      buildNewRankStatesFromHeldKeys(stopSwitchStates, keyboardBitmaps[i & 1], heldKeyLists[i & 1],
+                                     banks[committed ^ 1]);
+      for (byte rank = 0; rank < RANK_COUNT; rank++)
+      {
+        for (byte word = 0; word < BITMAP_WORD_COUNT; word++)
+        {
+          diffRankWord(banks[committed][rank], banks[committed ^ 1][rank], rank, word,
+                       [&](byte, byte, boolean) { bankChanges++; });
+        }
+      }
+      committed ^= 1;
+    }
+    benchSink = banks[committed][0].words[0];
+  });
+  if (copyChanges != bankChanges)
+  {
+    printf("  !! Bank diff found %llu changes, the copy found %llu\n", (unsigned long long)bankChanges,
+           (unsigned long long)copyChanges);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Pipe Frames: bytes on the wire per change set, MIDI notes vs pipe frames
+//
+
+struct WireScenario
+{
+  const char *name;
+  uint32_t stopsBefore;
+  uint32_t stopsAfter;
+  int keysBefore; // Per keyboard
+  int keysAfter;
+  boolean newChord; // Different keys after, rather than more of the same ones
+};
+
+void routeScenario(uint32_t stops, int keysPerKeyboard, uint64_t seed, Bitmap128 (&rankStates)[RANK_COUNT])
+{
+  boolean stopSwitchStates[STOP_STATES_SIZE];
+  for (int pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    stopSwitchStates[pin] = (stops >> pin) & 1;
+  }
+  Bitmap128 keyboards[DIVISION_COUNT] = {};
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    // A seed per keyboard, so asking for more keys keeps the ones before
+    uint64_t keySeed = seed * DIVISION_COUNT + keyboard;
+    while (keyboards[keyboard].count() < keysPerKeyboard)
+    {
+      keyboards[keyboard].set(randomKey(keySeed, keyboard), true);
+    }
+  }
+  buildNewRankStates(stopSwitchStates, keyboards, rankStates);
+}
+
+/**
+ * Sends each scenario both ways and counts the bytes. MIDI is three bytes a note, the MIDI Library
+ * doesn't use running status. The frames are checked against the reference decoder.
+ */
+void benchPipeFrames()
+{
+  printf("Pipe frames (bytes per change set, MIDI notes vs pipe frames)\n");
+  const uint32_t allStops = ((1UL << STOP_STATES_SIZE) - 1) & ~3UL;
+  const uint32_t someStops = allStops & 0x0A5A50UL;
+  const WireScenario scenarios[] = {
+      {"one more key, every stop", allStops, allStops, 5, 6, false},
+      {"chord change, some stops", someStops, someStops, 6, 6, true},
+      {"chord change, every stop", allStops, allStops, 6, 6, true},
+      {"registration change, chord held", someStops, allStops, 6, 6, false},
+      {"every stop in, chord held", allStops, 0, 10, 10, false},
+  };
+  printf("  %-40s %8s %8s %7s\n", "", "MIDI", "frames", "saved");
+  for (const WireScenario &scenario : scenarios)
+  {
+    Bitmap128 before[RANK_COUNT];
+    Bitmap128 after[RANK_COUNT];
+    routeScenario(scenario.stopsBefore, scenario.keysBefore, 5, before);
+    routeScenario(scenario.stopsAfter, scenario.keysAfter, scenario.newChord ? 6 : 5, after);
+    PipeFrameDecoder decoder;
+    resetPipeFrameDecoder(decoder);
+    byte sequence = 0;
+    byte frame[PIPE_FRAME_MAX_BYTES];
+    for (byte rank = 0; rank < RANK_COUNT; rank++)
+    {
+      byte length = encodePipeFrame(sequence++, rank, before[rank], before[rank], true, frame);
+      for (byte i = 0; i < length; i++)
+      {
+        decodePipeFrameByte(decoder, frame[i]);
+      }
+    }
+
+    unsigned midiBytes = 0;
+    unsigned frameBytes = 0;
+    for (byte rank = 0; rank < RANK_COUNT; rank++)
+    {
+      midiBytes += 3 * (before[rank] ^ after[rank]).count();
+      if (before[rank] == after[rank])
+      {
+        continue;
+      }
+      byte length = encodePipeFrame(sequence++, rank, before[rank], after[rank], false, frame);
+      frameBytes += length;
+      for (byte i = 0; i < length; i++)
+      {
+        decodePipeFrameByte(decoder, frame[i]);
+      }
+      if (decoder.ranks[rank] != after[rank])
+      {
+        printf("  !! The decoder doesn't match rank %d after %s\n", rank, scenario.name);
+      }
+    }
+    printf("  %-40s %8u %8u %6.0f%%\n", scenario.name, midiBytes, frameBytes,
+           midiBytes ? 100.0 * (midiBytes - (double)frameBytes) / midiBytes : 0.0);
+  }
+
+  // Random chords as rank states, so the encodings get a mix of sizes
+  const int changeSets = 1000;
+  std::vector<RouteState> states = makeRouteStates(changeSets + 1);
+  std::vector<Bitmap128> pipes((changeSets + 1) * DIVISION_COUNT);
+  for (int i = 0; i <= changeSets; i++)
+  {
+    memcpy(&pipes[i * DIVISION_COUNT], states[i].keys, sizeof(states[i].keys)); // Same layout on a little-endian host
+  }
+  benchmark("encode a frame per changed rank", changeSets, [&]()
+  {
+    byte frame[PIPE_FRAME_MAX_BYTES];
+    byte sequence = 0;
+    unsigned bytes = 0;
+    for (int i = 0; i < changeSets; i++)
+    {
+      for (byte rank = 0; rank < DIVISION_COUNT; rank++)
+      {
+        bytes += encodePipeFrame(sequence++, rank, pipes[i * DIVISION_COUNT + rank],
+                                 pipes[(i + 1) * DIVISION_COUNT + rank], false, frame);
+      }
+    }
+    benchSink = bytes;
+  });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Stop Changes: a full build vs patching one drawstop into the committed state
+//
+
+/**
+ * Pulls and pushes in the Great Open Diapason over and over, with a full chord held on every
+ * keyboard and most of the stops pulled, so the stop shares pipes with the Swell's principals
+ */
+void benchStopChanges()
+{
+  printf("Stop changes (one drawstop moving, 10 keys/manual, most stops pulled)\n");
+  const uint32_t stops = ((1UL << STOP_STATES_SIZE) - 1) & ~3UL;
+  const byte pin = GreatOpenDiapason8_PIN_15;
+  boolean stopSwitchStates[STOP_STATES_SIZE];
+  for (int stop = 0; stop < STOP_STATES_SIZE; stop++)
+  {
+    stopSwitchStates[stop] = (stops >> stop) & 1;
+  }
+  Bitmap128 keyboardBitmaps[DIVISION_COUNT] = {};
+  HeldKeyList heldKeyLists[DIVISION_COUNT] = {};
+  uint64_t seed = 53;
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    while (keyboardBitmaps[keyboard].count() < 10)
+    {
+      setHeldKey(keyboardBitmaps[keyboard], heldKeyLists[keyboard], randomKey(seed, keyboard), true);
+    }
+  }
+
+  const int passes = 10000;
+  Bitmap128 built[RANK_COUNT];
+  benchmark("full build from the held keys", passes, [&]()
+  {
+    for (int i = 0; i < passes; i++)
+    {
+      stopSwitchStates[pin] = !stopSwitchStates[pin];
+      buildNewRankStatesFromHeldKeys(stopSwitchStates, keyboardBitmaps, heldKeyLists, built);
+      benchSink = built[PRINCIPAL_RANK].words[0];
+    }
+  });
+
+  Bitmap128 patched[RANK_COUNT];
+  buildNewRankStates(stopSwitchStates, keyboardBitmaps, patched);
+  benchmark("copy and patch the one stop", passes, [&]()
+  {
+    Bitmap128 next[RANK_COUNT];
+    for (int i = 0; i < passes; i++)
+    {
+      stopSwitchStates[pin] = !stopSwitchStates[pin];
+      for (byte rank = 0; rank < RANK_COUNT; rank++)
+      {
+        next[rank] = patched[rank];
+      }
+      applyStopChange(stopSwitchStates, keyboardBitmaps, next, pin);
+      for (byte rank = 0; rank < RANK_COUNT; rank++)
+      {
+        patched[rank] = next[rank];
+      }
+      benchSink = patched[PRINCIPAL_RANK].words[0];
+    }
+  });
+  buildNewRankStates(stopSwitchStates, keyboardBitmaps, built);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    if (patched[rank] != built[rank])
+    {
+      printf("  !! Patched rank %d differs from a full build\n", rank);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Benchmark
+{
+  const char *name;
+  void (*run)();
+};
+
+const Benchmark BENCHMARKS[] = {
+    {"rank-bitmaps", benchRankBitmaps},
+    {"held-keys", benchHeldKeys},
+    {"rank-banks", benchRankBanks},
+    {"pipe-frames", benchPipeFrames},
+    {"stop-changes", benchStopChanges},
+};
+
+int main(int argc, char **argv)
+{
+  const char *filter = argc > 1 ? argv[1] : "";
+  for (const Benchmark &bench : BENCHMARKS)
+  {
+    if (strstr(bench.name, filter))
+    {
+      bench.run();
+      printf("\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,453 @@
+/**
+ * LMNC Organ Brain - Routing Equivalence Checker (host tool)
+ *
+ * Proves that the routing engine (OrganEngine.h, the code the firmware runs) still turns keys and
+ * stops into exactly the same pipes as the original hand-written enableNoteFor*Switches() routing.
+ * Run it after every change to the engine. The batch router the other host tools use
+ * (BatchRouter.h) and the held key routing the firmware uses (buildNewRankStatesFromHeldKeys) are
+ * checked the same way, and so is patching one drawstop into the state built without it
+ * (applyStopChange, the firmware's fast path when only a stop moved).
+ *
+ * Every stop word (all 2^19 combinations of the stop switches) is checked against a set of key
+ * bitmaps: no keys, every key, the top octave only (where the highest transposed pipes land), and
+ * --samples random chords per stop word. The random chords are seeded from the stop word, so a
+ * failure always reproduces with the same --seed.
+ *
+ * Stop words are split into chunks and shared out across all CPU cores. Each worker thread has its
+ * own queue of chunks, and a worker that runs out steals from the back of another's queue.
+ *
+ * Build and run from the project root:
+ *   g++ -std=c++17 -O2 -pthread -Iinclude -Itools tools/equivalence.cpp -o equivalence && ./equivalence
+ *
+ *   --samples  Random key bitmaps per stop word (default 64)
+ *   --threads  Worker threads (default: every core)
+ *   --seed     Seed for the random key bitmaps (default 1)
+ *
+ * Exits with 1 if any divergence was found.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "OrganEngine.h"
+#include "BatchRouter.h"
+
+#define CHUNK_SIZE 256 // Stop words per chunk of work
+#define MAX_REPORTED_DIVERGENCES 10
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Reference Model
+//
+// A straight copy of the routing as it was originally written, one if per stop. Don't "improve"
+// this, it's the thing the engine is checked against.
+//
+
+struct ReferenceState
+{
+  boolean StopSwitchStates[STOP_STATES_SIZE];
+  byte NewPrincipalPipesState[NOTES_BITMAP_ARRAY_SIZE];
+  byte NewStringPipesState[NOTES_BITMAP_ARRAY_SIZE];
+  byte NewFlutePipesState[NOTES_BITMAP_ARRAY_SIZE];
+  byte NewReedPipesState[NOTES_BITMAP_ARRAY_SIZE];
+
+  void setNoteState(byte noteBitmap[], int pitch)
+  {
+    if (pitch >= 0 && pitch < NOTES_SIZE)
+    {
+      noteBitmap[pitch / 8] |= 1 << (pitch % 8);
+    }
+  }
+
+  void enableNoteForSwellSwitches(int pitch)
+  {
+    if (StopSwitchStates[SwellOpenDiapason8_PIN_7])
+      setNoteState(NewPrincipalPipesState, pitch);
+    if (StopSwitchStates[SwellStoppedDiapason8_PIN_6])
+      setNoteState(NewFlutePipesState, pitch);
+    if (StopSwitchStates[SwellPrincipal4_PIN_5])
+      setNoteState(NewPrincipalPipesState, pitch + 12);
+    if (StopSwitchStates[SwellFlute4_PIN_4])
+    {
+      setNoteState(NewFlutePipesState, pitch + 12);
+      setNoteState(NewFlutePipesState, pitch + 24);
+    }
+    if (StopSwitchStates[SwellFifteenth2_PIN_3])
+      setNoteState(NewPrincipalPipesState, pitch + 24);
+    if (StopSwitchStates[SwellTwelfth22thirds_PIN_2])
+      setNoteState(NewPrincipalPipesState, pitch + 31);
+  }
+
+  void enableNoteForGreatSwitches(int pitch)
+  {
+    if (StopSwitchStates[GreatOpenDiapason8_PIN_15])
+      setNoteState(NewPrincipalPipesState, pitch);
+    if (StopSwitchStates[GreatLieblich8_PIN_14])
+      setNoteState(NewFlutePipesState, pitch);
+    if (StopSwitchStates[GreatSalicional8_PIN_13])
+      setNoteState(NewStringPipesState, pitch);
+    if (StopSwitchStates[GreatGemsHorn4_PIN_12])
+      setNoteState(NewPrincipalPipesState, pitch + 12);
+    if (StopSwitchStates[GreatSalicet4_PIN_11])
+      setNoteState(NewStringPipesState, pitch + 12);
+    if (StopSwitchStates[GreatNazard22thirds_PIN_10])
+      setNoteState(NewFlutePipesState, pitch + 31);
+    if (StopSwitchStates[GreatHorn8_PIN_9])
+      setNoteState(NewReedPipesState, pitch);
+    if (StopSwitchStates[GreatClarion4_PIN_8])
+      setNoteState(NewReedPipesState, pitch + 12);
+  }
+
+  void enableNoteForPedalSwitches(int pitch)
+  {
+    if (StopSwitchStates[PedalBassFlute8_PIN_20])
+    {
+      setNoteState(NewPrincipalPipesState, pitch);
+      setNoteState(NewStringPipesState, pitch);
+    }
+    if (StopSwitchStates[PedalBourdon16_PIN_19])
+      setNoteState(NewFlutePipesState, pitch);
+  }
+
+  void calculate(const byte swell[], const byte great[], const byte pedal[])
+  {
+    memset(NewPrincipalPipesState, 0, NOTES_BITMAP_ARRAY_SIZE);
+    memset(NewStringPipesState, 0, NOTES_BITMAP_ARRAY_SIZE);
+    memset(NewFlutePipesState, 0, NOTES_BITMAP_ARRAY_SIZE);
+    memset(NewReedPipesState, 0, NOTES_BITMAP_ARRAY_SIZE);
+    for (int pitch = 0; pitch < NOTES_SIZE; pitch++)
+    {
+      if ((swell[pitch / 8] >> (pitch % 8)) & 1)
+      {
+        enableNoteForSwellSwitches(pitch);
+      }
+      if ((great[pitch / 8] >> (pitch % 8)) & 1)
+      {
+        enableNoteForGreatSwitches(pitch);
+        if (StopSwitchStates[SwellToGreat_PIN_18])
+          enableNoteForSwellSwitches(pitch);
+      }
+      if ((pedal[pitch / 8] >> (pitch % 8)) & 1)
+      {
+        enableNoteForPedalSwitches(pitch);
+        if (StopSwitchStates[SwellToPedal_PIN_17])
+          enableNoteForSwellSwitches(pitch);
+        if (StopSwitchStates[GreatToPedal_PIN_16])
+          enableNoteForGreatSwitches(pitch);
+      }
+    }
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Test Cases
+//
+
+const byte STOP_PINS[] = {
+    SwellOpenDiapason8_PIN_7, SwellStoppedDiapason8_PIN_6, SwellPrincipal4_PIN_5, SwellFlute4_PIN_4,
+    SwellFifteenth2_PIN_3, SwellTwelfth22thirds_PIN_2, GreatOpenDiapason8_PIN_15, GreatLieblich8_PIN_14,
+    GreatSalicional8_PIN_13, GreatGemsHorn4_PIN_12, GreatSalicet4_PIN_11, GreatNazard22thirds_PIN_10,
+    GreatHorn8_PIN_9, GreatClarion4_PIN_8, PedalBassFlute8_PIN_20, PedalBourdon16_PIN_19,
+    SwellToGreat_PIN_18, SwellToPedal_PIN_17, GreatToPedal_PIN_16};
+const int STOP_COUNT = sizeof(STOP_PINS);
+const uint32_t STOP_WORD_COUNT = 1UL << STOP_COUNT;
+
+#define FIXED_KEY_CASES 3
+
+struct KeyCase
+{
+  byte keys[DIVISION_COUNT][NOTES_BITMAP_ARRAY_SIZE];
+};
+
+uint64_t splitmix64(uint64_t &state)
+{
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Key bitmaps for one case. The first few are fixed edge cases, the rest are random chords of up
+ * to ~20 keys per keyboard, which is about as much as two hands and two feet can hold. Keys are
+ * always inside the keyboard's compass (KEYBOARD_RANGES), since the firmware drops the rest before
+ * they get to the engine.
+ */
+void makeKeyCase(uint32_t stopWord, int sample, uint64_t seed, KeyCase &keyCase)
+{
+  memset(&keyCase, 0, sizeof(keyCase));
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    byte *keys = keyCase.keys[keyboard];
+    const PitchRange &range = KEYBOARD_RANGES[keyboard];
+    switch (sample)
+    {
+    case 0: // Nothing held
+      break;
+    case 1: // Everything held
+      for (int pitch = range.lowest; pitch <= range.highest; pitch++)
+      {
+        keys[pitch / 8] |= 1 << (pitch % 8);
+      }
+      break;
+    case 2: // Top octave, where the highest transpositions land
+      for (int pitch = range.highest - OCTAVE; pitch <= range.highest; pitch++)
+      {
+        keys[pitch / 8] |= 1 << (pitch % 8);
+      }
+      break;
+    default:
+    {
+      uint64_t state = seed ^ ((uint64_t)stopWord << 20) ^ ((uint64_t)sample << 4) ^ keyboard;
+      int held = splitmix64(state) % 21;
+      for (int i = 0; i < held; i++)
+      {
+        byte pitch = range.lowest + splitmix64(state) % (range.highest - range.lowest + 1);
+        keys[pitch / 8] |= 1 << (pitch % 8);
+      }
+    }
+    }
+  }
+}
+
+struct Divergence
+{
+  const char *model;
+  uint32_t stopWord;
+  int sample;
+  int rank;
+};
+
+struct Results
+{
+  std::atomic<uint64_t> states{0};
+  std::atomic<uint64_t> divergences{0};
+  std::mutex reportMutex;
+  std::vector<Divergence> reported;
+};
+
+/**
+ * Runs one stop word through the engine and the reference model with every key case
+ */
+void checkStopWord(const BatchRoutingTable &table, uint32_t stopWord, int samples, uint64_t seed, Results &results)
+{
+  ReferenceState reference = {};
+  boolean stopSwitchStates[STOP_STATES_SIZE] = {};
+  RouteState batchState = {};
+  for (int bit = 0; bit < STOP_COUNT; bit++)
+  {
+    boolean on = (stopWord >> bit) & 1;
+    stopSwitchStates[STOP_PINS[bit]] = on;
+    reference.StopSwitchStates[STOP_PINS[bit]] = on;
+    batchState.stops |= (uint32_t)on << STOP_PINS[bit];
+  }
+  RouteResult batchResult;
+
+  Bitmap128 newRankStates[RANK_COUNT];
+  Bitmap128 keyboardStates[DIVISION_COUNT];
+  Bitmap128 heldKeyRankStates[RANK_COUNT];
+  Bitmap128 patchedRankStates[RANK_COUNT];
+  Bitmap128 heldKeyboardStates[DIVISION_COUNT];
+  HeldKeyList heldKeys[DIVISION_COUNT];
+  const byte *referenceRankStates[RANK_COUNT];
+  referenceRankStates[PRINCIPAL_RANK] = reference.NewPrincipalPipesState;
+  referenceRankStates[STRING_RANK] = reference.NewStringPipesState;
+  referenceRankStates[FLUTE_RANK] = reference.NewFlutePipesState;
+  referenceRankStates[REED_RANK] = reference.NewReedPipesState;
+
+  KeyCase keyCase;
+  uint64_t divergences = 0;
+  for (int sample = 0; sample < FIXED_KEY_CASES + samples; sample++)
+  {
+    makeKeyCase(stopWord, sample, seed, keyCase);
+    memcpy(keyboardStates, keyCase.keys, sizeof(keyCase.keys)); // Same layout on a little-endian host
+
+    buildNewRankStates(stopSwitchStates, keyboardStates, newRankStates);
+    for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+    {
+      // Press every key the way handleMidiNote does
+      heldKeyboardStates[keyboard] = {};
+      heldKeys[keyboard] = {};
+      for (byte pitch : keyboardStates[keyboard].setBits())
+      {
+        setHeldKey(heldKeyboardStates[keyboard], heldKeys[keyboard], pitch, true);
+      }
+    }
+    buildNewRankStatesFromHeldKeys(stopSwitchStates, heldKeyboardStates, heldKeys, heldKeyRankStates);
+    memcpy(batchState.keys, keyCase.keys, sizeof(keyCase.keys));
+    routeBatch(table, &batchState, &batchResult, 1);
+    reference.calculate(keyCase.keys[SWELL], keyCase.keys[GREAT], keyCase.keys[PEDAL]);
+
+    // Route with one of the stops the other way, then patch it back. Couplers always need a full
+    // build, so only the speaking stops are tried.
+    byte patchedPin = STOP_PINS[sample % (STOP_COUNT - COUPLER_ROUTE_COUNT)];
+    stopSwitchStates[patchedPin] = !stopSwitchStates[patchedPin];
+    buildNewRankStates(stopSwitchStates, keyboardStates, patchedRankStates);
+    stopSwitchStates[patchedPin] = !stopSwitchStates[patchedPin];
+    applyStopChange(stopSwitchStates, keyboardStates, patchedRankStates, patchedPin);
+
+    for (int rank = 0; rank < RANK_COUNT; rank++)
+    {
+      const char *model = NULL;
+      if (memcmp(&newRankStates[rank], referenceRankStates[rank], NOTES_BITMAP_ARRAY_SIZE) != 0)
+      {
+        model = "engine";
+      }
+      else if (memcmp(&heldKeyRankStates[rank], referenceRankStates[rank], NOTES_BITMAP_ARRAY_SIZE) != 0)
+      {
+        model = "held keys";
+      }
+      else if (memcmp(&batchResult.ranks[rank], referenceRankStates[rank], NOTES_BITMAP_ARRAY_SIZE) != 0)
+      {
+        model = "batch router";
+      }
+      else if (memcmp(&patchedRankStates[rank], referenceRankStates[rank], NOTES_BITMAP_ARRAY_SIZE) != 0)
+      {
+        model = "stop change";
+      }
+      if (model)
+      {
+        divergences++;
+        std::lock_guard<std::mutex> lock(results.reportMutex);
+        if (results.reported.size() < MAX_REPORTED_DIVERGENCES)
+        {
+          results.reported.push_back({model, stopWord, sample, rank});
+        }
+      }
+    }
+  }
+  results.states += FIXED_KEY_CASES + samples;
+  results.divergences += divergences;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Work Stealing Pool
+//
+
+struct Chunk
+{
+  uint32_t begin;
+  uint32_t end;
+};
+
+struct WorkQueue
+{
+  std::mutex mutex;
+  std::deque<Chunk> chunks;
+};
+
+bool popOwn(WorkQueue &queue, Chunk &chunk)
+{
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.chunks.empty())
+  {
+    return false;
+  }
+  chunk = queue.chunks.front();
+  queue.chunks.pop_front();
+  return true;
+}
+
+bool steal(std::vector<WorkQueue> &queues, size_t thief, Chunk &chunk)
+{
+  for (size_t offset = 1; offset < queues.size(); offset++)
+  {
+    WorkQueue &victim = queues[(thief + offset) % queues.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.chunks.empty())
+    {
+      chunk = victim.chunks.back();
+      victim.chunks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void worker(std::vector<WorkQueue> &queues, size_t index, int samples, uint64_t seed, Results &results)
+{
+  BatchRoutingTable table = loadBatchRoutingTable();
+  Chunk chunk;
+  while (popOwn(queues[index], chunk) || steal(queues, index, chunk))
+  {
+    for (uint32_t stopWord = chunk.begin; stopWord < chunk.end; stopWord++)
+    {
+      checkStopWord(table, stopWord, samples, seed, results);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int samples = 64;
+  unsigned threads = std::thread::hardware_concurrency();
+  uint64_t seed = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--samples") && i + 1 < argc)
+    {
+      samples = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+    {
+      threads = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+    {
+      seed = strtoull(argv[++i], NULL, 0);
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--samples N] [--threads N] [--seed N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (threads == 0)
+  {
+    threads = 1;
+  }
+
+  // Deal the chunks out round robin, so every thread starts with a spread of stop words
+  std::vector<WorkQueue> queues(threads);
+  size_t next = 0;
+  for (uint32_t begin = 0; begin < STOP_WORD_COUNT; begin += CHUNK_SIZE)
+  {
+    uint32_t end = begin + CHUNK_SIZE < STOP_WORD_COUNT ? begin + CHUNK_SIZE : STOP_WORD_COUNT;
+    queues[next++ % threads].chunks.push_back({begin, end});
+  }
+
+  printf("Checking %u stop words x %d key cases on %u threads\n", STOP_WORD_COUNT, FIXED_KEY_CASES + samples, threads);
+
+  Results results;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (unsigned i = 0; i < threads; i++)
+  {
+    pool.emplace_back(worker, std::ref(queues), i, samples, seed, std::ref(results));
+  }
+  for (std::thread &thread : pool)
+  {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t states = results.states;
+  uint64_t divergences = results.divergences;
+  printf("States checked: %llu in %.2f s (%.0f states/s)\n", (unsigned long long)states, seconds, states / seconds);
+  printf("Divergences:    %llu\n", (unsigned long long)divergences);
+  for (const Divergence &divergence : results.reported)
+  {
+    printf("  %s: stop word 0x%05X, key case %d, rank %d\n", divergence.model, divergence.stopWord, divergence.sample,
+           divergence.rank);
+  }
+  return divergences == 0 ? 0 : 1;
+}
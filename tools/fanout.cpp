@@ -0,0 +1,337 @@
+/**
+ * LMNC Organ Brain - Fan-out Analyzer (host tool)
+ *
+ * For every combination of stop switches in the routing tables (OrganConfig.h), work out the worst
+ * case number of pipe messages the brain has to send:
+ *
+ *  - per key event: one key pressed on a keyboard with nothing else held
+ *  - per full-manual chord: every key on one keyboard pressed at once (or every pipe turning on at
+ *    once because the registration changed while those keys were held)
+ *  - per full-console chord: every key on every keyboard
+ *
+ * Each count is also shown as wire time at 31250 baud. The registrations whose full-console chord
+ * can overflow the output ring buffer (RING_BUFFER_MAX_SIZE) or whose full-manual chord takes longer
+ * than the latency budget to send are flagged, so we know which registrations to avoid before a
+ * concert.
+ *
+ * Keys cover each keyboard's compass and pipes each rank's compass (KEYBOARD_RANGES and RANK_RANGES).
+ * If the stops can reach a pipe outside its rank's compass, that's reported too, since the firmware
+ * will never send it.
+ *
+ * Build and run from the project root:
+ *   g++ -std=c++17 -O2 -Iinclude -Itools tools/fanout.cpp -o fanout && ./fanout [--budget-ms 100] [--list] [--worst 10]
+ *
+ *   --budget-ms  Latency budget for a full-manual chord in milliseconds (default 100)
+ *   --list       Print every flagged registration as CSV instead of the worst few
+ *   --worst      How many of the worst registrations to print (default 10)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "OrganConfig.h"
+#include "BatchRouter.h"
+
+/**
+ * Note messages are 3 bytes (status, pitch, velocity) and every byte is 10 bits on the wire
+ */
+#define MIDI_BAUD 31250
+#define NOTE_MESSAGE_BITS 30
+
+const RouteBitmap NO_KEYS = {0, 0};
+
+struct StopName
+{
+  byte pin;
+  const char *name;
+};
+
+const StopName STOP_NAMES[] = {
+    {SwellOpenDiapason8_PIN_7, "SwellOpenDiapason8"},
+    {SwellStoppedDiapason8_PIN_6, "SwellStoppedDiapason8"},
+    {SwellPrincipal4_PIN_5, "SwellPrincipal4"},
+    {SwellFlute4_PIN_4, "SwellFlute4"},
+    {SwellFifteenth2_PIN_3, "SwellFifteenth2"},
+    {SwellTwelfth22thirds_PIN_2, "SwellTwelfth22thirds"},
+    {GreatOpenDiapason8_PIN_15, "GreatOpenDiapason8"},
+    {GreatLieblich8_PIN_14, "GreatLieblich8"},
+    {GreatSalicional8_PIN_13, "GreatSalicional8"},
+    {GreatGemsHorn4_PIN_12, "GreatGemsHorn4"},
+    {GreatSalicet4_PIN_11, "GreatSalicet4"},
+    {GreatNazard22thirds_PIN_10, "GreatNazard22thirds"},
+    {GreatHorn8_PIN_9, "GreatHorn8"},
+    {GreatClarion4_PIN_8, "GreatClarion4"},
+    {PedalBassFlute8_PIN_20, "PedalBassFlute8"},
+    {PedalBourdon16_PIN_19, "PedalBourdon16"},
+    {SwellToGreat_PIN_18, "SwellToGreat"},
+    {SwellToPedal_PIN_17, "SwellToPedal"},
+    {GreatToPedal_PIN_16, "GreatToPedal"},
+};
+
+const char *DIVISION_NAMES[DIVISION_COUNT] = {"Swell", "Great", "Pedal"};
+const char *RANK_NAMES[RANK_COUNT] = {"Principal", "String", "Flute", "Reed"};
+
+struct Registration
+{
+  uint32_t stops; // Bit n set = the stop on pin n is pulled
+  int perKey[DIVISION_COUNT];
+  int perChord[DIVISION_COUNT];
+  int console;
+  int worstKey;
+  int worstChord;
+};
+
+int popcount(RouteBitmap bitmap)
+{
+  return __builtin_popcountll(bitmap.lo) + __builtin_popcountll(bitmap.hi);
+}
+
+RouteBitmap rangeBitmap(const PitchRange &range)
+{
+  RouteBitmap bitmap = NO_KEYS;
+  for (int pitch = range.lowest; pitch <= range.highest; pitch++)
+  {
+    (pitch < 64 ? bitmap.lo : bitmap.hi) |= 1ULL << (pitch % 64);
+  }
+  return bitmap;
+}
+
+RouteBitmap keyboardCompass[DIVISION_COUNT];
+RouteBitmap rankCompass[RANK_COUNT];
+
+double wireMillis(int messages)
+{
+  return messages * NOTE_MESSAGE_BITS * 1000.0 / MIDI_BAUD;
+}
+
+int countMessages(const RouteResult &result)
+{
+  int messages = 0;
+  for (int rank = 0; rank < RANK_COUNT; rank++)
+  {
+    // Pipes outside the rank's compass are never sent
+    messages += popcount({result.ranks[rank].lo & rankCompass[rank].lo, result.ranks[rank].hi & rankCompass[rank].hi});
+  }
+  return messages;
+}
+
+/**
+ * Routes one key and a full chord on each keyboard, and a full console chord, as one batch
+ */
+Registration analyze(const BatchRoutingTable &table, uint32_t stops)
+{
+  RouteState states[2 * DIVISION_COUNT + 1];
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    RouteState &key = states[2 * keyboard];
+    RouteState &chord = states[2 * keyboard + 1];
+    key.stops = chord.stops = stops;
+    for (int division = 0; division < DIVISION_COUNT; division++)
+    {
+      key.keys[division] = chord.keys[division] = NO_KEYS;
+    }
+    // The lowest key always has room for every transposition, so it's the worst single key
+    key.keys[keyboard] = rangeBitmap({KEYBOARD_RANGES[keyboard].lowest, KEYBOARD_RANGES[keyboard].lowest});
+    chord.keys[keyboard] = keyboardCompass[keyboard];
+  }
+  RouteState &console = states[2 * DIVISION_COUNT];
+  console.stops = stops;
+  for (int division = 0; division < DIVISION_COUNT; division++)
+  {
+    console.keys[division] = keyboardCompass[division];
+  }
+
+  RouteResult results[2 * DIVISION_COUNT + 1];
+  routeBatch(table, states, results, 2 * DIVISION_COUNT + 1);
+
+  Registration registration = {};
+  registration.stops = stops;
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    registration.perKey[keyboard] = countMessages(results[2 * keyboard]);
+    registration.perChord[keyboard] = countMessages(results[2 * keyboard + 1]);
+    registration.worstKey = std::max(registration.worstKey, registration.perKey[keyboard]);
+    registration.worstChord = std::max(registration.worstChord, registration.perChord[keyboard]);
+  }
+  registration.console = countMessages(results[2 * DIVISION_COUNT]);
+  return registration;
+}
+
+void printStops(uint32_t stops, const char *separator)
+{
+  bool first = true;
+  for (const StopName &stop : STOP_NAMES)
+  {
+    if (stops & (1UL << stop.pin))
+    {
+      printf("%s%s", first ? "" : separator, stop.name);
+      first = false;
+    }
+  }
+  if (first)
+  {
+    printf("(no stops)");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  double budgetMillis = 100;
+  bool list = false;
+  int worst = 10;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--budget-ms") && i + 1 < argc)
+    {
+      budgetMillis = atof(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--worst") && i + 1 < argc)
+    {
+      worst = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--list"))
+    {
+      list = true;
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--budget-ms N] [--worst N] [--list]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Every pin that's used by a stop or coupler
+  unsigned long stopMask = 0;
+  for (unsigned i = 0; i < STOP_ROUTE_COUNT; i++)
+  {
+    stopMask |= 1UL << readStopRoute(i).stopPin;
+  }
+  for (unsigned i = 0; i < COUPLER_ROUTE_COUNT; i++)
+  {
+    stopMask |= 1UL << readCouplerRoute(i).stopPin;
+  }
+  std::vector<byte> stopPins;
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    if (stopMask & (1UL << pin))
+    {
+      stopPins.push_back(pin);
+    }
+  }
+
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    keyboardCompass[keyboard] = rangeBitmap(KEYBOARD_RANGES[keyboard]);
+  }
+  for (int rank = 0; rank < RANK_COUNT; rank++)
+  {
+    rankCompass[rank] = rangeBitmap(RANK_RANGES[rank]);
+  }
+
+  BatchRoutingTable table = loadBatchRoutingTable();
+  unsigned long combinations = 1UL << stopPins.size();
+  std::vector<Registration> flagged;
+  Registration worstRegistration = {};
+  unsigned long ringOverflows = 0;
+  unsigned long overBudget = 0;
+  for (unsigned long combination = 0; combination < combinations; combination++)
+  {
+    uint32_t stops = 0;
+    for (size_t bit = 0; bit < stopPins.size(); bit++)
+    {
+      if (combination & (1UL << bit))
+      {
+        stops |= 1UL << stopPins[bit];
+      }
+    }
+
+    Registration registration = analyze(table, stops);
+    if (registration.console > worstRegistration.console)
+    {
+      worstRegistration = registration;
+    }
+    bool overflows = registration.console > RING_BUFFER_MAX_SIZE;
+    bool slow = wireMillis(registration.worstChord) > budgetMillis;
+    ringOverflows += overflows;
+    overBudget += slow;
+    if (overflows || slow)
+    {
+      flagged.push_back(registration);
+    }
+  }
+
+  std::sort(flagged.begin(), flagged.end(), [](const Registration &a, const Registration &b)
+            { return a.console > b.console; });
+
+  if (list)
+  {
+    printf("stops,swell_key,great_key,pedal_key,swell_chord,great_chord,pedal_chord,console,console_ms,"
+           "ring_overflow,over_budget\n");
+    for (const Registration &registration : flagged)
+    {
+      printf("\"");
+      printStops(registration.stops, "+");
+      printf("\",%d,%d,%d,%d,%d,%d,%d,%.1f,%d,%d\n",
+             registration.perKey[SWELL], registration.perKey[GREAT], registration.perKey[PEDAL],
+             registration.perChord[SWELL], registration.perChord[GREAT], registration.perChord[PEDAL],
+             registration.console, wireMillis(registration.console),
+             registration.console > RING_BUFFER_MAX_SIZE, wireMillis(registration.worstChord) > budgetMillis);
+    }
+    return 0;
+  }
+
+  // With every stop pulled and every key held, anything outside a rank's compass is a pipe the
+  // stops ask for that will never sound
+  RouteState everything = {(uint32_t)stopMask, {}};
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    everything.keys[keyboard] = keyboardCompass[keyboard];
+  }
+  RouteResult reached;
+  routeBatch(table, &everything, &reached, 1);
+  for (int rank = 0; rank < RANK_COUNT; rank++)
+  {
+    int outside = popcount(reached.ranks[rank]) - popcount({reached.ranks[rank].lo & rankCompass[rank].lo,
+                                                              reached.ranks[rank].hi & rankCompass[rank].hi});
+    if (outside > 0)
+    {
+      printf("!! %s stops reach %d pipes outside the rank's compass (%d-%d), they will never sound\n",
+             RANK_NAMES[rank], outside, RANK_RANGES[rank].lowest, RANK_RANGES[rank].highest);
+    }
+  }
+
+  printf("Stops in routing:          %zu (%lu registrations)\n", stopPins.size(), combinations);
+  printf("Wire time per message:     %.2f ms\n", wireMillis(1));
+  printf("Output ring buffer size:   %d messages\n", RING_BUFFER_MAX_SIZE);
+  printf("Latency budget:            %.1f ms per full-manual chord\n", budgetMillis);
+  printf("\n");
+  printf("Worst registration (full console chord): ");
+  printStops(worstRegistration.stops, " + ");
+  printf("\n");
+  for (int keyboard = 0; keyboard < DIVISION_COUNT; keyboard++)
+  {
+    printf("  %-6s key: %3d msgs %6.1f ms   chord: %4d msgs %7.1f ms\n", DIVISION_NAMES[keyboard],
+           worstRegistration.perKey[keyboard], wireMillis(worstRegistration.perKey[keyboard]),
+           worstRegistration.perChord[keyboard], wireMillis(worstRegistration.perChord[keyboard]));
+  }
+  printf("  Console chord: %d msgs %.1f ms\n", worstRegistration.console, wireMillis(worstRegistration.console));
+  printf("\n");
+  printf("Registrations that can overflow the ring buffer: %lu\n", ringOverflows);
+  printf("Registrations over the latency budget:           %lu\n", overBudget);
+
+  if (!flagged.empty() && worst > 0)
+  {
+    printf("\nWorst %d flagged registrations:\n", std::min(worst, (int)flagged.size()));
+    for (int i = 0; i < worst && i < (int)flagged.size(); i++)
+    {
+      const Registration &registration = flagged[i];
+      printf("  %4d msgs %6.1f ms  ", registration.console, wireMillis(registration.console));
+      printStops(registration.stops, " + ");
+      printf("\n");
+    }
+    printf("\nRun with --list for all of them as CSV\n");
+  }
+  return 0;
+}
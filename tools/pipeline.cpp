@@ -0,0 +1,223 @@
+/**
+ * LMNC Organ Brain - Dual Core Pipeline Stress Test (host tool)
+ *
+ * Runs the RP2040 pipeline (Pipeline.h) with a std::thread standing in for each core: the input
+ * thread pushes random key events and stop words as fast as the queues take them, and the routing
+ * thread routes them and plays the pipe changes onto a model of the pipes. At the end of each round
+ * the pipes have to match the routing of the final keys and stops, and every change the routing
+ * thread sent has to have really changed a pipe.
+ *
+ * Before that, the SPSC queue (SpscQueue.h) on its own carries a counter from one thread to the
+ * other, which has to come out in order with nothing missing.
+ *
+ * Build and run from the project root:
+ *   g++ -std=c++17 -O2 -pthread -Iinclude tools/pipeline.cpp -o pipeline && ./pipeline
+ *
+ *   --rounds  Rounds of random input (default 20)
+ *   --events  Key events per round (default 200000)
+ *   --seed    Seed for the random input (default 1)
+ *
+ * Exits with 1 if anything was lost, reordered or routed wrongly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "Pipeline.h"
+
+uint64_t pipelineRandom(uint64_t &state)
+{
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Queue
+//
+
+/**
+ * @return Number of values that came out wrong
+ */
+uint64_t stressQueue(uint32_t count)
+{
+  static SpscQueue<uint32_t, 64> queue;
+  resetSpscQueue(queue);
+  std::thread producer([&]()
+  {
+    for (uint32_t value = 0; value < count; value++)
+    {
+      while (!pushSpscQueue(queue, value))
+      {
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint64_t wrong = 0;
+  for (uint32_t expected = 0; expected < count; expected++)
+  {
+    uint32_t value;
+    while (!popSpscQueue(queue, value))
+    {
+      std::this_thread::yield();
+    }
+    wrong += value != expected;
+  }
+  producer.join();
+  return wrong;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Pipeline
+//
+
+struct RoundResult
+{
+  uint64_t passes;
+  uint64_t pipeChanges;
+  uint64_t redundantChanges; // Turned a pipe on that was on, or off that was off
+  uint64_t wrongPipes;       // Pipes that don't match the final keys and stops
+};
+
+RoundResult stressPipeline(int events, uint64_t seed)
+{
+  static Pipeline pipeline;
+  static RoutingCore core;
+  resetPipeline(pipeline);
+  resetRoutingCore(core);
+
+  // What the input thread pressed, for checking the result
+  Bitmap128 keyboardStates[DIVISION_COUNT] = {};
+  uint32_t stopWord = 0;
+  std::atomic<bool> inputDone(false);
+
+  // Core 0: key events, with a new stop word every so often
+  std::thread input([&]()
+  {
+    uint64_t state = seed;
+    for (int i = 0; i < events; i++)
+    {
+      uint64_t random = pipelineRandom(state);
+      if (random % 64 == 0)
+      {
+        stopWord = (uint32_t)(random >> 8) & ((1UL << STOP_STATES_SIZE) - 1) & ~3UL;
+        while (!pushSpscQueue(pipeline.stops, stopWord))
+        {
+          std::this_thread::yield();
+        }
+      }
+      byte keyboard = (random >> 40) % DIVISION_COUNT;
+      byte pitch = (random >> 48) % NOTES_SIZE; // Some off the keyboard, which have to be ignored
+      boolean on = (random >> 60) & 1;
+      while (!pushKeyEvent(pipeline, keyboard, pitch, on))
+      {
+        std::this_thread::yield();
+      }
+      if (inRange(KEYBOARD_RANGES[keyboard], pitch))
+      {
+        keyboardStates[keyboard].set(pitch, on);
+      }
+    }
+    inputDone.store(true, std::memory_order_release);
+  });
+
+  // Core 1: route, and play the changes onto the pipes
+  RoundResult result = {};
+  Bitmap128 pipes[RANK_COUNT] = {};
+  auto play = [&](byte rank, byte pitch, boolean on)
+  {
+    result.pipeChanges++;
+    result.redundantChanges += pipes[rank].get(pitch) == on;
+    pipes[rank].set(pitch, on);
+  };
+  std::thread routing([&]()
+  {
+    for (;;)
+    {
+      boolean done = inputDone.load(std::memory_order_acquire);
+      if (runRoutingPass(pipeline, core, play))
+      {
+        result.passes++;
+      }
+      else if (done)
+      {
+        break; // The input had finished before this pass found the queues empty
+      }
+    }
+  });
+  input.join();
+  routing.join();
+
+  boolean stopSwitchStates[STOP_STATES_SIZE];
+  for (byte pin = 0; pin < STOP_STATES_SIZE; pin++)
+  {
+    stopSwitchStates[pin] = (stopWord >> pin) & 1;
+  }
+  Bitmap128 expected[RANK_COUNT];
+  buildNewRankStates(stopSwitchStates, keyboardStates, expected);
+  for (byte rank = 0; rank < RANK_COUNT; rank++)
+  {
+    result.wrongPipes += (expected[rank] ^ pipes[rank]).count();
+    result.wrongPipes += (expected[rank] ^ core.rankBanks[core.committedBank][rank]).count();
+  }
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = 20;
+  int events = 200000;
+  uint64_t seed = 1;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--rounds") && i + 1 < argc)
+    {
+      rounds = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--events") && i + 1 < argc)
+    {
+      events = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+    {
+      seed = strtoull(argv[++i], NULL, 0);
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--rounds N] [--events N] [--seed N]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t queueErrors = stressQueue(10000000);
+  printf("Queue:          10000000 values, %llu out of order or missing\n", (unsigned long long)queueErrors);
+
+  RoundResult total = {};
+  for (int round = 0; round < rounds; round++)
+  {
+    RoundResult result = stressPipeline(events, seed + round);
+    total.passes += result.passes;
+    total.pipeChanges += result.pipeChanges;
+    total.redundantChanges += result.redundantChanges;
+    total.wrongPipes += result.wrongPipes;
+    if (result.redundantChanges || result.wrongPipes)
+    {
+      printf("  !! Round %d (--seed %llu): %llu redundant changes, %llu wrong pipes\n", round,
+             (unsigned long long)(seed + round), (unsigned long long)result.redundantChanges,
+             (unsigned long long)result.wrongPipes);
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Pipeline:       %d rounds of %d key events, %llu routing passes, %llu pipe changes\n", rounds, events,
+         (unsigned long long)total.passes, (unsigned long long)total.pipeChanges);
+  printf("Divergences:    %llu (%.2f s)\n", (unsigned long long)(total.redundantChanges + total.wrongPipes), seconds);
+  return queueErrors || total.redundantChanges || total.wrongPipes ? 1 : 0;
+}
@@ -0,0 +1,76 @@
+"""
+LMNC Organ Brain - SRAM Budget Report
+
+Lists every variable in SRAM (.data and .bss) by size after the firmware links, with the total
+and what's left over for the stack out of the board's SRAM. On the Nano everything has to fit in
+2 KB, so this shows where it went: the output queues, the rank banks, the serial buffers inside
+the core's HardwareSerial objects and the MIDI Library's instances.
+
+The AVR envs in platformio.ini run it after every build with
+
+  extra_scripts = post:tools/ram_report.py
+
+It also runs on its own against an ELF that's already built:
+
+  python3 tools/ram_report.py .pio/build/nanoatmega328/firmware.elf [--nm avr-nm] [--ram 2048]
+"""
+import subprocess
+import sys
+
+RAM_SYMBOL_TYPES = "bBdD"  # .bss and .data, local and global
+
+
+def ram_symbols(nm, elf):
+    """(size, name) for every symbol in SRAM, biggest first"""
+    output = subprocess.run([nm, "--print-size", "--size-sort", "--demangle", elf],
+                            capture_output=True, text=True, check=True).stdout
+    symbols = []
+    for line in output.splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4 and fields[2] in RAM_SYMBOL_TYPES:
+            symbols.append((int(fields[1], 16), fields[3]))
+    symbols.sort(key=lambda symbol: -symbol[0])
+    return symbols
+
+
+def print_ram_report(nm, elf, ram_bytes):
+    symbols = ram_symbols(nm, elf)
+    total = sum(size for size, _ in symbols)
+    print()
+    print("SRAM budget (%s)" % elf)
+    for size, name in symbols:
+        print("  %6d  %s" % (size, name))
+    print("  ------")
+    print("  %6d  in %d variables" % (total, len(symbols)))
+    if ram_bytes:
+        print("  %6d  left for the stack and heap, out of %d" % (ram_bytes - total, ram_bytes))
+    print()
+
+
+def ram_report_action(source, target, env):
+    nm = env.subst("$CC").replace("gcc", "nm")
+    ram_bytes = int(env.BoardConfig().get("upload.maximum_ram_size", 0))
+    print_ram_report(nm, str(target[0]), ram_bytes)
+
+
+def main(args):
+    nm = "avr-nm"
+    ram = 0
+    if "--nm" in args:
+        nm = args.pop(args.index("--nm") + 1)
+        args.remove("--nm")
+    if "--ram" in args:
+        ram = int(args.pop(args.index("--ram") + 1))
+        args.remove("--ram")
+    if len(args) != 1:
+        sys.exit("usage: ram_report.py firmware.elf [--nm avr-nm] [--ram bytes]")
+    print_ram_report(nm, args[0], ram)
+
+
+try:
+    Import  # noqa: F821 - only defined when PlatformIO runs this as an extra script
+except NameError:
+    main(sys.argv[1:])
+else:
+    Import("env")  # noqa: F821
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", ram_report_action)  # noqa: F821